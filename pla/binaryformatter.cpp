@@ -25,41 +25,63 @@ namespace pla {
 
 BinaryFormatter::BinaryFormatter(void) {}
 
-BinaryFormatter::BinaryFormatter(const binary &b) : mData(b) {}
+BinaryFormatter::BinaryFormatter(const binary &b) : mView(&b) {}
+
+BinaryFormatter::BinaryFormatter(binary &&b) : mData(std::move(b)) {}
 
 binary BinaryFormatter::remaining(void) const {
-	return binary(mData.begin() + mReadPosition, mData.end());
+	const binary &s = source();
+	return binary(s.begin() + mReadPosition, s.end());
 }
 
-const binary &BinaryFormatter::data(void) const { return mData; }
+size_t BinaryFormatter::remainingSize(void) const { return source().size() - mReadPosition; }
+
+const binary &BinaryFormatter::data(void) const { return source(); }
 
-binary &BinaryFormatter::data(void) { return mData; }
+binary &BinaryFormatter::data(void) {
+	detach();
+	return mData;
+}
 
 binary &BinaryFormatter::data(const binary &data) {
+	mView = nullptr;
 	mData = data;
 	mReadPosition = 0;
 	return mData;
 }
 
-void BinaryFormatter::append(const binary &b) { mData.insert(mData.end(), b.begin(), b.end()); }
+void BinaryFormatter::append(const binary &b) {
+	detach();
+	mData.insert(mData.end(), b.begin(), b.end());
+}
 
 void BinaryFormatter::clear(void) {
+	mView = nullptr;
 	mData.clear();
 	mReadPosition = 0;
 }
 
 size_t BinaryFormatter::read(byte *data, size_t size) {
-	auto begin = mData.begin() + mReadPosition;
-	size = std::min(size, size_t(mData.end() - begin));
+	const binary &s = source();
+	auto begin = s.begin() + mReadPosition;
+	size = std::min(size, size_t(s.end() - begin));
 	std::copy(begin, begin + size, data);
 	mReadPosition += size;
 	return size;
 }
 
 void BinaryFormatter::write(const byte *data, size_t size) {
+	detach();
 	mData.insert(mData.end(), data, data + size);
 }
 
+void BinaryFormatter::detach(void) {
+	if (mView) {
+		mData = *mView;
+		mView = nullptr;
+	}
+}
+
 BinaryFormatter &BinaryFormatter::operator>>(binary &b) {
 	mReadFailed = (read(b.data(), b.size()) != b.size());
 	return *this;
@@ -30,9 +30,11 @@ namespace pla {
 class BinaryFormatter {
 public:
 	BinaryFormatter(void);
-	BinaryFormatter(const binary &b);
+	BinaryFormatter(const binary &b); // read in place, b must outlive the formatter
+	BinaryFormatter(binary &&b);
 
 	binary remaining(void) const;
+	size_t remainingSize(void) const;
 	const binary &data(void) const;
 	binary &data(void);
 	binary &data(const binary &data);
@@ -78,7 +80,11 @@ protected:
 	static uint32_t toBigEndian(uint32_t n);
 	static uint64_t toBigEndian(uint64_t n);
 
+	const binary &source(void) const { return mView ? *mView : mData; }
+	void detach(void); // copies viewed data before writing
+
 	binary mData;
+	const binary *mView = nullptr;
 	size_t mReadPosition = 0;
 	bool mReadFailed = false;
 };
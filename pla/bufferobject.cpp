@@ -24,17 +24,27 @@ namespace pla {
 
 BufferObject::BufferObject(GLenum type, GLenum usage, bool readable)
     : mType(type), mUsage(usage), mReadable(readable) {
+#ifdef HEADLESS
+	mReadable = true; // the cache is the only storage
+#else
 	glGenBuffers(1, &mBuffer);
+#endif
 }
 
 BufferObject::~BufferObject(void) {
+#ifndef HEADLESS
 	glDeleteBuffers(1, &mBuffer);
+#endif
 	delete[] mCache;
 }
 
 size_t BufferObject::size(void) const { return mSize; }
 
-void BufferObject::bind(void) { glBindBuffer(mType, mBuffer); }
+void BufferObject::bind(void) {
+#ifndef HEADLESS
+	glBindBuffer(mType, mBuffer);
+#endif
+}
 
 void *BufferObject::offset(size_t offset) { return reinterpret_cast<void *>(offset); }
 
@@ -45,8 +55,10 @@ void BufferObject::fill(const void *ptr, size_t size) {
 	}
 
 	mSize = size;
+#ifndef HEADLESS
 	glBindBuffer(mType, mBuffer);
 	glBufferData(mType, size, ptr, mUsage);
+#endif
 
 	if (mReadable) {
 		delete[] mCache;
@@ -59,8 +71,10 @@ void BufferObject::replace(size_t offset, const void *ptr, size_t size) {
 	if (size == 0)
 		return;
 
+#ifndef HEADLESS
 	glBindBuffer(mType, mBuffer);
 	glBufferSubData(mType, offset, size, ptr);
+#endif
 
 	if (mCache)
 		std::memcpy(mCache + offset, ptr, size);
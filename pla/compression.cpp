@@ -0,0 +1,174 @@
+/*************************************************************************
+ *   Copyright (C) 2017-2018 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of Plateform.                                     *
+ *                                                                       *
+ *   Plateform is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   Plateform is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with Plateform.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+#include "pla/compression.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+namespace pla {
+
+namespace {
+
+// Each sequence is a token with literal and match length nibbles, the extended literal length,
+// the literals, a 2-byte match offset and the extended match length. The last one has no match.
+const size_t MinMatch = 4;
+const size_t MaxOffset = 0xFFFF;
+const int HashBits = 12;
+
+uint32_t read32(const uint8_t *p) {
+	uint32_t v;
+	std::memcpy(&v, p, 4);
+	return v;
+}
+
+size_t hash(uint32_t v) { return (v * 2654435761u) >> (32 - HashBits); }
+
+void writeLength(binary &out, size_t length) {
+	while (length >= 255) {
+		out.push_back(byte(255));
+		length -= 255;
+	}
+	out.push_back(byte(length));
+}
+
+void writeSequence(binary &out, const uint8_t *literals, size_t literalsLength, size_t offset,
+                   size_t matchLength) {
+	const size_t ml = matchLength ? matchLength - MinMatch : 0;
+	out.push_back(byte(std::min(literalsLength, size_t(15)) << 4 | std::min(ml, size_t(15))));
+	if (literalsLength >= 15)
+		writeLength(out, literalsLength - 15);
+
+	const byte *l = reinterpret_cast<const byte *>(literals);
+	out.insert(out.end(), l, l + literalsLength);
+	if (!matchLength)
+		return;
+
+	out.push_back(byte(offset & 0xFF));
+	out.push_back(byte(offset >> 8));
+	if (ml >= 15)
+		writeLength(out, ml - 15);
+}
+
+bool readLength(const uint8_t *&p, const uint8_t *end, size_t &length) {
+	uint8_t b;
+	do {
+		if (p == end)
+			return false;
+		b = *p++;
+		length += b;
+	} while (b == 255);
+	return true;
+}
+
+} // namespace
+
+binary compress(const binary &data) {
+	const size_t size = data.size();
+	binary out;
+	out.reserve(4 + size + size / 255 + 16);
+	for (int i = 0; i < 4; ++i)
+		out.push_back(byte((size >> (8 * i)) & 0xFF));
+
+	const uint8_t *in = reinterpret_cast<const uint8_t *>(data.data());
+	std::array<uint32_t, 1 << HashBits> table;
+	table.fill(uint32_t(-1));
+
+	size_t anchor = 0;
+	size_t i = 0;
+	while (size >= MinMatch && i <= size - MinMatch) {
+		const uint32_t v = read32(in + i);
+		const size_t h = hash(v);
+		const size_t candidate = table[h];
+		table[h] = uint32_t(i);
+		if (candidate == uint32_t(-1) || i - candidate > MaxOffset || read32(in + candidate) != v) {
+			++i;
+			continue;
+		}
+
+		size_t length = MinMatch;
+		while (i + length < size && in[candidate + length] == in[i + length])
+			++length;
+
+		writeSequence(out, in + anchor, i - anchor, i - candidate, length);
+		i += length;
+		anchor = i;
+	}
+
+	writeSequence(out, in + anchor, size - anchor, 0, 0);
+	return out;
+}
+
+std::optional<binary> decompress(const binary &data, size_t maxSize) {
+	if (data.size() < 4)
+		return std::nullopt;
+
+	size_t size = 0;
+	for (int i = 0; i < 4; ++i)
+		size |= size_t(to_integer<uint8_t>(data[i])) << (8 * i);
+	if (size > maxSize)
+		return std::nullopt;
+
+	binary out(size);
+	uint8_t *o = reinterpret_cast<uint8_t *>(out.data());
+	size_t pos = 0;
+
+	const uint8_t *p = reinterpret_cast<const uint8_t *>(data.data()) + 4;
+	const uint8_t *end = reinterpret_cast<const uint8_t *>(data.data()) + data.size();
+	while (p != end) {
+		const uint8_t token = *p++;
+		size_t literalsLength = token >> 4;
+		if (literalsLength == 15 && !readLength(p, end, literalsLength))
+			return std::nullopt;
+		if (literalsLength > size_t(end - p) || literalsLength > size - pos)
+			return std::nullopt;
+
+		std::copy(p, p + literalsLength, o + pos);
+		p += literalsLength;
+		pos += literalsLength;
+		if (p == end)
+			break; // last sequence
+
+		if (end - p < 2)
+			return std::nullopt;
+		const size_t offset = size_t(p[0]) | size_t(p[1]) << 8;
+		p += 2;
+
+		size_t matchLength = token & 0x0F;
+		if (matchLength == 15 && !readLength(p, end, matchLength))
+			return std::nullopt;
+		matchLength += MinMatch;
+		if (offset == 0 || offset > pos || matchLength > size - pos)
+			return std::nullopt;
+
+		// Copy byte by byte as the match may overlap its output
+		for (size_t k = 0; k < matchLength; ++k, ++pos)
+			o[pos] = o[pos - offset];
+	}
+
+	if (pos != size)
+		return std::nullopt;
+
+	return out;
+}
+
+} // namespace pla
@@ -0,0 +1,39 @@
+/*************************************************************************
+ *   Copyright (C) 2017-2018 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of Plateform.                                     *
+ *                                                                       *
+ *   Plateform is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   Plateform is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with Plateform.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+#ifndef PLA_COMPRESSION_H
+#define PLA_COMPRESSION_H
+
+#include "pla/binary.hpp"
+#include "pla/include.hpp"
+
+#include <optional>
+
+namespace pla {
+
+// Fast LZ77 compression in the spirit of LZ4, suited to small payloads with long runs.
+// The output starts with the uncompressed size, decompression fails on malformed input.
+binary compress(const binary &data);
+std::optional<binary> decompress(const binary &data, size_t maxSize);
+
+} // namespace pla
+
+#endif
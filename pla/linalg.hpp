@@ -43,6 +43,10 @@ using glm::dvec2;
 using glm::dvec3;
 using glm::dvec4;
 
+using glm::ivec2;
+using glm::ivec3;
+using glm::ivec4;
+
 using glm::quat;
 
 extern const float Pi;
@@ -24,7 +24,9 @@
 namespace pla {
 
 Mesh::Mesh(void) {
+#ifndef HEADLESS
 	glGenVertexArrays(1, &mVertexArray);
+#endif
 
 	mIndexBuffer = std::make_shared<IndexBuffer>(new IndexBufferObject(true)); // readable
 }
@@ -36,7 +38,11 @@ Mesh::Mesh(const index_t *indices, size_t nindices, const float *vertices, size_
 	computeRadius();
 }
 
-Mesh::~Mesh(void) { glDeleteVertexArrays(1, &mVertexArray); }
+Mesh::~Mesh(void) {
+#ifndef HEADLESS
+	glDeleteVertexArrays(1, &mVertexArray);
+#endif
+}
 
 void Mesh::setIndices(const index_t *indices, size_t count) {
 	if (indices) {
@@ -91,6 +97,7 @@ void Mesh::setVertexAttrib(unsigned layout, const unsigned char *attribs, size_t
 }
 
 void Mesh::updateVertexAttrib(unsigned layout, sptr<Attrib> attrib) {
+#ifndef HEADLESS
 	glBindVertexArray(mVertexArray);
 	glEnableVertexAttribArray(layout);
 	attrib->bind();
@@ -100,17 +107,32 @@ void Mesh::updateVertexAttrib(unsigned layout, sptr<Attrib> attrib) {
 	                      attrib->normalize, // normalize
 	                      0,                 // stride
 	                      NULL);
+#endif
 	if (layout == 0)
 		computeRadius();
 }
 
 void Mesh::unsetVertexAttrib(unsigned layout) {
+#ifndef HEADLESS
 	glBindVertexArray(mVertexArray);
 	glDisableVertexAttribArray(layout);
+#endif
 
 	mAttribBuffers.erase(layout);
 }
 
+void Mesh::clear(void) {
+#ifndef HEADLESS
+	glBindVertexArray(mVertexArray);
+	for (const auto &[layout, attrib] : mAttribBuffers)
+		glDisableVertexAttribArray(layout);
+#endif
+
+	mAttribBuffers.clear();
+	mIndexBuffer->fill(NULL, 0);
+	mRadius = -1.f;
+}
+
 size_t Mesh::indicesCount(void) const { return mIndexBuffer->count(); }
 
 size_t Mesh::vertexAttribCount(unsigned layout) const {
@@ -129,6 +151,13 @@ int Mesh::vertexAttribSize(unsigned layout) const {
 		return 0;
 }
 
+size_t Mesh::bufferSize(void) const {
+	size_t size = mIndexBuffer->count() * sizeof(index_t);
+	for (const auto &[layout, attrib] : mAttribBuffers)
+		size += attrib->bytes();
+	return size;
+}
+
 void Mesh::optimize(unsigned layout) {
 	auto it = mAttribBuffers.find(layout);
 	if (it == mAttribBuffers.end())
@@ -226,9 +255,11 @@ float Mesh::getRadius(void) const { return mRadius; }
 int Mesh::drawElements(void) { return drawElements(0, mIndexBuffer->count()); }
 
 int Mesh::drawElements(index_t first, index_t count) const {
+#ifndef HEADLESS
 	glBindVertexArray(mVertexArray);
 	mIndexBuffer->bind();
 	glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_INT, mIndexBuffer->offset(first));
+#endif
 	return count / 3;
 }
 
@@ -50,10 +50,12 @@ public:
 	void setVertexAttrib(unsigned layout, const unsigned char *attribs, size_t count = 0,
 	                     int size = 1, bool normalize = false);
 	void unsetVertexAttrib(unsigned layout);
+	void clear(void);
 
 	size_t indicesCount(void) const;
 	size_t vertexAttribCount(unsigned layout = 0) const;
 	int vertexAttribSize(unsigned layout = 0) const;
+	size_t bufferSize(void) const; // in bytes
 
 	void optimize(unsigned layout = 0);
 	void computeNormals(unsigned normalLayout = 1, unsigned layout = 0);
@@ -77,6 +79,7 @@ protected:
 		GLboolean normalize = GL_FALSE;
 
 		virtual size_t count(void) const = 0;
+		virtual size_t bytes(void) const = 0;
 		virtual void fill(const void *attribs, size_t count) = 0;
 		virtual void bind(void) = 0;
 		virtual void *data(void) = 0;
@@ -92,6 +95,8 @@ protected:
 
 		size_t count(void) const { return buffer->count(); }
 
+		size_t bytes(void) const { return buffer ? buffer->count() * sizeof(T) : 0; }
+
 		void fill(const void *attribs, size_t count) {
 			if (!buffer)
 				buffer = std::make_shared<AttribBuffer>(new AttribBufferObject(layout == 0));
@@ -21,13 +21,27 @@
 #ifndef PLA_OPENGL_H
 #define PLA_OPENGL_H
 
-#ifdef USE_OPENGL_ES
+#if defined(HEADLESS)
+// No OpenGL in headless mode, only define the types and constants used by buffers and meshes
+typedef unsigned int GLenum;
+typedef unsigned int GLuint;
+typedef unsigned char GLboolean;
+#define GL_FALSE 0
+#define GL_TRUE 1
+#define GL_BYTE 0x1400
+#define GL_UNSIGNED_BYTE 0x1401
+#define GL_INT 0x1404
+#define GL_FLOAT 0x1406
+#define GL_ARRAY_BUFFER 0x8892
+#define GL_ELEMENT_ARRAY_BUFFER 0x8893
+#define GL_DYNAMIC_DRAW 0x88E8
+#elif defined(USE_OPENGL_ES)
 #define GLFW_INCLUDE_ES3
+#include <GLFW/glfw3.h>
 #else
 #include <GL/glew.h>
-#endif
-
 #include <GLFW/glfw3.h>
+#endif
 
 #include <memory>
 
@@ -24,11 +24,157 @@
 #include <iostream>
 #include <random>
 
+// PLA_NO_SIMD forces the scalar lanes, so they can be tested where SIMD is available
+#if (defined(__AVX2__) || defined(__SSE2__)) && !defined(PLA_NO_SIMD)
+#include <immintrin.h>
+#endif
+
 namespace pla {
 
 using pla::bounds;
 using std::pow;
 
+namespace {
+
+// Lane implementations for batch evaluation, the widest available one is used for the bulk of
+// each row while the scalar one handles the remainder and serves as fallback (e.g. Emscripten)
+struct ScalarLanes {
+	static const int Count = 1;
+	using floatv = float;
+	using intv = int;
+	using maskv = bool;
+
+	static floatv load(const float *p) { return *p; }
+	static intv load(const int *p) { return *p; }
+	static void store(float *p, floatv v) { *p = v; }
+	static floatv set(float f) { return f; }
+	static floatv add(floatv a, floatv b) { return a + b; }
+	static floatv sub(floatv a, floatv b) { return a - b; }
+	static floatv mul(floatv a, floatv b) { return a * b; }
+	static intv mask(intv h, int m) { return h & m; }
+	static maskv less(intv h, int n) { return h < n; }
+	static maskv equal(intv h, int n) { return h == n; }
+	static maskv either(maskv a, maskv b) { return a || b; }
+	static floatv select(maskv m, floatv a, floatv b) { return m ? a : b; }
+	static floatv negate(floatv a, intv h, int bit) { return (h & bit) == 0 ? a : -a; }
+};
+
+#if defined(__AVX2__) && !defined(PLA_NO_SIMD)
+struct SimdLanes {
+	static const int Count = 8;
+	using floatv = __m256;
+	using intv = __m256i;
+	using maskv = __m256;
+
+	static floatv load(const float *p) { return _mm256_loadu_ps(p); }
+	static intv load(const int *p) { return _mm256_loadu_si256(reinterpret_cast<const intv *>(p)); }
+	static void store(float *p, floatv v) { _mm256_storeu_ps(p, v); }
+	static floatv set(float f) { return _mm256_set1_ps(f); }
+	static floatv add(floatv a, floatv b) { return _mm256_add_ps(a, b); }
+	static floatv sub(floatv a, floatv b) { return _mm256_sub_ps(a, b); }
+	static floatv mul(floatv a, floatv b) { return _mm256_mul_ps(a, b); }
+	static intv mask(intv h, int m) { return _mm256_and_si256(h, _mm256_set1_epi32(m)); }
+	static maskv less(intv h, int n) {
+		return _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(n), h));
+	}
+	static maskv equal(intv h, int n) {
+		return _mm256_castsi256_ps(_mm256_cmpeq_epi32(h, _mm256_set1_epi32(n)));
+	}
+	static maskv either(maskv a, maskv b) { return _mm256_or_ps(a, b); }
+	static floatv select(maskv m, floatv a, floatv b) {
+		return _mm256_or_ps(_mm256_and_ps(m, a), _mm256_andnot_ps(m, b));
+	}
+	static floatv negate(floatv a, intv h, int bit) {
+		const intv b = _mm256_set1_epi32(bit);
+		const maskv m = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(h, b), b));
+		return _mm256_xor_ps(a, _mm256_and_ps(m, _mm256_set1_ps(-0.f)));
+	}
+};
+#elif defined(__SSE2__) && !defined(PLA_NO_SIMD)
+struct SimdLanes {
+	static const int Count = 4;
+	using floatv = __m128;
+	using intv = __m128i;
+	using maskv = __m128;
+
+	static floatv load(const float *p) { return _mm_loadu_ps(p); }
+	static intv load(const int *p) { return _mm_loadu_si128(reinterpret_cast<const intv *>(p)); }
+	static void store(float *p, floatv v) { _mm_storeu_ps(p, v); }
+	static floatv set(float f) { return _mm_set1_ps(f); }
+	static floatv add(floatv a, floatv b) { return _mm_add_ps(a, b); }
+	static floatv sub(floatv a, floatv b) { return _mm_sub_ps(a, b); }
+	static floatv mul(floatv a, floatv b) { return _mm_mul_ps(a, b); }
+	static intv mask(intv h, int m) { return _mm_and_si128(h, _mm_set1_epi32(m)); }
+	static maskv less(intv h, int n) {
+		return _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(n)));
+	}
+	static maskv equal(intv h, int n) {
+		return _mm_castsi128_ps(_mm_cmpeq_epi32(h, _mm_set1_epi32(n)));
+	}
+	static maskv either(maskv a, maskv b) { return _mm_or_ps(a, b); }
+	static floatv select(maskv m, floatv a, floatv b) {
+		return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b));
+	}
+	static floatv negate(floatv a, intv h, int bit) {
+		const intv b = _mm_set1_epi32(bit);
+		const maskv m = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(h, b), b));
+		return _mm_xor_ps(a, _mm_and_ps(m, _mm_set1_ps(-0.f)));
+	}
+};
+#else
+using SimdLanes = ScalarLanes;
+#endif
+
+// Lattice row along z, x and y are fixed
+struct Row {
+	float x, y; // relative position in cube
+	float u, v; // fade curves
+	const float *z;
+	const float *w;
+	const int *hashes[8]; // hashes of the 8 cube corners
+};
+
+template <typename L>
+typename L::floatv gradLanes(typename L::intv h, typename L::floatv x, typename L::floatv y,
+                             typename L::floatv z) {
+	// Convert lower 4 bits of hash into 12 gradient directions like grad()
+	h = L::mask(h, 15);
+	auto u = L::select(L::less(h, 8), x, y);
+	auto xz = L::select(L::either(L::equal(h, 12), L::equal(h, 14)), x, z);
+	auto v = L::select(L::less(h, 4), y, xz);
+	return L::add(L::negate(u, h, 1), L::negate(v, h, 2));
+}
+
+template <typename L>
+typename L::floatv lerpLanes(typename L::floatv t, typename L::floatv a, typename L::floatv b) {
+	return L::add(a, L::mul(t, L::sub(b, a)));
+}
+
+template <typename L> void accumulateLanes(const Row &row, int k, float weight, float *out) {
+	using floatv = typename L::floatv;
+	const floatv one = L::set(1.f);
+	const floatv x = L::set(row.x), x1 = L::sub(x, one);
+	const floatv y = L::set(row.y), y1 = L::sub(y, one);
+	const floatv z = L::load(row.z + k), z1 = L::sub(z, one);
+	const floatv u = L::set(row.u), v = L::set(row.v), w = L::load(row.w + k);
+
+	auto grad = [&row, k](int c, floatv x, floatv y, floatv z) {
+		return gradLanes<L>(L::load(row.hashes[c] + k), x, y, z);
+	};
+
+	// Same blending as PerlinNoise::noise()
+	const floatv res =
+	    lerpLanes<L>(w,
+	                 lerpLanes<L>(v, lerpLanes<L>(u, grad(0, x, y, z), grad(1, x1, y, z)),
+	                              lerpLanes<L>(u, grad(2, x, y1, z), grad(3, x1, y1, z))),
+	                 lerpLanes<L>(v, lerpLanes<L>(u, grad(4, x, y, z1), grad(5, x1, y, z1)),
+	                              lerpLanes<L>(u, grad(6, x, y1, z1), grad(7, x1, y1, z1))));
+
+	L::store(out + k, L::add(L::load(out + k), L::mul(L::set(weight), res)));
+}
+
+} // namespace
+
 // Compute permutation vector from seed
 std::vector<int> make_perm(unsigned int seed, int period) {
 	std::vector<int> p(period);
@@ -62,6 +208,84 @@ double PerlinNoise::generate(const dvec3 &v, int octaves) const {
 	return norm > 0. ? value / norm : 0.;
 }
 
+void PerlinNoise::generateGrid(const dvec3 &origin, const dvec3 &step, const ivec3 &dims,
+                               int octaves, float *out) const {
+	if (dims.x <= 0 || dims.y <= 0 || dims.z <= 0)
+		return;
+
+	const size_t count = size_t(dims.x) * size_t(dims.y) * size_t(dims.z);
+	std::fill(out, out + count, 0.f);
+
+	int pw = 1;
+	double norm = 0.;
+	for (int i = 0; i < octaves; ++i) {
+		const double n = 0.5 / pw;
+		accumulateGrid(origin * double(pw), step * double(pw), dims, float(n), out);
+		pw *= 2;
+		norm += n;
+	}
+
+	// Map to [0, 1] like noise()
+	const float scale = norm > 0. ? float(0.5 / norm) : 0.f;
+	const float bias = norm > 0. ? 0.5f : 0.f;
+	for (size_t i = 0; i < count; ++i)
+		out[i] = out[i] * scale + bias;
+}
+
+void PerlinNoise::accumulateGrid(const dvec3 &origin, const dvec3 &step, const ivec3 &dims,
+                                 float weight, float *out) const {
+	// Positions along z are shared by all rows
+	std::vector<int> Z(dims.z);
+	std::vector<float> z(dims.z), w(dims.z);
+	for (int k = 0; k < dims.z; ++k) {
+		const double p = origin.z + step.z * k;
+		Z[k] = int(floor(p));
+		z[k] = float(p - floor(p));
+		w[k] = float(fade(p - floor(p)));
+	}
+
+	std::vector<int> hashes(8 * dims.z);
+	Row row;
+	row.z = z.data();
+	row.w = w.data();
+	for (int c = 0; c < 8; ++c)
+		row.hashes[c] = hashes.data() + c * dims.z;
+
+	for (int i = 0; i < dims.x; ++i) {
+		const double px = origin.x + step.x * i;
+		const int X = int(floor(px));
+		row.x = float(px - floor(px));
+		row.u = float(fade(px - floor(px)));
+
+		for (int j = 0; j < dims.y; ++j) {
+			const double py = origin.y + step.y * j;
+			const int Y = int(floor(py));
+			row.y = float(py - floor(py));
+			row.v = float(fade(py - floor(py)));
+
+			// Corners in the order of noise(), hash(AA), hash(BA), hash(AB), hash(BB) without Z
+			const int A = hash(X) + Y;
+			const int B = hash(X + 1) + Y;
+			const int corners[4] = {hash(A), hash(B), hash(A + 1), hash(B + 1)};
+			for (int c = 0; c < 4; ++c) {
+				int *lower = hashes.data() + c * dims.z;
+				int *upper = hashes.data() + (c + 4) * dims.z;
+				for (int k = 0; k < dims.z; ++k) {
+					lower[k] = hash(corners[c] + Z[k]);
+					upper[k] = hash(corners[c] + Z[k] + 1);
+				}
+			}
+
+			float *o = out + (size_t(i) * dims.y + j) * dims.z;
+			int k = 0;
+			for (; k + SimdLanes::Count <= dims.z; k += SimdLanes::Count)
+				accumulateLanes<SimdLanes>(row, k, weight, o);
+			for (; k < dims.z; ++k)
+				accumulateLanes<ScalarLanes>(row, k, weight, o);
+		}
+	}
+}
+
 double PerlinNoise::noise(double x, double y, double z, int m) const {
 	// Find the unit cube that contains the point
 	int X = floor(x);
@@ -111,6 +335,8 @@ double PerlinNoise::grad(int h, double x, double y, double z) const {
 int PerlinNoise::hash(int i) const {
 	// Circumvent modulo implementation for negative values with an offset
 	const unsigned offset = 0x80000000;
+	if ((mPeriod & (mPeriod - 1)) == 0)
+		return mPerm[unsigned(offset + i) & unsigned(mPeriod - 1)]; // avoid division
 	return mPerm[unsigned(offset + i) % mPeriod];
 }
 
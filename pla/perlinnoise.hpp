@@ -33,7 +33,14 @@ public:
 	PerlinNoise(unsigned int seed, int period = 256);
 	double generate(const dvec3 &v, int octaves = 1) const;
 
+	// Batch evaluation on the lattice origin + step * (i, j, k) in single precision,
+	// out must hold dims.x * dims.y * dims.z values indexed by (i * dims.y + j) * dims.z + k
+	void generateGrid(const dvec3 &origin, const dvec3 &step, const ivec3 &dims, int octaves,
+	                  float *out) const;
+
 private:
+	void accumulateGrid(const dvec3 &origin, const dvec3 &step, const ivec3 &dims, float weight,
+	                    float *out) const;
 	double noise(double x, double y, double z, int m) const;
 	double fade(double t) const;
 	double lerp(double t, double a, double b) const;
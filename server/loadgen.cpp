@@ -0,0 +1,161 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+// Load generator for convergence-server: simulated peers join, then send timestamped messages to
+// random other peers, and the forwarding latency is measured on reception
+
+#include "src/message.hpp"
+
+#include "rtc/websocket.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+using convergence::identifier;
+using convergence::Message;
+using pla::binary;
+using std::byte;
+
+using clock_type = std::chrono::steady_clock;
+
+const size_t PayloadSize = 64;
+
+int main(int argc, char *argv[]) {
+	try {
+		const std::string url = argc > 1 ? argv[1] : "ws://127.0.0.1:8080/test";
+		const int count = argc > 2 ? std::stoi(argv[2]) : 1000;
+		const double duration = argc > 3 ? std::stod(argv[3]) : 10.;
+		const double rate = argc > 4 ? std::stod(argv[4]) : 10.; // messages per second per peer
+
+		std::mt19937 rng(std::random_device{}());
+		auto randomId = [&rng]() {
+			binary id(16);
+			std::generate(id.begin(), id.end(), [&rng]() { return byte(rng()); });
+			return identifier(id);
+		};
+
+		std::atomic<int> joined = 0;
+		std::atomic<size_t> received = 0;
+		std::vector<double> latencies;
+		std::mutex latenciesMutex;
+
+		std::vector<identifier> ids;
+		std::vector<std::shared_ptr<rtc::WebSocket>> webSockets;
+		for (int i = 0; i < count; ++i) {
+			identifier id = randomId();
+			auto webSocket = std::make_shared<rtc::WebSocket>();
+			webSocket->onOpen([webSocket, id]() {
+				Message message(Message::Join);
+				message.source = id;
+				webSocket->send(binary(message));
+			});
+
+			webSocket->onMessage(
+			    [&](binary data) {
+				    Message message(std::move(data));
+				    if (message.type == Message::List) {
+					    ++joined;
+				    } else if (message.payload.size() >= sizeof(int64_t)) {
+					    int64_t sent;
+					    std::memcpy(&sent, message.payload.data(), sizeof(sent));
+					    const auto now = clock_type::now().time_since_epoch();
+					    const double latency =
+					        std::chrono::duration<double>(now - clock_type::duration(sent)).count();
+					    ++received;
+					    std::lock_guard<std::mutex> lock(latenciesMutex);
+					    latencies.push_back(latency);
+				    }
+			    },
+			    [](const std::string &) {});
+
+			webSocket->onError([](const std::string &error) {
+				std::cerr << "WebSocket error: " << error << std::endl;
+			});
+
+			webSocket->open(url);
+			ids.push_back(std::move(id));
+			webSockets.push_back(std::move(webSocket));
+		}
+
+		const auto joinDeadline = clock_type::now() + std::chrono::seconds(30);
+		while (joined < count && clock_type::now() < joinDeadline)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+		std::cout << joined << " of " << count << " peers joined" << std::endl;
+		if (joined < 2)
+			return 1;
+
+		// Messages are spread evenly over the run
+		std::uniform_int_distribution<int> peerDist(0, count - 1);
+		const auto start = clock_type::now();
+		size_t sent = 0;
+		while (true) {
+			const double elapsed = std::chrono::duration<double>(clock_type::now() - start).count();
+			if (elapsed >= duration)
+				break;
+
+			const size_t target = size_t(elapsed * rate * count);
+			while (sent < target) {
+				const int from = peerDist(rng);
+				int to = peerDist(rng);
+				if (to == from)
+					to = (to + 1) % count;
+
+				Message message(Message::Dummy);
+				message.source = ids[from];
+				message.destination = ids[to];
+				message.payload.resize(PayloadSize);
+				const int64_t now = clock_type::now().time_since_epoch().count();
+				std::memcpy(message.payload.data(), &now, sizeof(now));
+				webSockets[from]->send(binary(message));
+				++sent;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		std::this_thread::sleep_for(std::chrono::seconds(1)); // messages in flight
+
+		std::lock_guard<std::mutex> lock(latenciesMutex);
+		std::sort(latencies.begin(), latencies.end());
+		auto percentile = [&](double p) {
+			return latencies.empty() ? 0. : latencies[size_t(p * (latencies.size() - 1))] * 1000.;
+		};
+		std::cout << "Sent " << sent << " messages, received " << received << ", "
+		          << size_t(received / duration) << " messages/s" << std::endl;
+		std::cout << "Latency p50 " << percentile(0.5) << " ms, p99 " << percentile(0.99)
+		          << " ms, max " << percentile(1.) << " ms" << std::endl;
+
+		for (auto &webSocket : webSockets)
+			webSocket->close();
+
+	} catch (const std::exception &e) {
+		std::cout << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
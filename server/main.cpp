@@ -0,0 +1,89 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+// Signaling and relay server, a native replacement for server.py
+
+#include "server/relay.hpp"
+
+#include "rtc/websocket.hpp"
+#include "rtc/websocketserver.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+using convergence::Relay;
+
+std::atomic<bool> running(true);
+
+void stop(int) { running = false; }
+
+int main(int argc, char *argv[]) {
+	try {
+		const uint16_t port = argc > 1 ? uint16_t(std::stoul(argv[1])) : 8080;
+		const unsigned threads = argc > 2 ? unsigned(std::stoul(argv[2])) : 0;
+		const std::string bindAddress = argc > 3 ? argv[3] : "127.0.0.1";
+
+		std::signal(SIGINT, stop);
+		std::signal(SIGTERM, stop);
+
+		auto relay = std::make_shared<Relay>(threads);
+
+		rtc::WebSocketServer::Configuration config;
+		config.port = port;
+		config.bindAddress = bindAddress;
+		rtc::WebSocketServer server(config);
+		server.onClient(
+		    [relay](std::shared_ptr<rtc::WebSocket> webSocket) { relay->addClient(webSocket); });
+
+		std::cout << "Listening on port " << server.port() << " with " << threads
+		          << " forwarding threads" << std::endl;
+
+		using clock = std::chrono::steady_clock;
+		const auto period = std::chrono::seconds(10);
+		auto last = clock::now();
+		size_t forwarded = 0;
+		while (running) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			const auto now = clock::now();
+			if (now - last < period)
+				continue;
+
+			auto stats = relay->stats();
+			const double rate =
+			    (stats.forwarded - forwarded) / std::chrono::duration<double>(now - last).count();
+			std::cout << "Peers: " << stats.peers << ", forwarded " << size_t(rate)
+			          << " messages/s, dropped " << stats.dropped << std::endl;
+			forwarded = stats.forwarded;
+			last = now;
+		}
+
+		server.stop();
+
+	} catch (const std::exception &e) {
+		std::cout << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
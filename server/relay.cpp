@@ -0,0 +1,193 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+#include "server/relay.hpp"
+#include "src/message.hpp"
+
+#include "pla/binaryformatter.hpp"
+
+namespace convergence {
+
+using pla::BinaryFormatter;
+using pla::to_hex;
+
+// Type, size, source, destination
+const size_t HeaderSize = 4 + 4 + 16 + 16;
+const size_t DestinationOffset = 4 + 4 + 16;
+const uint32_t TypeMask = 0x7FFFFFFF; // without the compression flag
+
+Relay::Relay(unsigned threads) {
+	for (unsigned i = 0; i < threads; ++i) {
+		auto worker = std::make_unique<Worker>();
+		worker->thread = std::thread(&Relay::runWorker, this, std::ref(*worker));
+		mWorkers.push_back(std::move(worker));
+	}
+}
+
+Relay::~Relay(void) {
+	for (auto &worker : mWorkers) {
+		{
+			std::lock_guard<std::mutex> lock(worker->mutex);
+			worker->stopped = true;
+		}
+		worker->condition.notify_all();
+		worker->thread.join();
+	}
+}
+
+void Relay::addClient(shared_ptr<Channel> channel) {
+	{
+		std::unique_lock<std::shared_mutex> lock(mPeersMutex);
+		mClients.emplace(channel, identifier());
+	}
+
+	weak_ptr<Channel> weak = channel;
+	channel->onMessage(
+	    [this, weak](binary data) {
+		    // This is called on network threads
+		    if (auto channel = weak.lock())
+			    onMessage(channel, std::move(data));
+	    },
+	    [](const string &data) {
+		    // Ignore
+	    });
+
+	channel->onClosed([this, weak]() {
+		if (auto channel = weak.lock())
+			onClosed(channel);
+	});
+}
+
+Relay::Stats Relay::stats(void) const {
+	Stats stats;
+	{
+		std::shared_lock<std::shared_mutex> lock(mPeersMutex);
+		stats.peers = mPeers.size();
+	}
+	stats.forwarded = mForwarded.load();
+	stats.dropped = mDropped.load();
+	return stats;
+}
+
+void Relay::onMessage(shared_ptr<Channel> channel, binary data) {
+	// Only the header is read, the buffer is forwarded untouched
+	uint32_t type = 0, size = 0;
+	identifier source;
+	BinaryFormatter formatter(data);
+	if (data.size() < HeaderSize || !(formatter >> type >> size >> source)) {
+		++mDropped;
+		return;
+	}
+
+	if ((type & TypeMask) == Message::Join) {
+		join(channel, source);
+		return;
+	}
+
+	if (mWorkers.empty()) {
+		forward(std::move(data));
+		return;
+	}
+
+	auto &worker = *mWorkers[binary_hash()(source) % mWorkers.size()];
+	{
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		worker.queue.push_back(std::move(data));
+	}
+	worker.condition.notify_one();
+}
+
+void Relay::onClosed(shared_ptr<Channel> channel) {
+	std::unique_lock<std::shared_mutex> lock(mPeersMutex);
+	auto it = mClients.find(channel);
+	if (it == mClients.end())
+		return;
+
+	const identifier id = it->second;
+	mClients.erase(it);
+
+	auto jt = mPeers.find(id);
+	if (jt != mPeers.end() && jt->second == channel) {
+		mPeers.erase(jt);
+		std::cout << "Peer left: " << to_hex(id) << ", total " << mPeers.size() << " peers"
+		          << std::endl;
+	}
+}
+
+void Relay::join(shared_ptr<Channel> channel, const identifier &id) {
+	// The joining peer gets the list of the others, which then learn about it from its messages
+	Message message(Message::List);
+	message.destination = id;
+	{
+		std::unique_lock<std::shared_mutex> lock(mPeersMutex);
+		mPeers[id] = channel;
+		mClients[channel] = id;
+		for (const auto &[peer, other] : mPeers)
+			if (peer != id)
+				message.payload.insert(message.payload.end(), peer.begin(), peer.end());
+
+		std::cout << "Peer joined: " << to_hex(id) << ", total " << mPeers.size() << " peers"
+		          << std::endl;
+	}
+
+	channel->send(binary(message));
+}
+
+void Relay::forward(binary data) {
+	identifier destination(
+	    binary(data.begin() + DestinationOffset, data.begin() + DestinationOffset + 16));
+
+	shared_ptr<Channel> channel;
+	{
+		std::shared_lock<std::shared_mutex> lock(mPeersMutex);
+		auto it = mPeers.find(destination);
+		if (it != mPeers.end())
+			channel = it->second;
+	}
+
+	if (!channel) {
+		++mDropped;
+		return;
+	}
+
+	channel->send(std::move(data)); // the buffer is moved, not copied
+	++mForwarded;
+}
+
+void Relay::runWorker(Worker &worker) {
+	std::deque<binary> batch;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(worker.mutex);
+			worker.condition.wait(lock, [&]() { return worker.stopped || !worker.queue.empty(); });
+			if (worker.queue.empty())
+				return;
+
+			std::swap(batch, worker.queue);
+		}
+
+		for (auto &data : batch)
+			forward(std::move(data));
+
+		batch.clear();
+	}
+}
+
+} // namespace convergence
@@ -0,0 +1,84 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+#ifndef CONVERGENCE_RELAY_H
+#define CONVERGENCE_RELAY_H
+
+#include "src/identifier.hpp"
+#include "src/include.hpp"
+
+#include "rtc/channel.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+namespace convergence {
+
+using rtc::Channel;
+
+// Signaling server core, with the same behavior as server.py: a join registers the source and is
+// answered with the list of other peers, any other message is forwarded as is to its destination.
+class Relay {
+public:
+	struct Stats {
+		size_t peers;
+		size_t forwarded;
+		size_t dropped; // invalid or without a connected destination
+	};
+
+	Relay(unsigned threads = 0); // forwarding threads, 0 to forward on the network threads
+	~Relay(void);
+
+	void addClient(shared_ptr<Channel> channel);
+	Stats stats(void) const;
+
+private:
+	struct Worker {
+		std::deque<binary> queue;
+		std::mutex mutex;
+		std::condition_variable condition;
+		std::thread thread;
+		bool stopped = false;
+	};
+
+	void onMessage(shared_ptr<Channel> channel, binary data);
+	void onClosed(shared_ptr<Channel> channel);
+	void join(shared_ptr<Channel> channel, const identifier &id);
+	void forward(binary data);
+	void runWorker(Worker &worker);
+
+	std::map<shared_ptr<Channel>, identifier> mClients; // null identifier until joined
+	std::map<identifier, shared_ptr<Channel>> mPeers;
+	mutable std::shared_mutex mPeersMutex;
+
+	std::vector<uptr<Worker>> mWorkers; // messages from a source always go to the same worker
+
+	std::atomic<size_t> mForwarded = 0;
+	std::atomic<size_t> mDropped = 0;
+};
+
+} // namespace convergence
+
+#endif
@@ -0,0 +1,246 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+#include "src/blockdata.hpp"
+
+#include "pla/binaryformatter.hpp"
+
+#include <algorithm>
+
+namespace convergence {
+
+using pla::BinaryFormatter;
+
+namespace {
+
+int paletteBits(size_t count) { return count <= 2 ? 1 : count <= 4 ? 2 : 4; }
+
+} // namespace
+
+BlockData BlockData::Decode(const binary &data) {
+	if (IsLegacy(data))
+		return BlockData(reinterpret_cast<const value *>(data.data()));
+
+	BinaryFormatter formatter(data);
+	uint8_t mode = 0;
+	if (!(formatter >> mode))
+		throw std::runtime_error("Empty terrain block data");
+
+	BlockData result;
+	switch (mode) {
+	case Uniform: {
+		uint8_t type, weight;
+		if (!(formatter >> type >> weight))
+			throw std::runtime_error("Invalid uniform terrain block data");
+		result.mPalette.assign(1, value(type, weight));
+		break;
+	}
+	case Palette: {
+		uint8_t count = 0;
+		if (!(formatter >> count) || count < 2 || count > MaxPaletteSize)
+			throw std::runtime_error("Invalid terrain block palette size");
+		result.mMode = Palette;
+		result.mBits = paletteBits(count);
+		result.mPalette.resize(count);
+		for (auto &v : result.mPalette)
+			if (!(formatter >> v.type >> v.weight))
+				throw std::runtime_error("Invalid terrain block palette");
+		result.mIndices.resize(CellsCount * result.mBits / 8);
+		if (formatter.read(reinterpret_cast<byte *>(result.mIndices.data()),
+		                   result.mIndices.size()) != result.mIndices.size())
+			throw std::runtime_error("Invalid terrain block indices");
+		for (int i = 0; i < CellsCount; ++i)
+			if (result.readIndex(i) >= count)
+				throw std::runtime_error("Invalid terrain block palette index");
+		break;
+	}
+	case Dense: {
+		result.mMode = Dense;
+		result.mPalette.clear();
+		result.mCells.resize(CellsCount);
+		const size_t size = CellsCount * sizeof(value);
+		if (formatter.read(reinterpret_cast<byte *>(result.mCells.data()), size) != size)
+			throw std::runtime_error("Invalid dense terrain block data");
+		break;
+	}
+	default:
+		throw std::runtime_error("Unknown terrain block data mode: " + std::to_string(int(mode)));
+	}
+
+	if (!formatter.remaining().empty())
+		throw std::runtime_error("Trailing terrain block data");
+
+	return result;
+}
+
+bool BlockData::IsLegacy(const binary &data) {
+	// Compact encodings never have this size, dense ones have a mode byte in front
+	return data.size() == CellsCount * sizeof(value);
+}
+
+BlockData::BlockData(value v) : mMode(Uniform), mPalette(1, v) {}
+
+BlockData::BlockData(const value *cells) { pack(cells); }
+
+BlockData::~BlockData(void) {}
+
+BlockData::value BlockData::read(int i) const {
+	switch (mMode) {
+	case Uniform:
+		return mPalette[0];
+	case Palette:
+		return mPalette[readIndex(i)];
+	default:
+		return mCells[i];
+	}
+}
+
+bool BlockData::write(int i, value v) {
+	if (read(i) == v)
+		return false;
+
+	if (mMode != Dense) {
+		auto it = std::find(mPalette.begin(), mPalette.end(), v);
+		if (mMode == Palette && it != mPalette.end()) {
+			writeIndex(i, int(it - mPalette.begin()));
+			return true;
+		}
+		expand();
+	}
+
+	mCells[i] = v;
+	return true;
+}
+
+void BlockData::copyTo(value *cells) const {
+	switch (mMode) {
+	case Uniform:
+		std::fill(cells, cells + CellsCount, mPalette[0]);
+		break;
+	case Palette:
+		for (int i = 0; i < CellsCount; ++i)
+			cells[i] = mPalette[readIndex(i)];
+		break;
+	default:
+		std::copy(mCells.begin(), mCells.end(), cells);
+		break;
+	}
+}
+
+void BlockData::compact(void) {
+	if (mMode == Dense) {
+		std::vector<value> cells;
+		std::swap(cells, mCells);
+		pack(cells.data());
+	}
+}
+
+size_t BlockData::memoryUsage(void) const {
+	return sizeof(BlockData) + mPalette.capacity() * sizeof(value) + mIndices.capacity() +
+	       mCells.capacity() * sizeof(value);
+}
+
+binary BlockData::encode(void) const {
+	// Repack so the palette is minimal and ordered by first appearance
+	value cells[CellsCount];
+	copyTo(cells);
+	return BlockData(cells).serialize();
+}
+
+binary BlockData::encodeLegacy(void) const {
+	binary data(CellsCount * sizeof(value));
+	copyTo(reinterpret_cast<value *>(data.data()));
+	return data;
+}
+
+void BlockData::pack(const value *cells) {
+	mPalette.clear();
+	mIndices.clear();
+	mCells.clear();
+	for (int i = 0; i < CellsCount; ++i) {
+		if (std::find(mPalette.begin(), mPalette.end(), cells[i]) == mPalette.end()) {
+			if (int(mPalette.size()) == MaxPaletteSize) {
+				mMode = Dense;
+				mBits = 0;
+				mPalette.clear();
+				mCells.assign(cells, cells + CellsCount);
+				return;
+			}
+			mPalette.push_back(cells[i]);
+		}
+	}
+
+	if (mPalette.size() == 1) {
+		mMode = Uniform;
+		mBits = 0;
+		return;
+	}
+
+	mMode = Palette;
+	mBits = paletteBits(mPalette.size());
+	mIndices.assign(CellsCount * mBits / 8, 0);
+	for (int i = 0; i < CellsCount; ++i) {
+		auto it = std::find(mPalette.begin(), mPalette.end(), cells[i]);
+		writeIndex(i, int(it - mPalette.begin()));
+	}
+}
+
+void BlockData::expand(void) {
+	mCells.resize(CellsCount);
+	copyTo(mCells.data());
+	mMode = Dense;
+	mBits = 0;
+	mPalette.clear();
+	mIndices.clear();
+}
+
+binary BlockData::serialize(void) const {
+	BinaryFormatter formatter;
+	formatter << uint8_t(mMode);
+	switch (mMode) {
+	case Uniform:
+		formatter << mPalette[0].type << mPalette[0].weight;
+		break;
+	case Palette:
+		formatter << uint8_t(mPalette.size());
+		for (const auto &v : mPalette)
+			formatter << v.type << v.weight;
+		formatter.write(reinterpret_cast<const byte *>(mIndices.data()), mIndices.size());
+		break;
+	default:
+		formatter.write(reinterpret_cast<const byte *>(mCells.data()), CellsCount * sizeof(value));
+		break;
+	}
+	return std::move(formatter.data());
+}
+
+int BlockData::readIndex(int i) const {
+	const int bit = i * mBits;
+	return (mIndices[bit / 8] >> (bit % 8)) & ((1 << mBits) - 1);
+}
+
+void BlockData::writeIndex(int i, int index) {
+	const int bit = i * mBits;
+	const int mask = ((1 << mBits) - 1) << (bit % 8);
+	auto &b = mIndices[bit / 8];
+	b = uint8_t((b & ~mask) | ((index << (bit % 8)) & mask));
+}
+
+} // namespace convergence
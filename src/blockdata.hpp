@@ -0,0 +1,77 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+#ifndef CONVERGENCE_BLOCKDATA_H
+#define CONVERGENCE_BLOCKDATA_H
+
+#include "src/include.hpp"
+#include "src/surface.hpp"
+
+#include <vector>
+
+namespace convergence {
+
+// Compact storage for the cells of a block: uniform, small palette, or dense
+class BlockData {
+public:
+	using value = Surface::value;
+	static const int CellsCount = Surface::Block::CellsCount;
+	static const int MaxPaletteSize = 16;
+
+	// Also accepts the legacy encoding, recognized by its size
+	static BlockData Decode(const binary &data);
+	static bool IsLegacy(const binary &data);
+
+	BlockData(value v = value());
+	BlockData(const value *cells);
+	~BlockData(void);
+
+	value read(int i) const;
+	bool write(int i, value v); // expands to dense if v is not in the palette
+	void copyTo(value *cells) const;
+	void compact(void);
+	size_t memoryUsage(void) const; // in bytes
+
+	// Canonical encoding, identical cells always give identical data
+	binary encode(void) const;
+
+	// Raw cells, as encoded by peers predating the compact modes
+	binary encodeLegacy(void) const;
+
+private:
+	enum Mode : uint8_t { Uniform = 1, Palette = 2, Dense = 3 };
+
+	void pack(const value *cells);
+	void expand(void);
+	binary serialize(void) const;
+
+	int readIndex(int i) const;
+	void writeIndex(int i, int index);
+
+	Mode mMode;
+	int mBits = 0;                 // bits per palette index
+	std::vector<value> mPalette;   // single value if uniform
+	std::vector<uint8_t> mIndices; // packed palette indices
+	std::vector<value> mCells;     // dense cells
+};
+
+} // namespace convergence
+
+#endif
@@ -0,0 +1,76 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+#include "src/candidates.hpp"
+
+#include <algorithm>
+
+namespace convergence {
+
+const double RetryBackoff = 5.; // seconds, doubled on each failure in a row
+const double MaxBackoff = 120.; // seconds
+const unsigned MaxFailures = 6; // about 4 minutes of retries
+
+Candidates::Candidates(unsigned seed) : mRandom(seed) {}
+
+Candidates::~Candidates(void) {}
+
+void Candidates::add(const identifier &id) { mCandidates[id].failures = 0; }
+
+void Candidates::fail(const identifier &id) {
+	auto it = mCandidates.find(id);
+	if (it == mCandidates.end())
+		return;
+
+	Candidate &candidate = it->second;
+	if (++candidate.failures >= MaxFailures) {
+		mCandidates.erase(it);
+		return;
+	}
+
+	candidate.backoff = std::min(RetryBackoff * (1 << (candidate.failures - 1)), MaxBackoff);
+}
+
+void Candidates::update(double time) {
+	for (auto &[id, candidate] : mCandidates)
+		candidate.backoff = std::max(candidate.backoff - time, 0.);
+}
+
+std::vector<identifier> Candidates::pick(size_t count, const std::set<identifier> &except) {
+	std::vector<identifier> available;
+	for (const auto &[id, candidate] : mCandidates)
+		if (candidate.backoff <= 0. && except.find(id) == except.end())
+			available.push_back(id);
+
+	// Random choices make the overlay connected and its diameter small
+	std::shuffle(available.begin(), available.end(), mRandom);
+	if (available.size() > count)
+		available.resize(count);
+
+	return available;
+}
+
+bool Candidates::contains(const identifier &id) const {
+	return mCandidates.find(id) != mCandidates.end();
+}
+
+size_t Candidates::size(void) const { return mCandidates.size(); }
+
+} // namespace convergence
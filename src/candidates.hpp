@@ -0,0 +1,64 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+#ifndef CONVERGENCE_CANDIDATES_H
+#define CONVERGENCE_CANDIDATES_H
+
+#include "src/identifier.hpp"
+#include "src/include.hpp"
+
+#include <map>
+#include <random>
+#include <set>
+#include <vector>
+
+namespace convergence {
+
+// Peers discovered through signaling, incoming offers and broadcasts, to open peerings to. A peer
+// which failed to connect is retried after a backoff, and forgotten after a few failures in a row
+// as it most likely left. Not thread-safe, the owner locks.
+class Candidates {
+public:
+	Candidates(unsigned seed = std::random_device()());
+	~Candidates(void);
+
+	void add(const identifier &id); // discovered or heard from, clears its failures
+	void fail(const identifier &id);
+	void update(double time);
+
+	// Random peers not backing off, except the ones given
+	std::vector<identifier> pick(size_t count, const std::set<identifier> &except);
+
+	bool contains(const identifier &id) const;
+	size_t size(void) const;
+
+private:
+	struct Candidate {
+		double backoff = 0.; // seconds until it can be retried
+		unsigned failures = 0;
+	};
+
+	std::map<identifier, Candidate> mCandidates;
+	std::default_random_engine mRandom;
+};
+
+} // namespace convergence
+
+#endif
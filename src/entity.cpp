@@ -25,12 +25,13 @@
 namespace convergence {
 
 using pla::BinaryFormatter;
-using pla::FragmentShader;
-using pla::Program;
-using pla::VertexShader;
+
+// Entities only keep the latest state messages of their source
+const size_t MailboxSize = 64;
 
 Entity::Entity(sptr<MessageBus> messageBus, identifier id)
-    : mMessageBus(messageBus), mId(std::move(id)), mIsOnGround(false) {
+    : AsyncListener(MailboxSize, Overflow::DropOldest), mMessageBus(messageBus), mId(std::move(id)),
+      mIsOnGround(false) {
 	mTransform = mat4(1.f);
 	mSpeed = vec3(0.f);
 }
@@ -47,19 +48,20 @@ mat4 Entity::getTransform(void) const { return mTransform; }
 
 void Entity::setTransform(mat4 m) { mTransform = std::move(m); }
 
+EntityState Entity::getState(void) const { return EntityState::Quantise(mTransform); }
+
+void Entity::setState(const EntityState &state) { setTransform(state.transform()); }
+
 void Entity::transform(const mat4 &m) { mTransform *= m; }
 
 void Entity::accelerate(const vec3 &v) { mSpeed += v; }
 
 bool Entity::isOnGround(void) const { return mIsOnGround; }
 
-void Entity::collect(Light::Collection &lights) {
-	// Dummy
-}
-
 void Entity::update(sptr<Collidable> terrain, double time) {
-	Message message;
-	while (readMessage(message))
+	mInbox.clear();
+	readMessages(mInbox);
+	for (const auto &message : mInbox)
 		processMessage(message);
 
 	if (!mIsPicked) {
@@ -83,10 +85,16 @@ float Entity::getRadius() const { return 1.f; }
 
 vec3 Entity::getSpeed() const { return mSpeed; }
 
+#ifndef HEADLESS
+void Entity::collect(Light::Collection &lights) {
+	// Dummy
+}
+
 int Entity::draw(const Context &context) {
 	// Dummy
 	return 0;
 }
+#endif
 
 void Entity::handleCollision(const vec3 &normal) {
 	mSpeed -= normal * glm::dot(normal, mSpeed);
@@ -120,15 +128,4 @@ void Entity::processMessage(const Message &message) {
 	}
 }
 
-void Entity::sendTransform() const {
-	Message message(Message::EntityTransform);
-	BinaryFormatter formatter;
-	vec3 p = glm::vec3(mTransform[3]);
-	quat q = glm::quat_cast(mTransform);
-	formatter << float32_t(p.x) << float32_t(p.y) << float32_t(p.z);
-	formatter << float32_t(q.x) << float32_t(q.y) << float32_t(q.z) << float32_t(q.w);
-	message.payload = formatter.data();
-	mMessageBus->send(message);
-}
-
 } // namespace convergence
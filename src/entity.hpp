@@ -23,18 +23,26 @@
 
 #include "src/identifier.hpp"
 #include "src/include.hpp"
-#include "src/light.hpp"
 #include "src/messagebus.hpp"
+#include "src/snapshot.hpp"
 
 #include "pla/collidable.hpp"
+
+#ifndef HEADLESS
+#include "src/light.hpp"
+
 #include "pla/context.hpp"
 #include "pla/object.hpp"
+#endif
 
 namespace convergence {
 
 using pla::Collidable;
+
+#ifndef HEADLESS
 using pla::Context;
 using pla::Object;
+#endif
 
 class Entity : public MessageBus::AsyncListener {
 public:
@@ -52,6 +60,8 @@ public:
 	mat4 getTransform() const;
 
 	void setTransform(mat4 m);
+	virtual EntityState getState() const;
+	virtual void setState(const EntityState &state);
 	void transform(const mat4 &m);
 	void accelerate(const vec3 &v);
 
@@ -63,16 +73,18 @@ public:
 	virtual float getRadius() const;
 	virtual vec3 getSpeed() const;
 
-	virtual void collect(Light::Collection &lights);
 	virtual void update(sptr<Collidable> terrain, double time);
+#ifndef HEADLESS
+	virtual void collect(Light::Collection &lights);
 	virtual int draw(const Context &context);
+#endif
 
 protected:
 	virtual void handleCollision(const vec3 &normal);
 	virtual void processMessage(const Message &message);
-	void sendTransform() const;
 
 	sptr<MessageBus> mMessageBus;
+	std::vector<Message> mInbox;
 	identifier mId;
 	mat4 mTransform;
 	vec3 mSpeed;
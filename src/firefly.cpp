@@ -20,23 +20,24 @@
 
 #include "src/firefly.hpp"
 
+#ifndef HEADLESS
 #include "pla/program.hpp"
 #include "pla/shader.hpp"
+#endif
 
 namespace convergence {
 
+#ifndef HEADLESS
 using pla::FragmentShader;
 using pla::Program;
 using pla::Sphere;
 using pla::VertexShader;
+#endif
 
 Firefly::Firefly(sptr<MessageBus> messageBus, identifier id) : Entity(messageBus, std::move(id)) {
-
+#ifndef HEADLESS
 	mLight = std::make_shared<Light>(vec4(1.f, 0.9f, 0.6f, 1.f), 16.f);
-
-	auto program = std::make_shared<Program>(std::make_shared<VertexShader>("shader/color.vect"),
-	                                         std::make_shared<FragmentShader>("shader/color.frag"));
-	mObject = std::make_shared<Sphere>(64, program);
+#endif
 }
 
 Firefly::~Firefly() {}
@@ -45,14 +46,25 @@ float Firefly::getRadius() const { return 0.5f; }
 
 vec3 Firefly::getSpeed() const { return Entity::getSpeed(); }
 
-void Firefly::collect(Light::Collection &lights) { lights.add(mLight); }
-
 void Firefly::update(sptr<Collidable> terrain, double time) {
 	Entity::update(terrain, time);
+#ifndef HEADLESS
 	mLight->setPosition(getPosition());
+#endif
 }
 
+#ifndef HEADLESS
+void Firefly::collect(Light::Collection &lights) { lights.add(mLight); }
+
 int Firefly::draw(const Context &context) {
+	// The object is created on first draw so fireflies can exist without a graphics context
+	if (!mObject) {
+		auto program =
+		    std::make_shared<Program>(std::make_shared<VertexShader>("shader/color.vect"),
+		                              std::make_shared<FragmentShader>("shader/color.frag"));
+		mObject = std::make_shared<Sphere>(64, program);
+	}
+
 	int count = 0;
 	if (!context.overrideProgram()) {
 		Context subContext = context.transform(getTransform());
@@ -60,5 +72,6 @@ int Firefly::draw(const Context &context) {
 	}
 	return count;
 }
+#endif
 
 } // namespace convergence
@@ -34,13 +34,15 @@ public:
 	virtual float getRadius() const;
 	virtual vec3 getSpeed() const;
 
-	virtual void collect(Light::Collection &lights);
 	virtual void update(sptr<Collidable> terrain, double time);
+#ifndef HEADLESS
+	virtual void collect(Light::Collection &lights);
 	virtual int draw(const Context &context);
 
 protected:
 	sptr<Light> mLight;
 	sptr<Object> mObject;
+#endif
 };
 
 } // namespace convergence
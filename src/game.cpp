@@ -50,6 +50,7 @@ void Game::onInit(Engine *engine) {
 
 	mWorld = std::make_shared<World>(mMessageBus);
 	mMessageBus->registerTypeListener(Message::EntityTransform, mWorld);
+	mMessageBus->registerTypeListener(Message::EntitySnapshot, mWorld);
 
 	auto program = std::make_shared<Program>(std::make_shared<VertexShader>("shader/font.vect"),
 	                                         std::make_shared<FragmentShader>("shader/font.frag"));
@@ -104,6 +105,7 @@ bool Game::onUpdate(Engine *engine, double time) {
 		mReturnPressed = false;
 	}
 
+	mNetworking->update(time);
 	mWorld->update(time);
 
 	if (engine->isMouseButtonDown(MOUSE_BUTTON_LEFT) || mAccumulator >= 0.5) {
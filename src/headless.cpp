@@ -0,0 +1,84 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+// Headless peer: holds and serves the world without any graphics context
+
+#include "src/include.hpp"
+#include "src/logbackend.hpp"
+#include "src/messagebus.hpp"
+#include "src/networking.hpp"
+#include "src/world.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+using convergence::LogBackend;
+using convergence::Message;
+using convergence::MessageBus;
+using convergence::Networking;
+using convergence::World;
+
+std::atomic<bool> running(true);
+
+void stop(int) { running = false; }
+
+int main(int argc, char *argv[]) {
+	try {
+		std::cout << "Starting headless peer..." << std::endl;
+		const std::string url = argc > 1 ? argv[1] : "ws://127.0.0.1:8080/test";
+		const std::string storePath = argc > 2 ? argv[2] : "";
+
+		std::signal(SIGINT, stop);
+		std::signal(SIGTERM, stop);
+
+		auto messageBus = std::make_shared<MessageBus>();
+
+		auto networking = std::make_shared<Networking>(messageBus, url);
+		messageBus->registerTypeListener(Message::Description, networking);
+
+		// The world is kept across restarts if a store file is given
+		auto world = std::make_shared<World>(
+		    messageBus, !storePath.empty() ? std::make_unique<LogBackend>(storePath) : nullptr);
+		messageBus->registerTypeListener(Message::EntityTransform, world);
+		messageBus->registerTypeListener(Message::EntitySnapshot, world);
+
+		using clock = std::chrono::steady_clock;
+		const auto period = std::chrono::milliseconds(1000 / 30);
+		auto last = clock::now();
+		while (running) {
+			const auto now = clock::now();
+			const double time = std::chrono::duration<double>(now - last).count();
+			networking->update(time);
+			world->update(time);
+			last = now;
+			std::this_thread::sleep_until(now + period);
+		}
+
+	} catch (const std::exception &e) {
+		std::cout << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
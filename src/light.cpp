@@ -28,8 +28,7 @@ namespace convergence {
 const size_t MaxLightsCount = 16;
 
 Light::Light(vec4 color, float power, vec3 position)
-    : mColor(std::move(color)), mPower(std::move(power)), mPosition(std::move(position)),
-      mDepthCubeMap(std::make_shared<DepthCubeMap>(1024)) {}
+    : mColor(std::move(color)), mPower(std::move(power)), mPosition(std::move(position)) {}
 
 vec4 Light::color() const { return mColor; }
 
@@ -39,9 +38,16 @@ vec3 Light::position() const { return mPosition; }
 
 void Light::setPosition(vec3 position) { mPosition = position; }
 
-void Light::bindDepth(int face) { mDepthCubeMap->bindFramebuffer(face); }
+void Light::bindDepth(int face) { depthCubeMap()->bindFramebuffer(face); }
 
-void Light::unbindDepth() { mDepthCubeMap->unbindFramebuffer(); }
+void Light::unbindDepth() { depthCubeMap()->unbindFramebuffer(); }
+
+sptr<DepthCubeMap> Light::depthCubeMap() {
+	if (!mDepthCubeMap)
+		mDepthCubeMap = std::make_shared<DepthCubeMap>(1024);
+
+	return mDepthCubeMap;
+}
 
 Light::Collection::Collection() { mLights.reserve(MaxLightsCount); }
 
@@ -78,7 +84,7 @@ std::vector<float> Light::Collection::powers() const {
 std::vector<sptr<Texture>> Light::Collection::depthCubeMaps() const {
 	std::vector<sptr<Texture>> result(mLights.size());
 	std::transform(mLights.begin(), mLights.end(), result.begin(),
-	               [](const auto &light) { return light->mDepthCubeMap; });
+	               [](const auto &light) { return light->depthCubeMap(); });
 	return result;
 }
 
@@ -62,11 +62,13 @@ public:
 	};
 
 private:
+	sptr<DepthCubeMap> depthCubeMap();
+
 	vec4 mColor;
 	float mPower;
 	vec3 mPosition;
 
-	sptr<DepthCubeMap> mDepthCubeMap;
+	sptr<DepthCubeMap> mDepthCubeMap; // created on first use
 };
 
 } // namespace convergence
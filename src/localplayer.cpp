@@ -26,33 +26,12 @@ using pla::BinaryFormatter;
 
 namespace convergence {
 
-LocalPlayer::LocalPlayer(sptr<MessageBus> messageBus) : Player(messageBus, messageBus->localId()) {
-	mOldYaw = mYaw;
-	mOldPitch = mPitch;
-	mOldIsJumping = false;
-	mPositionUpdateCooldown = 0.f;
-}
+// The state is sent by the world in its entity snapshots
+LocalPlayer::LocalPlayer(sptr<MessageBus> messageBus)
+    : Player(messageBus, messageBus->localId()) {}
 
 LocalPlayer::~LocalPlayer(void) {}
 
-void LocalPlayer::update(sptr<Collidable> terrain, double time) {
-	Player::update(terrain, time);
-
-	mPositionUpdateCooldown += time;
-
-	if (mPositionUpdateCooldown > 0.5 || std::abs(mYaw - mOldYaw) > Epsilon ||
-	    std::abs(mPitch - mOldPitch) > Epsilon /*|| std::abs(mSpeed - mOldSpeed) > Epsilon*/ ||
-	    mIsJumping != mOldIsJumping) {
-		mPositionUpdateCooldown = 0.;
-		mOldYaw = mYaw;
-		mOldPitch = mPitch;
-		mOldIsJumping = mIsJumping;
-
-		sendTransform();
-		sendControl();
-	}
-}
-
 void LocalPlayer::onMessage(const Message &message) {
 	switch (message.type) {
 	case Message::EntityTransform:
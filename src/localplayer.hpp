@@ -31,16 +31,8 @@ public:
 	LocalPlayer(sptr<MessageBus> messageBus);
 	~LocalPlayer(void);
 
-	void update(sptr<Collidable> terrain, double time);
-
 protected:
 	void onMessage(const Message &message);
-
-private:
-	float mOldYaw, mOldPitch;
-	bool mOldIsJumping;
-
-	double mPositionUpdateCooldown;
 };
 
 } // namespace convergence
@@ -0,0 +1,332 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+#include "src/logbackend.hpp"
+#include "src/sha3.hpp"
+
+#include "pla/binaryformatter.hpp"
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace convergence {
+
+using pla::BinaryFormatter;
+
+namespace {
+
+const uint32_t Magic = 0x43564731; // "CVG1"
+const size_t KeySize = 16;
+const size_t HeaderSize = 4 + 1 + KeySize + 4; // magic, kind, key, size
+const size_t TrailerSize = 4;                  // checksum
+const uint32_t MaxRecordSize = 64 * 1024 * 1024;
+
+uint64_t recordSize(uint64_t payloadSize) { return HeaderSize + payloadSize + TrailerSize; }
+
+uint32_t crc32(const byte *data, size_t size, uint32_t previous = 0) {
+	static const auto table = []() {
+		std::array<uint32_t, 256> t;
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k)
+				c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			t[i] = c;
+		}
+		return t;
+	}();
+
+	uint32_t c = previous ^ 0xFFFFFFFF;
+	for (size_t i = 0; i < size; ++i)
+		c = table[(c ^ std::to_integer<uint32_t>(data[i])) & 0xFF] ^ (c >> 8);
+	return c ^ 0xFFFFFFFF;
+}
+
+void writeAll(int fd, const void *data, size_t size, uint64_t offset) {
+	auto p = static_cast<const char *>(data);
+	while (size > 0) {
+		ssize_t len = ::pwrite(fd, p, size, off_t(offset));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error(string("Store write failed: ") + std::strerror(errno));
+		}
+		p += len;
+		size -= size_t(len);
+		offset += uint64_t(len);
+	}
+}
+
+bool readAll(int fd, void *data, size_t size, uint64_t offset) {
+	auto p = static_cast<char *>(data);
+	while (size > 0) {
+		ssize_t len = ::pread(fd, p, size, off_t(offset));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error(string("Store read failed: ") + std::strerror(errno));
+		}
+		if (len == 0)
+			return false;
+		p += len;
+		size -= size_t(len);
+		offset += uint64_t(len);
+	}
+	return true;
+}
+
+uint64_t fileSize(int fd) {
+	struct stat st;
+	if (::fstat(fd, &st) < 0)
+		throw std::runtime_error(string("Store stat failed: ") + std::strerror(errno));
+	return uint64_t(st.st_size);
+}
+
+} // namespace
+
+LogBackend::LogBackend(const string &path) : mPath(path) {
+	mLog = ::open(mPath.c_str(), O_RDWR | O_CREAT, 0644);
+	if (mLog < 0)
+		throw std::runtime_error("Unable to open store log " + mPath + ": " + std::strerror(errno));
+
+	const string indexPath = mPath + ".idx";
+	mIndex = ::open(indexPath.c_str(), O_RDWR | O_CREAT, 0644);
+	if (mIndex < 0) {
+		::close(mLog);
+		throw std::runtime_error("Unable to open store index " + indexPath + ": " +
+		                         std::strerror(errno));
+	}
+
+	try {
+		recover();
+	} catch (...) {
+		::close(mIndex);
+		::close(mLog);
+		throw;
+	}
+
+	std::cout << "Opened store " << mPath << " with " << mEntries.size() << " records" << std::endl;
+}
+
+LogBackend::~LogBackend(void) {
+	// Recovery handles a tail lost in a crash, the index is rebuilt from the log
+	::fdatasync(mLog);
+	::fdatasync(mIndex);
+	::close(mIndex);
+	::close(mLog);
+}
+
+bool LogBackend::contains(const binary &digest) const {
+	return mEntries.find(digest) != mEntries.end();
+}
+
+void LogBackend::insert(const binary &digest, const binary &data) {
+	if (digest.size() != KeySize)
+		throw std::runtime_error("Invalid digest size for store");
+
+	append(Data, digest, data);
+}
+
+shared_ptr<binary> LogBackend::retrieve(const binary &digest) const {
+	auto it = mEntries.find(digest);
+	if (it == mEntries.end())
+		return nullptr;
+
+	Record record;
+	if (!readRecord(it->second.offset, record))
+		throw std::runtime_error("Corrupted record in store " + mPath);
+
+	return std::make_shared<binary>(std::move(record.payload));
+}
+
+void LogBackend::setReference(const string &name, const binary &digest) {
+	if (reference(name) == digest)
+		return;
+
+	// The records the reference points to must be on disk before it, so a crash may lose the
+	// latest references but never leaves one to missing data
+	if (::fdatasync(mLog) != 0)
+		throw std::runtime_error("Failed to sync store " + mPath);
+
+	BinaryFormatter formatter;
+	formatter << digest;
+	formatter << name;
+	append(Reference, ReferenceKey(name), formatter.data());
+}
+
+optional<binary> LogBackend::reference(const string &name) const {
+	auto it = mReferences.find(ReferenceKey(name));
+	if (it == mReferences.end())
+		return nullopt;
+
+	Record record;
+	if (!readRecord(it->second.offset, record) || record.payload.size() < KeySize)
+		throw std::runtime_error("Corrupted reference in store " + mPath);
+
+	return binary(record.payload.begin(), record.payload.begin() + KeySize);
+}
+
+binary LogBackend::ReferenceKey(const string &name) {
+	binary key;
+	Sha3_256(pla::to_binary(name), key);
+	key.resize(KeySize);
+	return key;
+}
+
+void LogBackend::recover(void) {
+	mLogSize = fileSize(mLog);
+
+	// Index entries follow the log order, keep the longest prefix consistent with the log
+	const uint64_t count = fileSize(mIndex) / sizeof(IndexEntry);
+	std::vector<IndexEntry> entries;
+	if (count > 0) {
+		const size_t size = size_t(count * sizeof(IndexEntry));
+		void *map = ::mmap(NULL, size, PROT_READ, MAP_SHARED, mIndex, 0);
+		if (map == MAP_FAILED)
+			throw std::runtime_error(string("Unable to map store index: ") + std::strerror(errno));
+
+		auto mapped = static_cast<const IndexEntry *>(map);
+		uint64_t end = 0;
+		for (uint64_t i = 0; i < count; ++i) {
+			const IndexEntry &entry = mapped[i];
+			if (entry.offset != end || end + recordSize(entry.size) > mLogSize)
+				break;
+			entries.push_back(entry);
+			end += recordSize(entry.size);
+		}
+		::munmap(map, size);
+	}
+
+	// The last indexed record might have been written only partially
+	Record record;
+	if (!entries.empty() && !readRecord(entries.back().offset, record))
+		entries.pop_back();
+
+	for (const auto &entry : entries) {
+		binary key(reinterpret_cast<const byte *>(entry.key),
+		           reinterpret_cast<const byte *>(entry.key) + KeySize);
+		if (entry.kind == Reference)
+			mReferences[std::move(key)] = entry;
+		else
+			mEntries[std::move(key)] = entry;
+	}
+
+	mIndexCount = entries.size();
+	if (mIndexCount != count && ::ftruncate(mIndex, off_t(mIndexCount * sizeof(IndexEntry))) < 0)
+		throw std::runtime_error(string("Unable to truncate store index: ") + std::strerror(errno));
+
+	// Index the records appended after the last entry, and drop a corrupted tail
+	uint64_t offset = entries.empty() ? 0 : entries.back().offset + recordSize(entries.back().size);
+	while (offset < mLogSize) {
+		if (!readRecord(offset, record)) {
+			std::cout << "Truncating store log " << mPath << " at corrupted record, dropping "
+			          << mLogSize - offset << " bytes" << std::endl;
+			if (::ftruncate(mLog, off_t(offset)) < 0)
+				throw std::runtime_error(string("Unable to truncate store log: ") +
+				                         std::strerror(errno));
+			mLogSize = offset;
+			break;
+		}
+
+		IndexEntry entry = {};
+		std::copy(record.key.begin(), record.key.end(), reinterpret_cast<byte *>(entry.key));
+		entry.offset = offset;
+		entry.size = uint32_t(record.payload.size());
+		entry.kind = record.kind;
+		appendIndex(entry);
+
+		if (record.kind == Reference)
+			mReferences[record.key] = entry;
+		else
+			mEntries[record.key] = entry;
+
+		offset += recordSize(record.payload.size());
+	}
+}
+
+bool LogBackend::readRecord(uint64_t offset, Record &record) const {
+	binary header(HeaderSize);
+	if (offset + HeaderSize > mLogSize || !readAll(mLog, header.data(), HeaderSize, offset))
+		return false;
+
+	BinaryFormatter formatter(header);
+	uint32_t magic = 0, size = 0;
+	uint8_t kind = 0;
+	record.key.resize(KeySize);
+	formatter >> magic >> kind >> record.key >> size;
+	if (magic != Magic || (kind != Data && kind != Reference) || size > MaxRecordSize ||
+	    offset + recordSize(size) > mLogSize)
+		return false;
+
+	binary rest(size + TrailerSize);
+	if (!readAll(mLog, rest.data(), rest.size(), offset + HeaderSize))
+		return false;
+
+	uint32_t checksum = 0;
+	BinaryFormatter trailer(binary(rest.end() - TrailerSize, rest.end()));
+	trailer >> checksum;
+	rest.resize(size);
+
+	if (checksum != crc32(rest.data(), rest.size(), crc32(header.data(), header.size())))
+		return false;
+
+	record.kind = Kind(kind);
+	record.payload = std::move(rest);
+	return true;
+}
+
+void LogBackend::append(Kind kind, const binary &key, const binary &payload) {
+	if (payload.size() > MaxRecordSize)
+		throw std::runtime_error("Record too large for store: " + std::to_string(payload.size()));
+
+	BinaryFormatter formatter;
+	formatter << Magic << uint8_t(kind) << key << uint32_t(payload.size()) << payload;
+	formatter << crc32(formatter.data().data(), formatter.data().size());
+	const binary &data = formatter.data();
+
+	// Write the record before its index entry, so the index never points past the log
+	const uint64_t offset = mLogSize;
+	writeAll(mLog, data.data(), data.size(), offset);
+	mLogSize += data.size();
+
+	IndexEntry entry = {};
+	std::copy(key.begin(), key.end(), reinterpret_cast<byte *>(entry.key));
+	entry.offset = offset;
+	entry.size = uint32_t(payload.size());
+	entry.kind = kind;
+	appendIndex(entry);
+
+	if (kind == Reference)
+		mReferences[key] = entry;
+	else
+		mEntries[key] = entry;
+}
+
+void LogBackend::appendIndex(const IndexEntry &entry) {
+	writeAll(mIndex, &entry, sizeof(entry), mIndexCount * sizeof(IndexEntry));
+	++mIndexCount;
+}
+
+} // namespace convergence
@@ -0,0 +1,86 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+#ifndef CONVERGENCE_LOGBACKEND_H
+#define CONVERGENCE_LOGBACKEND_H
+
+#include "src/include.hpp"
+#include "src/store.hpp"
+
+#include <unordered_map>
+
+namespace convergence {
+
+// Persistent store backend: records are appended to a log file, and a file of fixed-size
+// entries indexes them so opening does not require reading the whole log. On opening, a torn
+// or corrupted tail is detected with checksums and truncated, and missing entries are indexed.
+// The log is synced before each reference is written, so after a crash the references resolve
+// to complete data, possibly to an older root than the last one.
+class LogBackend final : public Store::Backend {
+public:
+	LogBackend(const string &path); // index is stored in path + ".idx"
+	~LogBackend(void);
+
+	bool contains(const binary &digest) const;
+	void insert(const binary &digest, const binary &data);
+	shared_ptr<binary> retrieve(const binary &digest) const;
+
+	void setReference(const string &name, const binary &digest);
+	optional<binary> reference(const string &name) const;
+
+private:
+	enum Kind : uint8_t { Data = 1, Reference = 2 };
+
+#pragma pack(push, 1)
+	struct IndexEntry {
+		uint8_t key[16];
+		uint64_t offset;
+		uint32_t size;
+		uint8_t kind;
+		uint8_t padding[3];
+	};
+#pragma pack(pop)
+
+	struct Record {
+		Kind kind;
+		binary key;
+		binary payload;
+	};
+
+	static binary ReferenceKey(const string &name);
+
+	void recover(void);
+	bool readRecord(uint64_t offset, Record &record) const;
+	void append(Kind kind, const binary &key, const binary &payload);
+	void appendIndex(const IndexEntry &entry);
+
+	const string mPath;
+	int mLog = -1;
+	int mIndex = -1;
+	uint64_t mLogSize = 0;
+	uint64_t mIndexCount = 0;
+
+	std::unordered_map<binary, IndexEntry, binary_hash> mEntries;
+	std::unordered_map<binary, IndexEntry, binary_hash> mReferences;
+};
+
+} // namespace convergence
+
+#endif
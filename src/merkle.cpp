@@ -33,12 +33,42 @@ Merkle::~Merkle(void) {}
 
 void Merkle::update(double time) {
 	std::lock_guard lock(mMutex);
+
+	std::vector<shared_ptr<Node>> merges;
+	{
+		std::lock_guard pendingLock(mPendingMergesMutex);
+		std::swap(merges, mPendingMerges);
+	}
+	for (auto &root : merges)
+		mergeRoot(root);
+
 	for (const auto &[index, data] : mChangedData)
-			changeData(index, *data);
+		changeData(index, *data);
 	mChangedData.clear();
 }
 
-void Merkle::updateRoot(const binary &digest) {
+void Merkle::setFormat(Format format) {
+	std::lock_guard lock(mMutex);
+	if (mFormat == format)
+		return;
+
+	if (mRoot) {
+		auto converted = convertTree(mRoot, format);
+		if (!converted) {
+			std::cerr << "Cannot switch tree format, subtrees are deferred" << std::endl;
+			return;
+		}
+		mRoot = converted;
+	}
+
+	std::cout << "Switching tree format to version " << int(format) << std::endl;
+	mFormat = format;
+	mCandidates.clear();
+	if (mRoot)
+		propagateRoot(mRoot->digest());
+}
+
+void Merkle::updateRoot(const binary &digest, Format format, const identifier &source) {
 	std::lock_guard lock(mMutex);
 
 	if (std::all_of(digest.begin(), digest.end(), [](byte b) { return b == byte(0); }))
@@ -49,20 +79,108 @@ void Merkle::updateRoot(const binary &digest) {
 		return;
 
 	std::cout << "Adding root candidate with digest " << to_hex(digest) << std::endl;
-	auto candidate = createNode({}, digest);
+	auto candidate = std::make_shared<Node>(Index(), digest, format);
+	candidate->populate(this, source);
 	candidate->addResolvedCallback(std::bind(&Merkle::mergeRoot, this, _1));
 	mCandidates[digest] = candidate;
 }
 
 void Merkle::updateData(Index index, const binary &data, bool change) {
+	std::vector<std::pair<Index, binary>> updates;
+	updates.emplace_back(std::move(index), data);
+	updateData(std::move(updates), change);
+}
+
+void Merkle::updateData(std::vector<std::pair<Index, binary>> updates, bool change) {
+	if (updates.empty())
+		return;
+
 	std::lock_guard lock(mMutex);
 
-	auto digest = mStore->insert(data);
-	std::cout << "Updating data with digest " << to_hex(digest) << std::endl;
+	Targets targets;
+	targets.reserve(updates.size());
+	for (auto &[index, data] : updates) {
+		auto digest = mStore->insert(data);
+		std::cout << "Updating data with digest " << to_hex(digest) << std::endl;
+		targets.emplace_back(std::move(index), std::move(digest));
+	}
 
-	mRoot = mRoot ? mRoot->fork(std::move(index), digest, change, this)
-	              : createNode({}, std::move(index), std::move(digest));
-	propagateRoot(mRoot->digest());
+	applyTargets(std::move(targets), change);
+}
+
+void Merkle::applyTargets(Targets targets, bool change) {
+	// Sort by path from the root so leaves sharing ancestors are contiguous, then all leaves are
+	// forked at once and each affected node is rebuilt only once. The last update of a leaf wins.
+	std::reverse(targets.begin(), targets.end());
+	std::stable_sort(targets.begin(), targets.end(),
+	                 [](const auto &a, const auto &b) { return a.first < b.first; });
+	targets.erase(std::unique(targets.begin(), targets.end(),
+	                          [](const auto &a, const auto &b) { return a.first == b.first; }),
+	              targets.end());
+
+	// Leaves under deferred subtrees can't be forked before the subtrees are resolved. Received
+	// ones are dropped as they will come with the sender's root, local ones are retried.
+	std::vector<shared_ptr<Node>> deferred;
+	auto last = std::stable_partition(targets.begin(), targets.end(), [&](const auto &t) {
+		auto node = mRoot ? mRoot->findDeferred(t.first) : nullptr;
+		if (!node)
+			return true;
+		if (std::find(deferred.begin(), deferred.end(), node) == deferred.end())
+			deferred.push_back(node);
+		return false;
+	});
+	if (!change)
+		mPendingTargets.insert(mPendingTargets.end(), last, targets.end());
+
+	if (last != targets.begin()) {
+		mRoot = mRoot ? mRoot->fork(targets.begin(), last, change, this)
+		              : createNode({}, targets.begin(), last, change, mFormat);
+		propagateRoot(mRoot->digest());
+	}
+
+	for (auto &node : deferred)
+		resolveDeferred(node);
+}
+
+binary Merkle::convertData(const binary &data, Format format) { return data; }
+
+bool Merkle::isInterested(const Index &index) const { return true; }
+
+void Merkle::updateInterest(void) {
+	std::lock_guard lock(mMutex);
+	if (mRoot)
+		updateInterest(mRoot);
+}
+
+void Merkle::updateInterest(shared_ptr<Node> node) {
+	if (!isInterested(node->index()))
+		return;
+
+	if (node->isDeferred()) {
+		resolveDeferred(node);
+	} else if (auto children = node->children()) {
+		for (const auto &child : *children)
+			if (child)
+				updateInterest(child);
+	}
+}
+
+void Merkle::resolveDeferred(shared_ptr<Node> node) {
+	if (!node->isDeferred())
+		return;
+
+	std::cout << "Resolving deferred node " << to_hex(node->digest()) << std::endl;
+	node->resolve(this);
+	node->addResolvedCallback([this](shared_ptr<Node> node) {
+		// Blocks under the subtree were generated without its data
+		if (get(node->index()) == node)
+			node->markChangedData(this);
+
+		Targets pending = std::move(mPendingTargets);
+		mPendingTargets.clear();
+		if (!pending.empty())
+			applyTargets(std::move(pending), false);
+	});
 }
 
 shared_ptr<Merkle::Node> Merkle::get(Index index) const {
@@ -73,10 +191,45 @@ shared_ptr<Merkle::Node> Merkle::root(void) const { return mRoot; }
 
 binary Merkle::rootDigest() const { return mRoot ? mRoot->digest() : binary(16, byte(0)); }
 
+size_t Merkle::hashedNodes() const { return mHashedNodes; }
+
+Merkle::Format Merkle::format() const { return mFormat; }
+
+binary Merkle::rootDigest(Format format) {
+	std::lock_guard lock(mMutex);
+	if (!mRoot || format == mFormat)
+		return rootDigest();
+
+	// Rebuilt from the leaves only when the tree changed since the last call
+	if (!mEncodedRoot || mEncodedRoot->format() != format ||
+	    mEncodedRootSource != mRoot->digest()) {
+		// The other encoding can't be computed without all leaves
+		Targets targets;
+		if (!mRoot->collectLeaves(targets) || targets.empty() || !convertLeaves(targets, format))
+			return binary();
+
+		const size_t hashedNodes = mHashedNodes; // not an update
+		mEncodedRoot = createNode({}, targets.begin(), targets.end(), false, format);
+		mEncodedRootSource = mRoot->digest();
+		mHashedNodes = hashedNodes;
+	}
+	return mEncodedRoot->digest();
+}
+
 void Merkle::mergeRoot(shared_ptr<Node> node) {
 	std::cout << "Merging root " << to_hex(node->digest()) << std::endl;
+	auto converted = convertTree(node, mFormat);
+	if (!converted) {
+		// Trees in the other format are fetched whole, so only missing data gets here
+		std::cerr << "Dropping root " << to_hex(node->digest()) << ", leaves are missing"
+		          << std::endl;
+		return;
+	}
+	node = converted;
 	if (mRoot) {
+		mMergingRoot = node;
 		mRoot = mRoot->merge(node, this);
+		mMergingRoot.reset();
 	} else {
 		mRoot = node;
 		mRoot->markChangedData(this);
@@ -84,74 +237,281 @@ void Merkle::mergeRoot(shared_ptr<Node> node) {
 	propagateRoot(mRoot->digest());
 }
 
-shared_ptr<Merkle::Node> Merkle::createNode(Index index, binary digest) {
-	auto node = std::make_shared<Node>(std::move(index), std::move(digest));
-	node->populate(mStore);
+void Merkle::deferMerge(shared_ptr<Node> a, shared_ptr<Node> b) {
+	// The subtrees differ but one has no content yet, so it is fetched before merging
+	auto root = mMergingRoot;
+	for (auto node : {a, b}) {
+		if (node->isDeferred())
+			resolveDeferred(node);
+		else if (node->isResolved())
+			continue;
+
+		if (!root)
+			continue;
+
+		node->addResolvedCallback([this, root](shared_ptr<Node>) {
+			std::lock_guard lock(mPendingMergesMutex);
+			if (std::find(mPendingMerges.begin(), mPendingMerges.end(), root) ==
+			    mPendingMerges.end())
+				mPendingMerges.push_back(root);
+		});
+	}
+}
+
+shared_ptr<Merkle::Node> Merkle::createNode(Index index, binary digest, Format format) {
+	auto node = std::make_shared<Node>(std::move(index), std::move(digest), format);
+	node->populate(this);
 	return node;
 }
 
-shared_ptr<Merkle::Node> Merkle::createNode(Index index, Index target, binary digest) {
-	if (target.length() == 0) {
-		return createNode(std::move(index), std::move(digest));
+shared_ptr<Merkle::Node> Merkle::createNode(Index index, Node::ChildrenArray children,
+                                            Format format) {
+	++mHashedNodes;
+	auto node = std::make_shared<Node>(std::move(index), std::move(children), mStore, format);
+	node->populate(this);
+	return node;
+}
+
+shared_ptr<Merkle::Node> Merkle::createNode(Index index, Targets::iterator begin,
+                                            Targets::iterator end, bool markChanged,
+                                            Format format) {
+	if (begin->first.length() == 0) {
+		auto node = createNode(std::move(index), begin->second, format);
+		if (markChanged)
+			node->markChangedData(this);
+		return node;
+	}
+
+	return buildNode(std::move(index), Node::ChildrenArray(), begin, end, markChanged, format);
+}
+
+shared_ptr<Merkle::Node> Merkle::buildNode(Index index, Node::ChildrenArray children,
+                                           Targets::iterator begin, Targets::iterator end,
+                                           bool markChanged, Format format) {
+	// Targets are sorted, so the ones under the same child are contiguous
+	for (auto it = begin; it != end;) {
+		const int n = it->first.peek();
+		auto last = std::find_if(it, end, [n](const auto &t) { return t.first.peek() != n; });
+		std::for_each(it, last, [](auto &t) { t.first.pop(); });
+		children[n] = forkChild(Index(n, index), children[n], it, last, markChanged, format);
+		it = last;
+	}
+
+	return createNode(std::move(index), std::move(children), format);
+}
+
+shared_ptr<Merkle::Node> Merkle::forkChild(Index index, shared_ptr<Node> child,
+                                           Targets::iterator begin, Targets::iterator end,
+                                           bool markChanged, Format format) {
+	if (format == Format::Compressed) {
+		// Skip the levels shared by all targets and the existing child
+		const int limit = child ? child->index().length() : Index::MaxLength;
+		const auto back = std::prev(end);
+		while (index.length() < limit) {
+			const int n = begin->first.peek();
+			if (back->first.peek() != n || (child && child->index().at(index.length()) != n))
+				break;
+
+			std::for_each(begin, end, [](auto &t) { t.first.pop(); });
+			index = Index(n, index);
+		}
+
+		if (child && index.length() < limit) {
+			// Targets diverge above the child, insert a branching node
+			Node::ChildrenArray children;
+			children[child->index().at(index.length())] = std::move(child);
+			return buildNode(std::move(index), std::move(children), begin, end, markChanged,
+			                 format);
+		}
 	}
 
+	return child ? child->fork(begin, end, markChanged, this)
+	             : createNode(std::move(index), begin, end, markChanged, format);
+}
+
+shared_ptr<Merkle::Node> Merkle::mergeNodes(shared_ptr<Node> a, shared_ptr<Node> b) {
+	const Index &ia = a->index();
+	const Index &ib = b->index();
+	if (ia == ib)
+		return a->merge(b, this);
+
+	// Compressed subtrees under the same child may start at different depths
+	int depth = 0;
+	while (depth < ia.length() && depth < ib.length() && ia.at(depth) == ib.at(depth))
+		++depth;
+
+	// A subtree without content can't be descended into, the local one is kept until it has
+	if ((depth == ia.length() && (a->isDeferred() || !a->isResolved())) ||
+	    (depth == ib.length() && (b->isDeferred() || !b->isResolved()))) {
+		deferMerge(a, b);
+		return a;
+	}
+
+	if (depth == ia.length()) {
+		auto children = *a->children();
+		auto &child = children[ib.at(depth)];
+		if (child) {
+			child = mergeNodes(child, b);
+		} else {
+			child = b;
+			child->markChangedData(this);
+		}
+		return children != *a->children() ? createNode(ia, std::move(children), a->format()) : a;
+	}
+
+	if (depth == ib.length()) {
+		auto children = *b->children();
+		const int n = ia.at(depth);
+		for (int i = 0; i < Node::ChildrenCount; ++i)
+			if (children[i] && i != n)
+				children[i]->markChangedData(this);
+
+		children[n] = children[n] ? mergeNodes(a, children[n]) : a;
+		return createNode(ib, std::move(children), b->format());
+	}
+
+	Index index = ia;
+	while (index.length() > depth)
+		index = index.parent();
+
 	Node::ChildrenArray children;
-	int n = target.pop();
-	children[n] = createNode(Index(n, index), std::move(target), std::move(digest));
+	children[ia.at(depth)] = a;
+	children[ib.at(depth)] = b;
+	b->markChangedData(this);
+	return createNode(std::move(index), std::move(children), a->format());
+}
 
-	auto node = std::make_shared<Node>(std::move(index), std::move(children), mStore);
-	node->populate(mStore);
-	return node;
+shared_ptr<Merkle::Node> Merkle::convertTree(shared_ptr<Node> root, Format format) {
+	if (root->format() == format)
+		return root;
+
+	// The tree is rebuilt from all leaves, re-encoded for the format
+	Targets targets;
+	if (!root->collectLeaves(targets) || targets.empty() || !convertLeaves(targets, format))
+		return nullptr;
+
+	return createNode({}, targets.begin(), targets.end(), false, format);
+}
+
+bool Merkle::convertLeaves(Targets &targets, Format format) {
+	// Only conversions of the current leaves are kept
+	auto &previous = mConvertedLeaves[format];
+	std::unordered_map<binary, binary, binary_hash> converted;
+	for (auto &[index, digest] : targets) {
+		auto it = previous.find(digest);
+		if (it == previous.end()) {
+			auto data = mStore->retrieve(digest);
+			if (!data)
+				return false;
+
+			it = previous.emplace(digest, mStore->insert(convertData(*data, format))).first;
+		}
+		converted.insert(*it);
+		digest = it->second;
+	}
+	previous = std::move(converted);
+	return true;
 }
 
 Merkle::Index::Index(void) {}
 
 Merkle::Index::Index(const binary &data) {
-	mValues.resize(data.size());
-	std::transform(data.begin(), data.end(), mValues.begin(),
-	               [](byte b) { return std::to_integer<uint8_t>(b) & 0x3F; });
+	for (byte b : data)
+		push(std::to_integer<uint8_t>(b) & 0x3F);
 }
 
 Merkle::Index::~Index(void) {}
 
-Merkle::Index::Index(int child, const Index &parent) {
-	mValues.reserve(1 + parent.mValues.size());
-	mValues.push_back(child);
-	for (int value : parent.mValues)
-		mValues.push_back(value);
+Merkle::Index::Index(int child, const Index &parent) : mLength(parent.mLength + 1) {
+	if (parent.mLength >= MaxLength)
+		throw std::runtime_error("Merkle index too long");
+
+	const uint64_t mask = (uint64_t(1) << 48) - 1;
+	mWords[0] = ((parent.mWords[0] << 6) & mask) | uint64_t(child & 0x3F);
+	mWords[1] = ((parent.mWords[1] << 6) & mask) | (parent.mWords[0] >> 42);
 }
 
-int Merkle::Index::length(void) const { return mValues.size(); }
+int Merkle::Index::length(void) const { return mLength; }
+
+int Merkle::Index::peek(void) const { return value(mLength - 1); }
 
 int Merkle::Index::pop(void) {
-	int tmp = mValues.back();
-	mValues.pop_back();
+	const int i = --mLength;
+	const int shift = 6 * (i & 7);
+	const int tmp = int((mWords[i >> 3] >> shift) & 0x3F);
+	mWords[i >> 3] &= ~(uint64_t(0x3F) << shift);
 	return tmp;
 }
 
-void Merkle::Index::push(int child) { mValues.push_back(child); }
+void Merkle::Index::push(int child) {
+	if (mLength >= MaxLength)
+		throw std::runtime_error("Merkle index too long");
+
+	const int i = mLength++;
+	mWords[i >> 3] |= uint64_t(child & 0x3F) << (6 * (i & 7));
+}
 
 Merkle::Index Merkle::Index::parent(void) const {
-	return !mValues.empty() ? Index(++mValues.begin(), mValues.end()) : *this;
+	if (mLength == 0)
+		return *this;
+
+	Index result;
+	result.mLength = mLength - 1;
+	result.mWords[0] = (mWords[0] >> 6) | ((mWords[1] & 0x3F) << 42);
+	result.mWords[1] = mWords[1] >> 6;
+	return result;
 }
 
-int Merkle::Index::child(void) const { return !mValues.empty() ? mValues.front() : 0; }
+int Merkle::Index::child(void) const { return mLength > 0 ? value(0) : 0; }
 
-Merkle::Node::Node(Index index, binary digest)
-    : mIndex(std::move(index)), mDigest(std::move(digest)) {}
+int Merkle::Index::at(int depth) const { return value(mLength - 1 - depth); }
+
+bool Merkle::Index::operator<(const Index &other) const {
+	for (int i = mLength - 1, j = other.mLength - 1; i >= 0 && j >= 0; --i, --j) {
+		const int a = value(i);
+		const int b = other.value(j);
+		if (a != b)
+			return a < b;
+	}
+	return mLength < other.mLength;
+}
 
-Merkle::Node::Node(Index index, ChildrenArray children, shared_ptr<Store> store)
-    : mIndex(std::move(index)) {
+int Merkle::Index::value(int i) const { return int((mWords[i >> 3] >> (6 * (i & 7))) & 0x3F); }
+
+Merkle::Node::Node(Index index, binary digest, Format format)
+    : mIndex(std::move(index)), mFormat(format), mDigest(std::move(digest)) {}
+
+Merkle::Node::Node(Index index, ChildrenArray children, shared_ptr<Store> store, Format format)
+    : mIndex(std::move(index)), mFormat(format) {
 
 	// Build data
-	binary data(ChildrenCount * 16, byte(0));
-	auto it = data.begin();
-	for (int i = 0; i < ChildrenCount; ++i) {
-		if (children[i]) {
-			const binary &digest = children[i]->digest();
-			std::copy(digest.begin(), digest.begin() + 16, it);
+	binary data;
+	if (mFormat == Format::Compressed) {
+		// Version, then for each child: number, skipped levels, their child numbers, digest
+		data.push_back(byte(mFormat));
+		for (int i = 0; i < ChildrenCount; ++i) {
+			if (!children[i])
+				continue;
+
+			const Index &index = children[i]->index();
+			data.push_back(byte(i));
+			data.push_back(byte(index.length() - mIndex.length() - 1));
+			for (int depth = mIndex.length() + 1; depth < index.length(); ++depth)
+				data.push_back(byte(index.at(depth)));
+
+			const binary digest = children[i]->digest();
+			data.insert(data.end(), digest.begin(), digest.begin() + 16);
+		}
+	} else {
+		data.resize(ChildrenCount * 16, byte(0));
+		auto it = data.begin();
+		for (int i = 0; i < ChildrenCount; ++i) {
+			if (children[i]) {
+				const binary &digest = children[i]->digest();
+				std::copy(digest.begin(), digest.begin() + 16, it);
+			}
+			it += 16;
 		}
-		it += 16;
 	}
 
 	mDigest = store->insert(data); // populate will retrieve the data
@@ -160,9 +520,23 @@ Merkle::Node::Node(Index index, ChildrenArray children, shared_ptr<Store> store)
 
 Merkle::Node::~Node(void) {}
 
-void Merkle::Node::populate(shared_ptr<Store> store) {
+void Merkle::Node::populate(Merkle *merkle, const identifier &source) {
+	mMerkle = merkle;
+	mSource = source;
 	if (std::any_of(mDigest.begin(), mDigest.end(), [](byte b) { return b != byte(0); }))
-		store->request(mDigest, shared_from_this()); // will init resolved state
+		merkle->mStore->request(mDigest, shared_from_this(), mSource); // will init resolved state
+}
+
+void Merkle::Node::defer(const identifier &source) {
+	mSource = source;
+	mDeferred = true;
+	mResolved = true; // the parent does not wait for it
+}
+
+void Merkle::Node::resolve(Merkle *merkle) {
+	mDeferred = false;
+	mResolved = false;
+	populate(merkle, mSource);
 }
 
 void Merkle::Node::notify(const binary &digest, shared_ptr<binary> data, shared_ptr<Store> store) {
@@ -171,16 +545,23 @@ void Merkle::Node::notify(const binary &digest, shared_ptr<binary> data, shared_
 
 	mData = data;
 
-	if (!mChildren && mIndex.length() < 16) {
+	if (!mChildren && mIndex.length() < Index::MaxLength) {
 		ChildrenArray children;
-		auto it = data->begin();
-		for (int i = 0; i < ChildrenCount; ++i) {
-			if (std::any_of(it, it + 16, [](byte b) { return b != byte(0); })) {
-				children[i] = std::make_shared<Node>(Index(i, mIndex), binary(it, it + 16));
-				children[i]->populate(store);
-			}
-			it += 16;
+		if (!ParseChildren(mIndex, mFormat, *data, children)) {
+			std::cerr << "Invalid node " << to_hex(mDigest) << std::endl;
+			return;
 		}
+		for (auto &child : children) {
+			if (!child)
+				continue;
+
+			// A tree in the other format is fetched whole, it can only be converted from all leaves
+			if (mFormat != mMerkle->format() || mMerkle->isInterested(child->index()))
+				child->populate(mMerkle, mSource);
+			else
+				child->defer(mSource);
+		}
+
 		mChildren.emplace(std::move(children));
 	}
 
@@ -193,42 +574,65 @@ shared_ptr<Merkle::Node> Merkle::Node::child(Index target) {
 
 	int n = target.pop();
 	auto child = mChildren ? mChildren->at(n) : nullptr;
-	return child ? child->child(target) : nullptr;
+	if (!child)
+		return nullptr;
+
+	// Compressed children may skip levels
+	for (int depth = mIndex.length() + 1; depth < child->mIndex.length(); ++depth)
+		if (target.length() == 0 || target.pop() != child->mIndex.at(depth))
+			return nullptr;
+
+	return child->child(target);
+}
+
+shared_ptr<Merkle::Node> Merkle::Node::findDeferred(Index target) {
+	if (mDeferred)
+		return shared_from_this();
+
+	if (target.length() == 0 || !mChildren)
+		return nullptr;
+
+	auto child = mChildren->at(target.pop());
+	if (!child)
+		return nullptr;
+
+	for (int depth = mIndex.length() + 1; depth < child->mIndex.length(); ++depth)
+		if (target.length() == 0 || target.pop() != child->mIndex.at(depth))
+			return nullptr;
+
+	return child->findDeferred(target);
 }
 
-shared_ptr<Merkle::Node> Merkle::Node::fork(Index target, const binary &digest, bool markChanged,
-                                            Merkle *merkle) {
-	if (target.length() == 0) {
+shared_ptr<Merkle::Node> Merkle::Node::fork(Targets::iterator begin, Targets::iterator end,
+                                            bool markChanged, Merkle *merkle) {
+	if (begin->first.length() == 0) {
+		const binary &digest = begin->second;
 		std::cout << "Forking " << to_hex(mDigest) << " to " << to_hex(digest) << std::endl;
-		auto node = std::make_shared<Node>(mIndex, digest);
-		node->populate(merkle->mStore);
+		auto node = std::make_shared<Node>(mIndex, digest, mFormat);
+		node->populate(merkle);
 		if (markChanged)
 			node->markChangedData(merkle);
 		return node;
 	}
 
-	ChildrenArray children;
-	if (mChildren)
-		children = *mChildren;
-
-	int n = target.pop();
-	auto &child = children[n];
-	child = child ? child->fork(std::move(target), digest, markChanged, merkle)
-	              : merkle->createNode(Index(n, mIndex), std::move(target), digest);
-
-	auto node = std::make_shared<Node>(mIndex, std::move(children), merkle->mStore);
-	node->populate(merkle->mStore);
-	return node;
+	return merkle->buildNode(mIndex, mChildren ? *mChildren : ChildrenArray(), begin, end,
+	                         markChanged, mFormat);
 }
 
 shared_ptr<Merkle::Node> Merkle::Node::merge(shared_ptr<Node> other, Merkle *merkle) {
-	if (!other || !other->isResolved() || mIndex != other->mIndex)
+	if (!other || mIndex != other->mIndex)
 		throw std::runtime_error("Illegal node merge");
 
 	if (mDigest == other->mDigest)
 		return shared_from_this();
 
-	if (mIndex.length() < 16) {
+	// Without history neither side is known to be an ancestor, so both need content to merge
+	if (mDeferred || other->mDeferred || !mResolved || !other->mResolved) {
+		merkle->deferMerge(shared_from_this(), other);
+		return shared_from_this();
+	}
+
+	if (mIndex.length() < Index::MaxLength) {
 		ChildrenArray children = *mChildren;
 		ChildrenArray &others = *other->mChildren;
 		for (int i = 0; i < ChildrenCount; ++i) {
@@ -236,7 +640,7 @@ shared_ptr<Merkle::Node> Merkle::Node::merge(shared_ptr<Node> other, Merkle *mer
 				continue;
 
 			if (children[i]) {
-				children[i] = children[i]->merge(others[i], merkle);
+				children[i] = merkle->mergeNodes(children[i], others[i]);
 			} else {
 				children[i] = others[i];
 				children[i]->markChangedData(merkle);
@@ -246,17 +650,15 @@ shared_ptr<Merkle::Node> Merkle::Node::merge(shared_ptr<Node> other, Merkle *mer
 		if (children == *mChildren)
 			return shared_from_this();
 
-		auto node = std::make_shared<Node>(mIndex, children, merkle->mStore);
-		node->populate(merkle->mStore);
-		return node;
+		return merkle->createNode(mIndex, std::move(children), mFormat);
 	} else {
 		binary data = *other->data();
 		if (mData && !merkle->merge(*mData, data))
 			return shared_from_this();
 
 		auto digest = merkle->mStore->insert(data);
-		auto node = std::make_shared<Node>(mIndex, digest);
-		node->populate(merkle->mStore);
+		auto node = std::make_shared<Node>(mIndex, digest, mFormat);
+		node->populate(merkle);
 		node->markChangedData(merkle);
 		return node;
 	}
@@ -268,12 +670,28 @@ void Merkle::Node::markChangedData(Merkle *merkle) {
 			if (child)
 				child->markChangedData(merkle);
 		});
-	} else if (mResolved) {
+	} else if (mResolved && mData) {
 		std::cout << "Changed data for node " << to_hex(mDigest) << std::endl;
 		merkle->mChangedData[mIndex] = mData;
 	}
 }
 
+bool Merkle::Node::collectLeaves(Targets &targets) const {
+	if (mIndex.length() == Index::MaxLength) {
+		targets.emplace_back(mIndex, mDigest);
+		return true;
+	}
+	if (!mChildren)
+		return false;
+
+	bool complete = true;
+	for (const auto &child : *mChildren)
+		if (child && !child->collectLeaves(targets))
+			complete = false;
+
+	return complete;
+}
+
 void Merkle::Node::addResolvedCallback(ResolvedCallback callback) {
 	if (mResolved)
 		callback(shared_from_this());
@@ -314,6 +732,8 @@ void Merkle::Node::markResolved(void) {
 
 bool Merkle::Node::isResolved(void) const { return mResolved; }
 
+bool Merkle::Node::isDeferred(void) const { return mDeferred; }
+
 binary Merkle::Node::digest(void) const { return mDigest; }
 
 binary Merkle::Node::toBinary(void) const {
@@ -326,5 +746,97 @@ binary Merkle::Node::toBinary(void) const {
 
 std::optional<Merkle::Node::ChildrenArray> Merkle::Node::children(void) const { return mChildren; }
 
+bool Merkle::Node::ParseChildren(const Index &index, Format format, const binary &data,
+                                 ChildrenArray &children) {
+	if (format == Format::Compressed)
+		return ParseCompressed(index, data, children);
+
+	if (data.size() != ChildrenCount * 16)
+		return false;
+
+	auto it = data.begin();
+	for (int i = 0; i < ChildrenCount; ++i) {
+		if (std::any_of(it, it + 16, [](byte b) { return b != byte(0); }))
+			children[i] = std::make_shared<Node>(Index(i, index), binary(it, it + 16), format);
+		it += 16;
+	}
+	return true;
+}
+
+bool Merkle::Node::ParseCompressed(const Index &parent, const binary &data,
+                                   ChildrenArray &children) {
+	if (data.empty() || data[0] != byte(Format::Compressed))
+		return false;
+
+	size_t i = 1;
+	while (i < data.size()) {
+		if (i + 2 > data.size())
+			return false;
+
+		const int n = std::to_integer<int>(data[i++]);
+		const int skip = std::to_integer<int>(data[i++]);
+		if (n >= ChildrenCount || children[n] || parent.length() + 1 + skip > Index::MaxLength ||
+		    i + skip + 16 > data.size())
+			return false;
+
+		Index index(n, parent);
+		for (int k = 0; k < skip; ++k) {
+			const int v = std::to_integer<int>(data[i++]);
+			if (v >= ChildrenCount)
+				return false;
+			index = Index(v, index);
+		}
+
+		children[n] = std::make_shared<Node>(std::move(index), binary(data.begin() + i,
+		                                     data.begin() + i + 16), Format::Compressed);
+		i += 16;
+	}
+	return true;
+}
+
+Merkle::Walker::Walker(shared_ptr<Store> store, const binary &digest, Format format,
+                       Filter filter)
+    : mStore(std::move(store)), mFormat(format), mFilter(std::move(filter)) {
+	push(Index(), digest);
+}
+
+Merkle::Walker::~Walker(void) {}
+
+shared_ptr<binary> Merkle::Walker::next(void) {
+	while (!mStack.empty()) {
+		auto &frame = mStack.back();
+		if (frame.next < frame.children.size()) {
+			auto child = frame.children[frame.next++];
+			push(child->index(), child->digest()); // invalidates frame
+			continue;
+		}
+
+		auto data = std::move(frame.data);
+		mStack.pop_back();
+		return data;
+	}
+
+	return nullptr;
+}
+
+void Merkle::Walker::push(const Index &index, const binary &digest) {
+	if (mFilter && !mFilter(index))
+		return;
+
+	Frame frame;
+	frame.data = mStore->retrieve(digest);
+	if (!frame.data)
+		return;
+
+	Node::ChildrenArray children;
+	if (index.length() < Index::MaxLength &&
+	    Node::ParseChildren(index, mFormat, *frame.data, children))
+		for (auto &child : children)
+			if (child)
+				frame.children.push_back(std::move(child));
+
+	mStack.push_back(std::move(frame));
+}
+
 } // namespace convergence
 
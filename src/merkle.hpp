@@ -24,6 +24,7 @@
 #include "src/include.hpp"
 #include "src/store.hpp"
 
+#include <map>
 #include <unordered_map>
 #include <unordered_set>
 #include <array>
@@ -38,54 +39,83 @@ public:
 
 	virtual void update(double time);
 
+	// Node encodings: Full stores all 64 child digests at every level, Compressed skips levels
+	// with a single child and lists children sparsely. Peers only running Full are legacy ones.
+	enum class Format : uint8_t { Full = 1, Compressed = 2 };
+
+	// Up to 16 six-bit child numbers packed 8 per word, leaf-most first
 	class Index {
 	public:
+		static const int MaxLength = 16;
+
 		Index(void);
 		Index(const binary &data);
 		Index(int child, const Index &parent);
-		template <typename Iterator> Index(Iterator begin, Iterator end) : mValues(begin, end) {}
+		template <typename Iterator> Index(Iterator begin, Iterator end) {
+			for (auto it = begin; it != end; ++it)
+				push(*it);
+		}
 		~Index(void);
 
 		int length(void) const;
+		int peek(void) const; // next child from the root side
 		int pop(void);
 		void push(int child);
 
 		Index parent(void) const;
 		int child(void) const;
+		int at(int depth) const; // child number at depth from the root
 
-		bool operator==(const Index &other) const { return mValues == other.mValues; }
-		bool operator!=(const Index &other) const { return mValues != other.mValues; }
+		bool operator==(const Index &other) const {
+			return mWords == other.mWords && mLength == other.mLength;
+		}
+		bool operator!=(const Index &other) const { return !(*this == other); }
+		bool operator<(const Index &other) const; // order of paths from the root
 
 		struct hash {
 			std::size_t operator()(const Index &index) const noexcept {
-				std::size_t seed = 0;
-				std::for_each(index.mValues.begin(), index.mValues.end(),
-				              [&seed](int v) { hash_combine(seed, v); });
+				std::size_t seed = index.mLength;
+				hash_combine(seed, index.mWords[0]);
+				hash_combine(seed, index.mWords[1]);
 				return seed;
 			}
 		};
 
-	protected:
-		std::vector<int> mValues;
+	private:
+		int value(int i) const;
+
+		std::array<uint64_t, 2> mWords = {}; // bits beyond mLength are kept zero
+		uint8_t mLength = 0;
 	};
 
+	// Remaining paths to leaves with their new digests
+	using Targets = std::vector<std::pair<Index, binary>>;
+
 	class Node : public Store::Notifiable, public std::enable_shared_from_this<Node> {
 	public:
 		static const int ChildrenCount = 64;
 		using ChildrenArray = std::array<shared_ptr<Node>, ChildrenCount>;
 
-		Node(Index index, binary digest);
-		Node(Index index, ChildrenArray children, shared_ptr<Store> store);
+		Node(Index index, binary digest, Format format);
+		Node(Index index, ChildrenArray children, shared_ptr<Store> store, Format format);
 		virtual ~Node(void);
 
+		const Index &index(void) const { return mIndex; }
+		Format format(void) const { return mFormat; }
+
 		shared_ptr<binary> data() { return mData; }
 
-		void populate(shared_ptr<Store> store);
+		void populate(Merkle *merkle, const identifier &source = identifier());
+		void defer(const identifier &source);
+		void resolve(Merkle *merkle);
 		void notify(const binary &digest, shared_ptr<binary> data, shared_ptr<Store> store);
 		shared_ptr<Node> child(Index index);
-		shared_ptr<Node> fork(Index target, const binary &digest, bool markChanged, Merkle *merkle);
+		shared_ptr<Node> findDeferred(Index index); // deferred node on the path, if any
+		shared_ptr<Node> fork(Targets::iterator begin, Targets::iterator end, bool markChanged,
+		                      Merkle *merkle);
 		shared_ptr<Node> merge(shared_ptr<Node> other, Merkle *merkle);
 		void markChangedData(Merkle *merkle);
+		bool collectLeaves(Targets &targets) const; // false if a subtree is missing
 
 		using ResolvedCallback = std::function<void(shared_ptr<Node>)>;
 		void addResolvedCallback(ResolvedCallback callback);
@@ -94,42 +124,118 @@ public:
 		void checkResolved(void);
 		void markResolved(void);
 		bool isResolved(void) const;
+		bool isDeferred(void) const;
 
 		binary digest(void) const;
 		binary toBinary(void) const;
 
 		std::optional<ChildrenArray> children(void) const;
 
+		// Unpopulated children of a node with the given data
+		static bool ParseChildren(const Index &index, Format format, const binary &data,
+		                          ChildrenArray &children);
+
 	private:
+		static bool ParseCompressed(const Index &index, const binary &data,
+		                            ChildrenArray &children);
+
 		const Index mIndex;
+		const Format mFormat;
 		binary mDigest;
+		Merkle *mMerkle = nullptr;
+		identifier mSource; // peer expected to hold the data
 		std::optional<ChildrenArray> mChildren;
 		shared_ptr<binary> mData;
 		std::list<ResolvedCallback> mResolvedCallbacks;
 		bool mResolved = false;
+		bool mDeferred = false; // outside the interest, only known by digest
+	};
+
+	// Walks a stored subtree children first, so a receiver has the whole subtree when the root
+	// arrives. Subtrees rejected by the filter and nodes missing from the store are skipped.
+	class Walker {
+	public:
+		using Filter = std::function<bool(const Index &index)>;
+
+		Walker(shared_ptr<Store> store, const binary &digest, Format format,
+		       Filter filter = nullptr);
+		~Walker(void);
+
+		shared_ptr<binary> next(void); // null when done
+
+	private:
+		struct Frame {
+			shared_ptr<binary> data;
+			std::vector<shared_ptr<Node>> children;
+			size_t next = 0;
+		};
+
+		void push(const Index &index, const binary &digest);
+
+		const shared_ptr<Store> mStore;
+		const Format mFormat;
+		const Filter mFilter;
+		std::vector<Frame> mStack;
 	};
 
 	shared_ptr<Node> get(Index target) const;
 	shared_ptr<Node> root() const;
 	binary rootDigest() const;
+	binary rootDigest(Format format); // empty if leaves are missing, nodes are stored
+	size_t hashedNodes() const; // interior nodes rebuilt by updates
+	Format format() const;
 
 protected:
-	void updateRoot(const binary &digest);
+	void setFormat(Format format); // re-encodes the current tree
+	void updateRoot(const binary &digest, Format format = Format::Full,
+	                const identifier &source = identifier());
 	void updateData(Index index, const binary &data, bool change = false);
+	void updateData(std::vector<std::pair<Index, binary>> updates, bool change = false);
 
 	virtual bool merge(const binary &a, binary &b) = 0;
 	virtual bool changeData(const Index &index, const binary &data) = 0;
 	virtual bool propagateRoot(const binary &digest) = 0;
 
+	// Leaf data as encoded in trees of the format, unchanged by default
+	virtual binary convertData(const binary &data, Format format);
+
+	// Subtrees not of interest are left unresolved, and only fetched to merge a different one
+	virtual bool isInterested(const Index &index) const;
+	void updateInterest(void); // resolves deferred subtrees now of interest
+
 private:
 	void mergeRoot(shared_ptr<Node> node);
-	shared_ptr<Node> createNode(Index index, binary digest);
-	shared_ptr<Node> createNode(Index index, Index target, binary digest);
+	void deferMerge(shared_ptr<Node> a, shared_ptr<Node> b); // merges again once resolved
+	void applyTargets(Targets targets, bool change);
+	void resolveDeferred(shared_ptr<Node> node);
+	void updateInterest(shared_ptr<Node> node);
+	shared_ptr<Node> createNode(Index index, binary digest, Format format);
+	shared_ptr<Node> createNode(Index index, Node::ChildrenArray children, Format format);
+	shared_ptr<Node> createNode(Index index, Targets::iterator begin, Targets::iterator end,
+	                            bool markChanged, Format format);
+	shared_ptr<Node> buildNode(Index index, Node::ChildrenArray children, Targets::iterator begin,
+	                           Targets::iterator end, bool markChanged, Format format);
+	shared_ptr<Node> forkChild(Index index, shared_ptr<Node> child, Targets::iterator begin,
+	                           Targets::iterator end, bool markChanged, Format format);
+	shared_ptr<Node> mergeNodes(shared_ptr<Node> a, shared_ptr<Node> b);
+	shared_ptr<Node> convertTree(shared_ptr<Node> root, Format format);
+	bool convertLeaves(Targets &targets, Format format); // false if leaf data is missing
 
 	const shared_ptr<Store> mStore;
 	shared_ptr<Node> mRoot;
 	std::unordered_map<binary, shared_ptr<Node>, binary_hash> mCandidates;
 	std::unordered_map<Index, shared_ptr<binary>, Index::hash> mChangedData;
+	Targets mPendingTargets;                      // local updates waiting for deferred subtrees
+	shared_ptr<Node> mMergingRoot;                // incoming root being merged
+	std::vector<shared_ptr<Node>> mPendingMerges; // roots to merge again, see deferMerge()
+	std::mutex mPendingMergesMutex;               // callbacks may run under mMutex
+
+	Format mFormat = Format::Compressed;
+	shared_ptr<Node> mEncodedRoot; // mRoot in the other format, built on demand
+	binary mEncodedRootSource;     // digest of mRoot when it was built
+	// Leaf digests of the current tree re-encoded in each format, see convertLeaves()
+	std::map<Format, std::unordered_map<binary, binary, binary_hash>> mConvertedLeaves;
+	size_t mHashedNodes = 0;
 
 	mutable std::mutex mMutex;
 };
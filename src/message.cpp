@@ -21,38 +21,94 @@
 #include "src/message.hpp"
 
 #include "pla/binaryformatter.hpp"
+#include "pla/compression.hpp"
 
 namespace convergence {
 
 using pla::BinaryFormatter;
 
+// Set in the serialized type when the payload is compressed
+const uint32_t CompressedFlag = 0x80000000;
+const size_t MinCompressedSize = 64;
+const size_t MaxPayloadSize = 16 * 1024 * 1024;
+
+// Type, size, source, destination
+const size_t HeaderSize = 4 + 4 + 16 + 16;
+const size_t DestinationOffset = 4 + 4 + 16;
+
+static bool IsCompressible(Message::Type type) {
+	switch (type) {
+	case Message::Gossip:
+	case Message::Store:
+	case Message::StoreBatch:
+	case Message::TerrainUpdate:
+	case Message::TerrainDelta:
+	case Message::TerrainSnapshot:
+		return true;
+	default:
+		return false;
+	}
+}
+
 Message::Message(Type _type) : type(_type) {}
 
-Message::Message(const binary &data) {
+Message::Message(const binary &data) : Message(binary(data)) {}
+
+Message::Message(binary &&data) {
 	uint32_t size = 0;
 	uint32_t tmpType = 0;
 
 	BinaryFormatter formatter(data);
-	formatter >> tmpType >> size;
-	payload.resize(size);
-	type = Type(tmpType);
+	if (!(formatter >> tmpType >> size >> source >> destination))
+		throw std::runtime_error("Invalid message");
+
+	type = Type(tmpType & ~CompressedFlag);
+
+	// The received buffer is reused for the payload: no allocation, but erasing the header
+	// shifts the payload down, which is still a copy of its size
+	data.erase(data.begin(), data.begin() + HeaderSize);
+	data.resize(std::min(data.size(), size_t(size)));
+	payload = std::move(data);
 
-	formatter >> source;
-	formatter >> destination;
-	formatter >> payload;
+	if (tmpType & CompressedFlag) {
+		auto decompressed = pla::decompress(payload, MaxPayloadSize);
+		if (!decompressed)
+			throw std::runtime_error("Invalid compressed message");
+
+		payload = std::move(*decompressed);
+	}
 }
 
-Message::operator binary(void) const {
-	uint32_t size(payload.size());
+Message::operator binary(void) const { return toBinary(false); }
+
+binary Message::toBinary(bool compress) const {
+	uint32_t tmpType = uint32_t(type);
+	binary compressed;
+	if (compress && IsCompressible(type) && payload.size() >= MinCompressedSize) {
+		compressed = pla::compress(payload);
+		if (compressed.size() < payload.size())
+			tmpType |= CompressedFlag;
+	}
+
+	const binary &data = tmpType & CompressedFlag ? compressed : payload;
+	uint32_t size(data.size());
 
 	BinaryFormatter formatter;
-	formatter << uint32_t(type) << size;
+	formatter.data().reserve(HeaderSize + data.size());
+	formatter << tmpType << size;
 
 	formatter << source;
 	formatter << destination;
-	formatter << payload;
+	formatter << data;
+
+	return std::move(formatter.data());
+}
+
+void Message::SetDestination(binary &data, const identifier &destination) {
+	if (data.size() < HeaderSize)
+		throw std::runtime_error("Invalid message");
 
-	return formatter.data();
+	std::copy(destination.begin(), destination.end(), data.begin() + DestinationOffset);
 }
 
 } // namespace convergence
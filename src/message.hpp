@@ -40,26 +40,41 @@ public:
 		// Peering
 		Description = 0x11,
 		Candidate = 0x12,
+		Gossip = 0x13, // broadcast relayed through the overlay
+		Prune = 0x14,  // stop relaying broadcasts from the sources
+		Graft = 0x15,  // relay them again, from all sources if none
 
 		// Player
 		EntityReserved = 0x20,
 		EntityTransform = 0x21,
 		EntitySpeed = 0x22,
 		EntityControl = 0x23,
+		EntitySnapshot = 0x24,
 
 		// Store
 		Store = 0x30,
 		Request = 0x31,
+		StoreBatch = 0x32,
+		RequestBatch = 0x33,
 
 		// Terrain
 		TerrainRoot = 0x40,
-		TerrainUpdate = 0x41
+		TerrainUpdate = 0x41,
+		TerrainCompressedRoot = 0x42, // ignored by legacy peers
+		TerrainDelta = 0x43,
+		TerrainSnapshotRequest = 0x44,
+		TerrainSnapshot = 0x45 // chunk of a subtree, children first
 	};
 
 	Message(Type _type = Dummy);
 	Message(const binary &data);
+	Message(binary &&data); // the payload takes over the buffer
 
 	operator binary(void) const;
+	binary toBinary(bool compress) const; // compress only if the receiver supports it
+
+	// Rewrites the destination of a serialized message in place
+	static void SetDestination(binary &data, const identifier &destination);
 
 	Type type;
 	identifier source;
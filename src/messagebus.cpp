@@ -22,8 +22,8 @@
 
 #include "pla/binaryformatter.hpp"
 
-#include <chrono>
-#include <list>
+#include <algorithm>
+#include <numeric>
 #include <random>
 
 namespace convergence {
@@ -32,13 +32,49 @@ using pla::binary;
 using pla::BinaryFormatter;
 using pla::to_hex;
 
-MessageBus::MessageBus(void) {
-	using clock = std::chrono::high_resolution_clock;
-	using random_bytes_engine =
-	    std::independent_bits_engine<std::default_random_engine, CHAR_BIT, unsigned char>;
-	random_bytes_engine rbe;
-	rbe.seed(clock::now().time_since_epoch() / std::chrono::milliseconds(1));
-	std::generate(mLocalId.begin(), mLocalId.end(), [&rbe]() { return byte(rbe()); });
+const size_t DefaultSendRate = 2 * 1024 * 1024; // bytes per second per channel
+const size_t DefaultSendBurst = 256 * 1024;
+
+const uint8_t GossipHops = 64; // duplicates are dropped anyway, this only bounds paths
+const double GraftPeriod = 10.;  // seconds
+
+static Scheduler::Class Classify(Message::Type type) {
+	switch (type) {
+	case Message::TerrainUpdate:
+	case Message::TerrainDelta:
+	case Message::Request:
+	case Message::RequestBatch:
+	case Message::TerrainSnapshotRequest:
+		return Scheduler::Terrain;
+	case Message::Store:
+	case Message::StoreBatch:
+	case Message::TerrainSnapshot:
+		return Scheduler::Bulk;
+	default:
+		return Scheduler::Control; // signaling, entity state and root announcements
+	}
+}
+
+// Only the latest state matters, so a lost message must not delay the next ones
+static bool IsLatestWins(Message::Type type) {
+	switch (type) {
+	case Message::EntityTransform:
+	case Message::EntitySpeed:
+	case Message::EntityControl:
+	case Message::EntitySnapshot:
+		return true;
+	default:
+		return false;
+	}
+}
+
+MessageBus::MessageBus(void)
+    : mSendRate(DefaultSendRate), mSendBurst(DefaultSendBurst),
+      mListeners(std::make_shared<Listeners>()) {
+	// Identifiers key routes and broadcast deduplication, so they must not collide. A clock seed
+	// only gave a few hundred distinct identifiers.
+	std::random_device device;
+	std::generate(mLocalId.begin(), mLocalId.end(), [&device]() { return byte(device()); });
 
 	std::cout << "Local identifier: " << to_hex(mLocalId) << std::endl;
 }
@@ -50,6 +86,8 @@ identifier MessageBus::localId(void) const { return mLocalId; }
 void MessageBus::addRoute(const identifier &id, shared_ptr<Channel> channel, Priority priority) {
 	std::lock_guard<std::mutex> lock(mRoutesMutex);
 	mRoutes[id][priority] = channel;
+	if (priority == Priority::Direct)
+		mNeighbors[channel] = id;
 }
 
 void MessageBus::removeRoute(const identifier &id, shared_ptr<Channel> channel) {
@@ -67,9 +105,21 @@ void MessageBus::removeRoute(const identifier &id, shared_ptr<Channel> channel)
 		if (map.empty())
 			mRoutes.erase(it);
 	}
+
+	if (auto it = mNeighbors.find(channel); it != mNeighbors.end() && it->second == id)
+		mNeighbors.erase(it);
+
+	auto jt = mUnreliableRoutes.find(id);
+	if (jt != mUnreliableRoutes.end() && jt->second == channel)
+		mUnreliableRoutes.erase(jt);
 }
 
 void MessageBus::removeAllRoutes(shared_ptr<Channel> channel) {
+	{
+		std::lock_guard<std::mutex> lock(mSchedulersMutex);
+		mSchedulers.erase(channel);
+	}
+
 	std::lock_guard<std::mutex> lock(mRoutesMutex);
 	auto it = mRoutes.begin();
 	while (it != mRoutes.end()) {
@@ -86,18 +136,39 @@ void MessageBus::removeAllRoutes(shared_ptr<Channel> channel) {
 		else
 			++it;
 	}
+
+	mNeighbors.erase(channel);
+
+	auto jt = mUnreliableRoutes.begin();
+	while (jt != mUnreliableRoutes.end()) {
+		if (jt->second == channel)
+			jt = mUnreliableRoutes.erase(jt);
+		else
+			++jt;
+	}
 }
 
 void MessageBus::addChannel(shared_ptr<Channel> channel, Priority priority) {
 	channel->onMessage(
-	    [this, channel, priority](const binary &data) {
+	    [this, channel, priority](binary data) {
 		    // This can be called on non-main thread
-		    Message message(data);
+		    Message message(std::move(data));
 
-		    if (!message.source.isNull()) {
+		    // Routes through neighbors are only learned from broadcasts, see gossip()
+		    if (!message.source.isNull() && priority != Priority::Relay &&
+		        message.type != Message::Gossip) {
 			    addRoute(message.source, channel, priority);
 		    }
 
+		    if (message.type == Message::Join && !message.payload.empty()) {
+			    auto capabilities = std::to_integer<uint8_t>(message.payload[0]);
+			    std::lock_guard<std::mutex> lock(mRoutesMutex);
+			    if (capabilities & Capability::Compression)
+				    mCompressionPeers.insert(message.source);
+			    if (capabilities & Capability::Gossip)
+				    mGossipPeers.insert(message.source);
+		    }
+
 		    if (message.type == Message::List) {
 			    identifier peerId;
 			    BinaryFormatter formatter(message.payload);
@@ -107,8 +178,13 @@ void MessageBus::addChannel(shared_ptr<Channel> channel, Priority priority) {
 					    dispatchPeer(peerId);
 				    }
 			    }
+		    } else if (message.type == Message::Gossip) {
+			    gossip(message, channel);
+		    } else if ((message.type == Message::Prune || message.type == Message::Graft) &&
+		               message.destination == mLocalId) {
+			    receiveOverlay(message);
 		    } else {
-			    route(message);
+			    route(message, channel);
 		    }
 	    },
 	    [](const string &data) {
@@ -117,20 +193,63 @@ void MessageBus::addChannel(shared_ptr<Channel> channel, Priority priority) {
 
 	Message message(Message::Join);
 	message.source = mLocalId;
+	// Legacy peers send no capabilities
+	message.payload.push_back(byte(Capability::Compression | Capability::Gossip));
 	channel->send(message);
 
 	std::lock_guard<std::mutex> lock(mChannelsMutex);
 	mChannels.insert(channel);
 }
 
+void MessageBus::addUnreliableChannel(const identifier &id, shared_ptr<Channel> channel) {
+	channel->onMessage(
+	    [this, id, channel](binary data) {
+		    // This can be called on non-main thread
+		    Message message(std::move(data));
+
+		    // Only broadcasts are relayed on this channel
+		    if (message.type == Message::Gossip)
+			    gossip(message, channel);
+		    else if (message.source == id && IsLatestWins(message.type) &&
+		             (message.destination == mLocalId || message.destination.isNull()))
+			    dispatch(message);
+	    },
+	    [](const string &data) {
+		    // Ignore
+	    });
+
+	{
+		std::lock_guard<std::mutex> lock(mRoutesMutex);
+		mUnreliableRoutes[id] = channel;
+	}
+
+	std::lock_guard<std::mutex> lock(mChannelsMutex);
+	mChannels.insert(channel);
+}
+
 void MessageBus::removeChannel(shared_ptr<Channel> channel) {
+	identifier neighbor;
+	{
+		std::lock_guard<std::mutex> lock(mRoutesMutex);
+		if (auto it = mNeighbors.find(channel); it != mNeighbors.end())
+			neighbor = it->second;
+	}
+
 	removeAllRoutes(channel);
 
-	std::lock_guard<std::mutex> lock(mChannelsMutex);
-	auto it = mChannels.find(channel);
-	if (it != mChannels.end()) {
-		mChannels.erase(it);
-		channel->onMessage([](const binary &data) {}, [](const string &data) {});
+	{
+		std::lock_guard<std::mutex> lock(mChannelsMutex);
+		auto it = mChannels.find(channel);
+		if (it != mChannels.end()) {
+			mChannels.erase(it);
+			channel->onMessage([](const binary &data) {}, [](const string &data) {});
+		}
+	}
+
+	// Broadcasts pruned from other links may have gone through the neighbor
+	if (!neighbor.isNull()) {
+		mOverlay.removeNeighbor(neighbor);
+		graftNeighbors();
 	}
 }
 
@@ -142,144 +261,518 @@ void MessageBus::send(Message &message) {
 		broadcast(message);
 }
 
+std::vector<identifier> MessageBus::peers(void) {
+	auto listeners = std::atomic_load(&mListeners);
+	std::vector<identifier> result;
+	for (const auto &[id, remotes] : listeners->remotes)
+		if (id != mLocalId && std::any_of(remotes.begin(), remotes.end(),
+		                                  [](const auto &l) { return !l.expired(); }))
+			result.push_back(id);
+
+	return result;
+}
+
 void MessageBus::broadcast(Message &message) {
 	message.source = mLocalId;
 
-	// Broadcast to remote ids that have local listeners
-	std::list<identifier> destinations;
+	bool overlay;
 	{
-		std::lock_guard<std::mutex> lock(mListenersMutex);
-		binary last;
-		auto it = mListeners.begin();
-		while (it != mListeners.end()) {
-			if (last == it->first) {
-				++it;
-				continue;
-			}
+		std::lock_guard<std::mutex> lock(mRoutesMutex);
+		overlay = !mNeighbors.empty();
+	}
 
-			last = it->first;
+	if (overlay) {
+		// Each neighbor gets one copy and relays it to its own neighbors
+		BinaryFormatter formatter;
+		formatter << mOverlay.nextSequence() << uint8_t(GossipHops);
+		formatter << uint32_t(message.type) << message.payload;
+
+		Message envelope(Message::Gossip);
+		envelope.source = mLocalId;
+		envelope.payload = std::move(formatter.data());
+		sendGossip(envelope, message, identifier());
+		return;
+	}
 
-			if (auto l = it->second.lock()) {
-				if (it->first != mLocalId)
-					destinations.push_back(it->first);
-				++it;
-			} else {
-				it = mListeners.erase(it);
-			}
+	// Without neighbors yet, broadcast to remote ids that have local listeners. The message is
+	// serialized once per encoding, then only the destination is rewritten for each peer.
+	binary encoded[2];
+	for (auto d : peers()) {
+		shared_ptr<Channel> channel = findRoute(d, message.type, message.source);
+		if (!channel)
+			continue;
+
+		bool compress;
+		{
+			std::lock_guard<std::mutex> lock(mRoutesMutex);
+			compress = mCompressionPeers.count(d) > 0;
 		}
-	}
 
-	for (auto d : destinations) {
-		message.destination = d;
-		route(message);
-	}
+		binary &data = encoded[compress];
+		if (data.empty())
+			data = message.toBinary(compress);
 
-	message.destination.clear();
+		Message::SetDestination(data, d);
+		getScheduler(channel)->send(data.data(), data.size(), Classify(message.type));
+	}
 }
 
 void MessageBus::dispatch(const Message &message) {
-	std::list<shared_ptr<Listener>> listeners;
-	{
-		std::lock_guard<std::mutex> lock(mListenersMutex);
-		auto range = mTypeListeners.equal_range(message.type);
-		auto it = range.first;
-		while (it != range.second) {
-			if (auto l = it->second.lock()) {
-				listeners.push_back(l);
-				++it;
-			} else {
-				it = mTypeListeners.erase(it);
-			}
+	// The snapshot keeps the registrations alive even if they are replaced meanwhile
+	auto listeners = std::atomic_load(&mListeners);
+
+	if (auto it = listeners->types.find(message.type); it != listeners->types.end())
+		for (const auto &weak : it->second)
+			if (auto l = weak.lock())
+				l->onMessage(message);
+
+	// Type listeners may register a listener for the source, like a peering on an incoming offer
+	listeners = std::atomic_load(&mListeners);
+
+	if (auto it = listeners->remotes.find(message.source); it != listeners->remotes.end())
+		for (const auto &weak : it->second)
+			if (auto l = weak.lock())
+				l->onMessage(message);
+}
+
+void MessageBus::dispatchPeer(const identifier &id) {
+	auto listeners = std::atomic_load(&mListeners);
+	for (const auto &[type, typeListeners] : listeners->types)
+		for (const auto &weak : typeListeners)
+			if (auto l = weak.lock())
+				l->onPeer(id);
+}
+
+void MessageBus::registerTypeListener(Message::Type type, weak_ptr<Listener> listener) {
+	updateListeners([&](Listeners &listeners) { listeners.types[type].push_back(listener); });
+}
+
+void MessageBus::registerListener(const identifier &remoteId, weak_ptr<Listener> listener) {
+	updateListeners(
+	    [&](Listeners &listeners) { listeners.remotes[remoteId].push_back(listener); });
+}
+
+void MessageBus::updateListeners(std::function<void(Listeners &)> update) {
+	std::lock_guard<std::mutex> lock(mListenersMutex);
+	auto listeners = std::make_shared<Listeners>(*mListeners);
+	update(*listeners);
+
+	// Expired listeners are dropped here instead of on dispatch
+	auto prune = [](auto &map) {
+		for (auto it = map.begin(); it != map.end();) {
+			auto &v = it->second;
+			v.erase(std::remove_if(v.begin(), v.end(), [](const auto &l) { return l.expired(); }),
+			        v.end());
+			it = v.empty() ? map.erase(it) : std::next(it);
+		}
+	};
+	prune(listeners->types);
+	prune(listeners->remotes);
+
+	std::atomic_store(&mListeners, shared_ptr<const Listeners>(std::move(listeners)));
+}
+
+void MessageBus::route(Message &message, shared_ptr<Channel> from) {
+	if (message.destination == mLocalId || message.destination.isNull()) {
+		dispatch(message);
+	} else {
+		// Never send a relayed message back where it came from
+		shared_ptr<Channel> channel =
+		    findRoute(message.destination, message.type, message.source, from);
+		if (!channel)
+			return;
+
+		bool compress;
+		{
+			std::lock_guard<std::mutex> lock(mRoutesMutex);
+			compress = mCompressionPeers.count(message.destination) > 0;
 		}
+		binary data = message.toBinary(compress);
+		getScheduler(channel)->send(data.data(), data.size(), Classify(message.type));
 	}
+}
+
+void MessageBus::gossip(Message &envelope, shared_ptr<Channel> from) {
+	// Sequence, remaining hops, then the broadcast message type and payload
+	uint32_t sequence = 0;
+	uint8_t hops = 0;
+	uint32_t type = 0;
+	BinaryFormatter formatter(envelope.payload);
+	if (!(formatter >> sequence >> hops >> type))
+		return;
 
-	for (auto l : listeners)
-		l->onMessage(message);
+	if (envelope.source.isNull() || envelope.source == mLocalId)
+		return;
 
-	listeners.clear();
+	identifier neighbor;
+	bool reliable = false;
 	{
-		std::lock_guard<std::mutex> lock(mListenersMutex);
-		auto range = mListeners.equal_range(message.source);
-		auto it = range.first;
-		while (it != range.second) {
-			if (auto l = it->second.lock()) {
-				listeners.push_back(l);
-				++it;
-			} else {
-				it = mListeners.erase(it);
-			}
+		std::lock_guard<std::mutex> lock(mRoutesMutex);
+		if (auto it = mNeighbors.find(from); it != mNeighbors.end()) {
+			neighbor = it->second;
+			reliable = true;
+		} else {
+			for (const auto &[id, channel] : mUnreliableRoutes)
+				if (channel == from)
+					neighbor = id;
 		}
 	}
 
-	for (auto l : listeners)
-		l->onMessage(message);
+	// Duplicates prune links, the prunes are sent in batches on update()
+	auto arrival = mOverlay.receive(envelope.source, sequence, neighbor);
+	if (arrival.graft)
+		sendOverlay(Message::Graft, neighbor, envelope.source);
+
+	if (arrival.duplicate)
+		return;
+
+	// The neighbor which delivered the latest broadcast first is on a shortest path to the
+	// source. Routes only ever point to such neighbors, so they can't form loops.
+	if (arrival.newest && reliable)
+		addRoute(envelope.source, from, Priority::Relay);
+
+	// Sources are peers too, networking can open peerings to them
+	if (arrival.discovered)
+		dispatchPeer(envelope.source);
+
+	Message message(static_cast<Message::Type>(type));
+	message.source = envelope.source;
+	message.destination = mLocalId;
+	message.payload = formatter.remaining();
+	dispatch(message);
+
+	if (hops > 1) {
+		envelope.payload[sizeof(sequence)] = byte(hops - 1);
+		sendGossip(envelope, message, neighbor);
+	}
 }
 
-void MessageBus::dispatchPeer(const identifier &id) {
-	std::list<shared_ptr<Listener>> listeners;
+void MessageBus::sendGossip(const Message &envelope, const Message &message,
+                            const identifier &except) {
+	// Legacy neighbors get the message itself, they don't relay it
+	std::vector<std::tuple<identifier, bool, bool>> neighbors; // id, overlay, compression
 	{
-		std::lock_guard<std::mutex> lock(mListenersMutex);
-		auto it = mTypeListeners.begin();
-		while (it != mTypeListeners.end()) {
-			if (auto l = it->second.lock()) {
-				listeners.push_back(l);
-				++it;
-			} else {
-				it = mTypeListeners.erase(it);
-			}
+		std::lock_guard<std::mutex> lock(mRoutesMutex);
+		for (const auto &[channel, id] : mNeighbors) {
+			if (id == except || id == envelope.source || mOverlay.isPruned(id, envelope.source))
+				continue;
+
+			neighbors.emplace_back(id, mGossipPeers.count(id) > 0, mCompressionPeers.count(id) > 0);
 		}
 	}
 
-	for (auto l : listeners)
-		l->onPeer(id);
+	binary encoded[2][2]; // per overlay support and compression
+	for (const auto &[id, overlay, compress] : neighbors) {
+		// Envelopes are accepted from any neighbor on the unreliable channel, not plain copies
+		const identifier &source = overlay ? mLocalId : message.source;
+		shared_ptr<Channel> channel = findRoute(id, message.type, source);
+		if (!channel)
+			continue;
+
+		binary &data = encoded[overlay][compress];
+		if (data.empty())
+			data = overlay ? envelope.toBinary(compress) : message.toBinary(compress);
+
+		if (!overlay)
+			Message::SetDestination(data, id);
+
+		getScheduler(channel)->send(data.data(), data.size(), Classify(message.type));
+	}
 }
 
-void MessageBus::registerTypeListener(Message::Type type, weak_ptr<Listener> listener) {
-	std::lock_guard<std::mutex> lock(mListenersMutex);
-	mTypeListeners.insert(std::make_pair(type, listener));
+void MessageBus::receiveOverlay(const Message &message) {
+	// The source of the message is the neighbor
+	identifier source;
+	BinaryFormatter formatter(message.payload);
+	if (message.type == Message::Graft && message.payload.empty()) {
+		mOverlay.graftAll(message.source);
+		return;
+	}
+
+	while (formatter >> source) {
+		if (message.type == Message::Prune)
+			mOverlay.prune(message.source, source);
+		else
+			mOverlay.graft(message.source, source);
+	}
 }
 
-void MessageBus::registerListener(const identifier &remoteId, weak_ptr<Listener> listener) {
-	std::lock_guard<std::mutex> lock(mListenersMutex);
-	mListeners.insert(std::make_pair(remoteId, listener));
+void MessageBus::sendOverlay(Message::Type type, const identifier &neighbor, binary payload) {
+	Message message(type);
+	message.destination = neighbor;
+	message.payload = std::move(payload);
+	send(message);
 }
 
-void MessageBus::route(Message &message) {
-	if (message.destination == mLocalId || message.destination.isNull()) {
-		dispatch(message);
-	} else {
-		shared_ptr<Channel> channel = findRoute(message.destination);
-		if (channel)
-			channel->send(message);
+void MessageBus::graftNeighbors(void) {
+	mOverlay.clearPruning();
+
+	std::vector<identifier> neighbors;
+	{
+		std::lock_guard<std::mutex> lock(mRoutesMutex);
+		for (const auto &[channel, id] : mNeighbors)
+			if (mGossipPeers.count(id))
+				neighbors.push_back(id);
 	}
+
+	for (const auto &id : neighbors)
+		sendOverlay(Message::Graft, id, binary());
 }
 
-shared_ptr<Channel> MessageBus::findRoute(const identifier &remoteId) {
+void MessageBus::update(double time) {
+	// Links lost further away can leave a part of a tree cut off, so broadcasts are periodically
+	// flooded again until duplicates prune the links back
+	mGraftTime += time;
+	if (mGraftTime >= GraftPeriod) {
+		mGraftTime = 0.;
+		graftNeighbors();
+	}
+
+	for (const auto &[neighbor, sources] : mOverlay.takePrunes()) {
+		binary payload;
+		for (const auto &source : sources)
+			payload.insert(payload.end(), source.begin(), source.end());
+
+		sendOverlay(Message::Prune, neighbor, std::move(payload));
+	}
+
+	std::vector<shared_ptr<Scheduler>> schedulers;
+	{
+		std::lock_guard<std::mutex> lock(mSchedulersMutex);
+		for (const auto &[channel, scheduler] : mSchedulers)
+			schedulers.push_back(scheduler);
+	}
+
+	for (auto &scheduler : schedulers)
+		scheduler->update(time);
+}
+
+void MessageBus::setSendRate(size_t bytesPerSecond, size_t burst) {
+	std::lock_guard<std::mutex> lock(mSchedulersMutex);
+	mSendRate = bytesPerSecond;
+	mSendBurst = burst;
+	for (const auto &[channel, scheduler] : mSchedulers)
+		scheduler->setRate(mSendRate, mSendBurst);
+}
+
+size_t MessageBus::queuedBytes(const identifier &remoteId) {
+	shared_ptr<Channel> channel;
+	{
+		std::lock_guard<std::mutex> lock(mRoutesMutex);
+		auto it = mRoutes.find(remoteId);
+		if (it == mRoutes.end() || it->second.empty())
+			return 0;
+
+		channel = it->second.rbegin()->second;
+	}
+
+	std::lock_guard<std::mutex> lock(mSchedulersMutex);
+	auto it = mSchedulers.find(channel);
+	if (it == mSchedulers.end())
+		return 0;
+
+	auto stats = it->second->stats();
+	return std::accumulate(stats.queuedBytes.begin(), stats.queuedBytes.end(), size_t(0));
+}
+
+Scheduler::Stats MessageBus::sendStats(void) const {
+	Scheduler::Stats total = {};
+	std::lock_guard<std::mutex> lock(mSchedulersMutex);
+	for (const auto &[channel, scheduler] : mSchedulers) {
+		auto stats = scheduler->stats();
+		for (int c = 0; c < Scheduler::ClassCount; ++c) {
+			total.queued[c] += stats.queued[c];
+			total.queuedBytes[c] += stats.queuedBytes[c];
+			total.sentBytes[c] += stats.sentBytes[c];
+			total.throughput[c] += stats.throughput[c];
+		}
+	}
+	return total;
+}
+
+shared_ptr<Scheduler> MessageBus::getScheduler(shared_ptr<Channel> channel) {
+	std::lock_guard<std::mutex> lock(mSchedulersMutex);
+	auto it = mSchedulers.find(channel);
+	if (it != mSchedulers.end())
+		return it->second;
+
+	auto scheduler = std::make_shared<Scheduler>(channel, mSendRate, mSendBurst);
+	channel->onBufferedAmountLow([weak = weak_ptr<Scheduler>(scheduler)]() {
+		if (auto scheduler = weak.lock())
+			scheduler->flush();
+	});
+	mSchedulers.emplace(channel, scheduler);
+	return scheduler;
+}
+
+shared_ptr<Channel> MessageBus::findRoute(const identifier &remoteId, Message::Type type,
+                                          const identifier &source, shared_ptr<Channel> except) {
 	std::lock_guard<std::mutex> lock(mRoutesMutex);
+	// The neighbor only accepts messages from this peer on the unreliable channel, relayed ones
+	// take the reliable route
+	if (IsLatestWins(type) && source == mLocalId) {
+		auto it = mUnreliableRoutes.find(remoteId);
+		if (it != mUnreliableRoutes.end() && it->second != except)
+			return it->second;
+	}
+
 	auto it = mRoutes.find(remoteId);
-	if (it != mRoutes.end() && !it->second.empty()) {
+	if (it != mRoutes.end()) {
 		// Choose route with highest priority
-		return it->second.rbegin()->second;
+		for (auto jt = it->second.rbegin(); jt != it->second.rend(); ++jt)
+			if (jt->second != except)
+				return jt->second;
 	}
 
 	std::cout << "No route for " << to_hex(remoteId) << std::endl;
 	return nullptr;
 }
 
+static size_t RoundCapacity(size_t capacity) {
+	size_t size = 2;
+	while (size < capacity)
+		size <<= 1;
+	return size;
+}
+
+MessageBus::AsyncListener::AsyncListener(size_t capacity, Overflow overflow)
+    : mOverflow(overflow), mMask(RoundCapacity(capacity) - 1) {
+	mSlots.reset(new Slot[mMask + 1]);
+	for (size_t i = 0; i <= mMask; ++i)
+		mSlots[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+MessageBus::AsyncListener::~AsyncListener(void) {}
+
 void MessageBus::AsyncListener::onMessage(const Message &message) {
-	std::lock_guard<std::mutex> lock(mQueueMutex);
-	mQueue.push(message);
+	// This can be called on multiple threads concurrently
+	if (mOverflow == Overflow::DropOldest) {
+		while (!push(message)) {
+			Message dropped;
+			if (pop(dropped))
+				mDropped.fetch_add(1, std::memory_order_relaxed);
+		}
+	} else {
+		// Once messages have spilled, later ones follow them to keep the order
+		if (mSpillSize.load(std::memory_order_acquire) > 0 || !push(message)) {
+			std::lock_guard<std::mutex> lock(mSpillMutex);
+			mSpill.push(message);
+			mSpillSize.store(mSpill.size(), std::memory_order_release);
+			mSpilled.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	updateHighWater();
 }
 
 bool MessageBus::AsyncListener::readMessage(Message &message) {
-	std::lock_guard<std::mutex> lock(mQueueMutex);
-	if (!mQueue.empty()) {
-		message = mQueue.front();
-		mQueue.pop();
+	if (pop(message))
 		return true;
+
+	if (mSpillSize.load(std::memory_order_acquire) == 0)
+		return false;
+
+	std::lock_guard<std::mutex> lock(mSpillMutex);
+	if (mSpill.empty())
+		return false;
+
+	message = std::move(mSpill.front());
+	mSpill.pop();
+	mSpillSize.store(mSpill.size(), std::memory_order_release);
+	return true;
+}
+
+size_t MessageBus::AsyncListener::readMessages(std::vector<Message> &messages) {
+	// Bounded so that busy producers can't keep the consumer here
+	size_t count = 0;
+	Message message;
+	while (count <= mMask) {
+		if (!pop(message))
+			break;
+
+		messages.push_back(std::move(message));
+		++count;
+	}
+
+	// Spilled messages are newer than the ones in the ring
+	if (count <= mMask && mSpillSize.load(std::memory_order_acquire) > 0) {
+		std::lock_guard<std::mutex> lock(mSpillMutex);
+		while (!mSpill.empty()) {
+			messages.push_back(std::move(mSpill.front()));
+			mSpill.pop();
+			++count;
+		}
+		mSpillSize.store(0, std::memory_order_release);
+	}
+
+	return count;
+}
+
+MessageBus::AsyncListener::MailboxStats MessageBus::AsyncListener::mailboxStats(void) const {
+	MailboxStats stats = {};
+	size_t enqueued = mEnqueuePos.load(std::memory_order_relaxed);
+	size_t dequeued = mDequeuePos.load(std::memory_order_relaxed);
+	stats.depth = (enqueued > dequeued ? enqueued - dequeued : 0) +
+	              mSpillSize.load(std::memory_order_relaxed);
+	stats.highWater = mHighWater.load(std::memory_order_relaxed);
+	stats.dropped = mDropped.load(std::memory_order_relaxed);
+	stats.spilled = mSpilled.load(std::memory_order_relaxed);
+	return stats;
+}
+
+// Bounded queue with a sequence number per slot, see
+// https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+// Producers also pop when dropping the oldest message, so it must allow several consumers.
+bool MessageBus::AsyncListener::push(const Message &message) {
+	size_t pos = mEnqueuePos.load(std::memory_order_relaxed);
+	Slot *slot;
+	while (true) {
+		slot = &mSlots[pos & mMask];
+		size_t sequence = slot->sequence.load(std::memory_order_acquire);
+		auto diff = intptr_t(sequence) - intptr_t(pos);
+		if (diff == 0) {
+			if (mEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return false; // full
+		} else {
+			pos = mEnqueuePos.load(std::memory_order_relaxed);
+		}
+	}
+
+	slot->message = message;
+	slot->sequence.store(pos + 1, std::memory_order_release);
+	return true;
+}
+
+bool MessageBus::AsyncListener::pop(Message &message) {
+	size_t pos = mDequeuePos.load(std::memory_order_relaxed);
+	Slot *slot;
+	while (true) {
+		slot = &mSlots[pos & mMask];
+		size_t sequence = slot->sequence.load(std::memory_order_acquire);
+		auto diff = intptr_t(sequence) - intptr_t(pos + 1);
+		if (diff == 0) {
+			if (mDequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return false; // empty
+		} else {
+			pos = mDequeuePos.load(std::memory_order_relaxed);
+		}
 	}
 
-	return false;
+	message = std::move(slot->message);
+	slot->sequence.store(pos + mMask + 1, std::memory_order_release);
+	return true;
+}
+
+void MessageBus::AsyncListener::updateHighWater(void) {
+	size_t depth = mailboxStats().depth;
+	size_t highWater = mHighWater.load(std::memory_order_relaxed);
+	while (depth > highWater &&
+	       !mHighWater.compare_exchange_weak(highWater, depth, std::memory_order_relaxed))
+		;
 }
 
 } // namespace convergence
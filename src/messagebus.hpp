@@ -24,13 +24,18 @@
 #include "src/identifier.hpp"
 #include "src/include.hpp"
 #include "src/message.hpp"
+#include "src/overlay.hpp"
+#include "src/scheduler.hpp"
 
 #include "rtc/channel.hpp"
 
+#include <atomic>
+#include <functional>
 #include <map>
 #include <memory>
 #include <queue>
 #include <set>
+#include <vector>
 
 namespace convergence {
 
@@ -40,54 +45,133 @@ class MessageBus {
 public:
 	enum class Priority : int { Default = 0, Relay = 1, Direct = 2 };
 
+	// Flags advertised in the join message sent on each channel
+	enum Capability : uint8_t { Compression = 0x01, Gossip = 0x02 };
+
 	MessageBus(void);
 	virtual ~MessageBus(void);
 
 	identifier localId(void) const;
+	std::vector<identifier> peers(void); // remote ids with local listeners
 
 	void addChannel(shared_ptr<Channel> channel, Priority priority);
 	void removeChannel(shared_ptr<Channel> channel);
 
+	// Direct channel to a peer which may lose or reorder messages, used for latest-wins types
+	void addUnreliableChannel(const identifier &id, shared_ptr<Channel> channel);
+
 	void addRoute(const identifier &id, shared_ptr<Channel> channel, Priority priority);
 	void removeRoute(const identifier &id, shared_ptr<Channel> channel);
 	void removeAllRoutes(shared_ptr<Channel> channel);
 
 	void send(Message &message);
-	void broadcast(Message &message);
+	void broadcast(Message &message); // relayed by neighbors through the overlay
 	void dispatch(const Message &message);
 
+	// Outbound traffic is paced per channel, update() refills the budgets and flushes the queues
+	void update(double time);
+	void setSendRate(size_t bytesPerSecond, size_t burst);
+	Scheduler::Stats sendStats(void) const; // summed over channels
+	size_t queuedBytes(const identifier &remoteId); // waiting on the route to a peer
+
 	class Listener {
 	public:
 		virtual void onPeer(const identifier &id){};
 		virtual void onMessage(const Message &message) = 0;
 	};
 
+	// Messages are queued in a bounded ring and read back by a single consumer thread
 	class AsyncListener : public Listener {
 	public:
+		enum class Overflow {
+			Grow,      // spill to an unbounded queue, nothing is lost
+			DropOldest // for state messages superseded by newer ones
+		};
+
+		struct MailboxStats {
+			size_t depth;     // messages waiting
+			size_t highWater; // maximum depth seen
+			size_t dropped;   // messages discarded on overflow
+			size_t spilled;   // messages queued past the ring capacity
+		};
+
+		AsyncListener(size_t capacity = 1024, Overflow overflow = Overflow::Grow);
+		virtual ~AsyncListener(void);
+
 		void onMessage(const Message &message);
 		bool readMessage(Message &message);
+		size_t readMessages(std::vector<Message> &messages); // appends all waiting messages
+
+		MailboxStats mailboxStats(void) const;
 
 	private:
-		std::queue<Message> mQueue;
-		std::mutex mQueueMutex;
+		struct Slot {
+			std::atomic<size_t> sequence;
+			Message message;
+		};
+
+		bool push(const Message &message);
+		bool pop(Message &message);
+		void updateHighWater(void);
+
+		const Overflow mOverflow;
+		const size_t mMask;
+		std::unique_ptr<Slot[]> mSlots;
+		std::atomic<size_t> mEnqueuePos = 0;
+		std::atomic<size_t> mDequeuePos = 0;
+
+		std::queue<Message> mSpill; // only used with Overflow::Grow
+		std::atomic<size_t> mSpillSize = 0;
+		mutable std::mutex mSpillMutex;
+
+		std::atomic<size_t> mHighWater = 0;
+		std::atomic<size_t> mDropped = 0;
+		std::atomic<size_t> mSpilled = 0;
 	};
 
 	void registerTypeListener(Message::Type type, weak_ptr<Listener> listener);
 	void registerListener(const identifier &remoteId, weak_ptr<Listener> listener);
 
 private:
+	// Registrations are immutable once published and replaced as a whole on change, so
+	// dispatch only needs an atomic load and never blocks or allocates
+	struct Listeners {
+		std::map<Message::Type, std::vector<weak_ptr<Listener>>> types;
+		std::map<identifier, std::vector<weak_ptr<Listener>>> remotes;
+	};
+
+	void updateListeners(std::function<void(Listeners &)> update);
 	void dispatchPeer(const identifier &id);
-	void route(Message &message);
-	shared_ptr<Channel> findRoute(const identifier &remoteId);
+	void route(Message &message, shared_ptr<Channel> from = nullptr);
+	void gossip(Message &envelope, shared_ptr<Channel> from);
+	void sendGossip(const Message &envelope, const Message &message, const identifier &except);
+	void receiveOverlay(const Message &message);
+	void sendOverlay(Message::Type type, const identifier &neighbor, binary payload);
+	void graftNeighbors(void);
+	shared_ptr<Channel> findRoute(const identifier &remoteId, Message::Type type,
+	                              const identifier &source, shared_ptr<Channel> except = nullptr);
+	shared_ptr<Scheduler> getScheduler(shared_ptr<Channel> channel);
 
 	identifier mLocalId;
 	std::set<shared_ptr<Channel>> mChannels;
 	std::mutex mChannelsMutex;
 	std::map<identifier, std::map<Priority, shared_ptr<Channel>>> mRoutes;
+	std::map<identifier, shared_ptr<Channel>> mUnreliableRoutes;
+	std::map<shared_ptr<Channel>, identifier> mNeighbors; // channels with a direct route
+	std::set<identifier> mCompressionPeers;
+	std::set<identifier> mGossipPeers;
 	std::mutex mRoutesMutex;
-	std::multimap<Message::Type, weak_ptr<Listener>> mTypeListeners;
-	std::multimap<identifier, weak_ptr<Listener>> mListeners;
-	std::mutex mListenersMutex;
+	Overlay mOverlay;
+	double mGraftTime = 0.;
+	std::map<shared_ptr<Channel>, shared_ptr<Scheduler>> mSchedulers;
+	size_t mSendRate;
+	size_t mSendBurst;
+	mutable std::mutex mSchedulersMutex;
+	// Accessed with the std::atomic_load() and std::atomic_store() overloads for shared_ptr. They
+	// are not lock-free in libstdc++, which takes a spinlock from a small pool for each access,
+	// but the lock only covers the pointer copy and not the dispatch.
+	shared_ptr<const Listeners> mListeners;
+	std::mutex mListenersMutex; // serializes updates
 };
 
 } // namespace convergence
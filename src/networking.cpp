@@ -27,21 +27,68 @@ namespace convergence {
 using pla::to_hex;
 using rtc::WebSocket;
 
-Networking::Networking(shared_ptr<MessageBus> messageBus, const string &url)
-    : mMessageBus(messageBus) {
+const double ConnectTimeout = 15.; // seconds
+
+Networking::Networking(shared_ptr<MessageBus> messageBus, const string &url, size_t degree)
+    : mMessageBus(messageBus), mDegree(degree), mMaxDegree(degree * 3) {
 	connectWebSocket(url);
 }
 
 Networking::~Networking(void) {}
 
+void Networking::update(double time) {
+	// Dropped peerings are destroyed without the lock, closing may wait for network threads
+	std::vector<shared_ptr<Peering>> dropped;
+	std::lock_guard<std::mutex> lock(mMutex);
+	auto it = mPeerings.begin();
+	while (it != mPeerings.end()) {
+		const auto &[id, peering] = *it;
+		if (peering->isConnected()) {
+			mUnconnectedTime.erase(id);
+			mCandidates.add(id);
+			++it;
+			continue;
+		}
+
+		double &unconnected = mUnconnectedTime[id];
+		unconnected += time;
+		if (unconnected < ConnectTimeout) {
+			++it;
+			continue;
+		}
+
+		// Retried later, the peer might only have been busy
+		std::cout << "Dropping peer: " << to_hex(id) << std::endl;
+		mCandidates.fail(id);
+		dropped.push_back(peering);
+		mUnconnectedTime.erase(id);
+		it = mPeerings.erase(it);
+	}
+
+	mCandidates.update(time);
+	connectCandidates();
+}
+
 void Networking::onPeer(const identifier &id) {
 	std::cout << "Discovered peer: " << to_hex(id) << std::endl;
-	auto peering = createPeering(id);
-	peering->connect();
+	std::lock_guard<std::mutex> lock(mMutex);
+	mCandidates.add(id);
+	connectCandidates();
 }
 
 void Networking::onMessage(const Message &message) {
 	const identifier &id = message.source;
+	std::lock_guard<std::mutex> lock(mMutex);
+	mCandidates.add(id);
+	if (mPeerings.find(id) != mPeerings.end())
+		return;
+
+	// The remote peer will time out and try another one
+	if (mPeerings.size() >= mMaxDegree) {
+		std::cout << "Declining peer: " << to_hex(id) << std::endl;
+		return;
+	}
+
 	std::cout << "Incoming peer: " << to_hex(id) << std::endl;
 	createPeering(id);
 }
@@ -75,4 +122,16 @@ shared_ptr<Peering> Networking::createPeering(const identifier &id) {
 	return peering;
 }
 
+void Networking::connectCandidates(void) {
+	if (mPeerings.size() >= mDegree)
+		return;
+
+	std::set<identifier> connected;
+	for (const auto &[id, peering] : mPeerings)
+		connected.insert(id);
+
+	for (const auto &id : mCandidates.pick(mDegree - mPeerings.size(), connected))
+		createPeering(id)->connect();
+}
+
 } // namespace convergence
@@ -21,6 +21,7 @@
 #ifndef CONVERGENCE_NETWORKING_H
 #define CONVERGENCE_NETWORKING_H
 
+#include "src/candidates.hpp"
 #include "src/include.hpp"
 #include "src/messagebus.hpp"
 #include "src/peering.hpp"
@@ -31,11 +32,15 @@ namespace convergence {
 
 using std::multimap;
 
+// Peers form an overlay instead of a full mesh: each one opens peerings to a few random peers and
+// accepts incoming ones up to a limit, broadcasts are then relayed by neighbors
 class Networking final : public MessageBus::Listener {
 public:
-	Networking(shared_ptr<MessageBus> messageBus, const string &url);
+	Networking(shared_ptr<MessageBus> messageBus, const string &url, size_t degree = 4);
 	~Networking(void);
 
+	void update(double time); // replaces peerings which failed or closed
+
 protected:
 	void onPeer(const identifier &id);
 	void onMessage(const Message &message);
@@ -43,9 +48,15 @@ protected:
 private:
 	void connectWebSocket(const string &url);
 	shared_ptr<Peering> createPeering(const identifier &id);
+	void connectCandidates(void);
 
 	shared_ptr<MessageBus> mMessageBus;
+	const size_t mDegree;    // peerings opened while there are fewer
+	const size_t mMaxDegree; // incoming peerings are declined past this
 	std::map<identifier, shared_ptr<Peering>> mPeerings;
+	std::map<identifier, double> mUnconnectedTime;
+	Candidates mCandidates;
+	std::mutex mMutex;
 };
 } // namespace convergence
 
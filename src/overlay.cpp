@@ -0,0 +1,121 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+#include "src/overlay.hpp"
+
+namespace convergence {
+
+const uint32_t SeenWindow = 64;
+
+Overlay::Overlay(void) {}
+
+Overlay::~Overlay(void) {}
+
+uint32_t Overlay::nextSequence(void) { return ++mSequence; }
+
+Overlay::Arrival Overlay::receive(const identifier &source, uint32_t sequence,
+                                  const identifier &neighbor) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	Arrival arrival = {};
+	auto [it, inserted] = mSeen.try_emplace(source);
+	Seen &seen = it->second;
+	auto diff = int32_t(sequence - seen.last);
+	if (inserted || diff > 0) {
+		seen.window = !inserted && uint32_t(diff) < SeenWindow ? (seen.window << diff) | 1 : 1;
+		seen.last = sequence;
+		arrival.newest = true;
+		arrival.discovered = inserted;
+	} else if (uint32_t(-diff) >= SeenWindow) {
+		arrival.duplicate = true; // too old to tell
+	} else {
+		uint64_t bit = uint64_t(1) << -diff;
+		arrival.duplicate = (seen.window & bit) != 0;
+		seen.window |= bit;
+	}
+
+	if (neighbor.isNull())
+		return arrival;
+
+	// A pruned neighbor may deliver first if it relayed before getting the prune
+	Link link(neighbor, source);
+	if (arrival.duplicate) {
+		if (mPruning.insert(link).second)
+			mPendingPrunes.insert(link);
+	} else if (mPruning.erase(link) > 0) {
+		arrival.graft = mPendingPrunes.erase(link) == 0;
+	}
+
+	return arrival;
+}
+
+std::map<identifier, std::vector<identifier>> Overlay::takePrunes(void) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	std::map<identifier, std::vector<identifier>> prunes;
+	for (const auto &[neighbor, source] : mPendingPrunes)
+		prunes[neighbor].push_back(source);
+
+	mPendingPrunes.clear();
+	return prunes;
+}
+
+bool Overlay::isPruned(const identifier &neighbor, const identifier &source) const {
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mPruned.find(Link(neighbor, source)) != mPruned.end();
+}
+
+void Overlay::prune(const identifier &neighbor, const identifier &source) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	mPruned.emplace(neighbor, source);
+}
+
+void Overlay::graft(const identifier &neighbor, const identifier &source) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	mPruned.erase(Link(neighbor, source));
+}
+
+void Overlay::graftAll(const identifier &neighbor) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	auto it = mPruned.lower_bound(Link(neighbor, identifier()));
+	while (it != mPruned.end() && it->first == neighbor)
+		it = mPruned.erase(it);
+}
+
+void Overlay::removeNeighbor(const identifier &neighbor) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	auto it = mPruned.lower_bound(Link(neighbor, identifier()));
+	while (it != mPruned.end() && it->first == neighbor)
+		it = mPruned.erase(it);
+
+	it = mPruning.lower_bound(Link(neighbor, identifier()));
+	while (it != mPruning.end() && it->first == neighbor)
+		it = mPruning.erase(it);
+
+	it = mPendingPrunes.lower_bound(Link(neighbor, identifier()));
+	while (it != mPendingPrunes.end() && it->first == neighbor)
+		it = mPendingPrunes.erase(it);
+}
+
+void Overlay::clearPruning(void) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	mPruning.clear();
+	mPendingPrunes.clear();
+}
+
+} // namespace convergence
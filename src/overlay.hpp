@@ -0,0 +1,80 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+#ifndef CONVERGENCE_OVERLAY_H
+#define CONVERGENCE_OVERLAY_H
+
+#include "src/identifier.hpp"
+#include "src/include.hpp"
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <set>
+#include <vector>
+
+namespace convergence {
+
+// Broadcast state of the overlay. Broadcasts are relayed to neighbors and duplicates are detected
+// by sequence number. A duplicate means the link is redundant for its source, so it gets pruned,
+// and each source ends up with a spanning tree (like Plumtree without the lazy push).
+class Overlay {
+public:
+	struct Arrival {
+		bool duplicate;  // already received, neither dispatched nor relayed
+		bool newest;     // latest broadcast from the source so far
+		bool graft;      // the neighbor should relay the source again
+		bool discovered; // first broadcast from the source
+	};
+
+	Overlay(void);
+	~Overlay(void);
+
+	uint32_t nextSequence(void);
+	Arrival receive(const identifier &source, uint32_t sequence, const identifier &neighbor);
+	std::map<identifier, std::vector<identifier>> takePrunes(void); // sources per neighbor
+
+	bool isPruned(const identifier &neighbor, const identifier &source) const;
+	void prune(const identifier &neighbor, const identifier &source);
+	void graft(const identifier &neighbor, const identifier &source);
+	void graftAll(const identifier &neighbor);
+	void removeNeighbor(const identifier &neighbor);
+	void clearPruning(void); // all neighbors must then be grafted
+
+private:
+	// Last sequence received from a source, with a bit per previous sequence
+	struct Seen {
+		uint32_t last = 0;
+		uint64_t window = 0;
+	};
+
+	using Link = std::pair<identifier, identifier>; // neighbor, source
+
+	std::map<identifier, Seen> mSeen;
+	std::set<Link> mPruned;  // sources not relayed to the neighbor
+	std::set<Link> mPruning; // sources the neighbor was asked not to relay
+	std::set<Link> mPendingPrunes;
+	std::atomic<uint32_t> mSequence = 0;
+	mutable std::mutex mMutex;
+};
+
+} // namespace convergence
+
+#endif
@@ -35,6 +35,7 @@ using std::function;
 using std::vector;
 
 const string DataChannelName = "data";
+const string EntityChannelName = "entities"; // unordered and unreliable
 
 Peering::Peering(const identifier &id, shared_ptr<MessageBus> messageBus)
     : mId(id), mMessageBus(messageBus) {
@@ -46,6 +47,8 @@ Peering::Peering(const identifier &id, shared_ptr<MessageBus> messageBus)
 		std::cout << "Data channel received" << std::endl;
 		if (dataChannel->label() == DataChannelName)
 			setDataChannel(dataChannel);
+		else if (dataChannel->label() == EntityChannelName)
+			setEntityChannel(dataChannel);
 	});
 
 	mPeerConnection->onLocalDescription([this](const rtc::Description &description) {
@@ -74,9 +77,22 @@ bool Peering::isConnected(void) const { return mDataChannel && mDataChannel->isO
 void Peering::connect(void) {
 	disconnect();
 	setDataChannel(mPeerConnection->createDataChannel(DataChannelName));
+
+	// Lost entity updates are superseded by the next ones instead of being retransmitted
+	rtc::DataChannelInit init;
+	init.reliability.type = rtc::Reliability::Type::Rexmit;
+	init.reliability.unordered = true;
+	init.reliability.rexmit = 0;
+	setEntityChannel(mPeerConnection->createDataChannel(EntityChannelName, init));
 }
 
 void Peering::disconnect(void) {
+	if (mEntityChannel) {
+		mMessageBus->removeChannel(mEntityChannel);
+		mEntityChannel->close();
+		mEntityChannel.reset();
+	}
+
 	if (mDataChannel) {
 		mMessageBus->removeChannel(mDataChannel);
 		mDataChannel->close();
@@ -112,6 +128,28 @@ void Peering::setDataChannel(shared_ptr<rtc::DataChannel> dataChannel) {
 	mDataChannel->onClosed(closeCallback);
 }
 
+void Peering::setEntityChannel(shared_ptr<rtc::DataChannel> entityChannel) {
+	mEntityChannel = entityChannel;
+
+	// Until it is open, entity messages go through the data channel
+	auto openCallback = [this]() {
+		std::cout << "Entity channel open" << std::endl;
+		mMessageBus->addUnreliableChannel(mId, mEntityChannel);
+	};
+
+	auto closeCallback = [this]() {
+		std::cout << "Entity channel closed" << std::endl;
+		mMessageBus->removeChannel(mEntityChannel);
+	};
+
+	if (mEntityChannel->isOpen())
+		openCallback();
+	else
+		mEntityChannel->onOpen(openCallback);
+
+	mEntityChannel->onClosed(closeCallback);
+}
+
 void Peering::processSignaling(Message::Type type, const binary &payload) {
 	switch (type) {
 	case Message::Join: {
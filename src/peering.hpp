@@ -46,6 +46,7 @@ protected:
 
 private:
 	void setDataChannel(shared_ptr<rtc::DataChannel> dataChannel);
+	void setEntityChannel(shared_ptr<rtc::DataChannel> entityChannel);
 	void processSignaling(Message::Type type, const binary &payload);
 	void sendSignaling(Message::Type type, const binary &payload);
 
@@ -53,6 +54,7 @@ private:
 	shared_ptr<MessageBus> mMessageBus;
 	shared_ptr<rtc::PeerConnection> mPeerConnection;
 	shared_ptr<rtc::DataChannel> mDataChannel;
+	shared_ptr<rtc::DataChannel> mEntityChannel;
 };
 
 } // namespace convergence
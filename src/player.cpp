@@ -19,39 +19,29 @@
  ***************************************************************************/
 
 #include "src/player.hpp"
-#include "src/factory.hpp"
 
 #include "pla/binaryformatter.hpp"
+
+#ifndef HEADLESS
+#include "src/factory.hpp"
+
 #include "pla/program.hpp"
 #include "pla/shader.hpp"
+#endif
 
 namespace convergence {
 
 using pla::BinaryFormatter;
+
+#ifndef HEADLESS
 using pla::FragmentShader;
 using pla::Program;
 using pla::VertexShader;
+#endif
 
 Player::Player(sptr<MessageBus> messageBus, identifier id)
     : Entity(messageBus, std::move(id)), mYaw(0.f), mPitch(0.f), mWalkSpeed(0.f), mAction(0.f),
-      mIsJumping(false) {
-
-	auto program = std::make_shared<Program>(std::make_shared<VertexShader>("shader/color.vect"),
-	                                         std::make_shared<FragmentShader>("shader/color.frag"));
-
-	float cube_vertices[] = {
-	    -1.0, -1.0, 1.0,  1.0, -1.0, 1.0,  1.0, 1.0, 1.0,  -1.0, 1.0, 1.0,
-	    -1.0, -1.0, -1.0, 1.0, -1.0, -1.0, 1.0, 1.0, -1.0, -1.0, 1.0, -1.0,
-	};
-
-	Object::index_t cube_indices[] = {
-	    0, 1, 2, 2, 3, 0, 1, 5, 6, 6, 2, 1, 7, 6, 5, 5, 4, 7,
-	    4, 0, 3, 3, 7, 4, 4, 5, 1, 1, 0, 4, 3, 2, 6, 6, 7, 3,
-	};
-
-	mObject = std::make_shared<Object>(cube_indices, 12 * 3, cube_vertices, 8 * 3, program);
-	mTool = Factory("pickaxe", 1.f / 32.f, program).build();
-}
+      mIsJumping(false) {}
 
 Player::~Player(void) {}
 
@@ -104,6 +94,18 @@ vec3 Player::getSpeed() const {
 	return Entity::getSpeed() + vec3(std::sin(-mYaw), std::cos(-mYaw), 0.f) * mWalkSpeed;
 }
 
+EntityState Player::getState(void) const {
+	EntityState state = Entity::getState();
+	state.setControl(mYaw, mPitch, mWalkSpeed);
+	return state;
+}
+
+void Player::setState(const EntityState &state) {
+	Entity::setState(state);
+	pivot(state.yawAngle(), state.pitchAngle()); // rotation is rebuilt from control
+	mWalkSpeed = state.walkSpeed();
+}
+
 void Player::update(sptr<Collidable> terrain, double time) {
 	if (isOnGround() && mIsJumping)
 		accelerate(vec3(0.f, 0.f, 10.f));
@@ -127,7 +129,28 @@ void Player::update(sptr<Collidable> terrain, double time) {
 		mPicked->setTransform(std::move(handTransform));
 }
 
+#ifndef HEADLESS
 int Player::draw(const Context &context) {
+	// Objects are created on first draw so players can exist without a graphics context
+	if (!mObject) {
+		auto program =
+		    std::make_shared<Program>(std::make_shared<VertexShader>("shader/color.vect"),
+		                              std::make_shared<FragmentShader>("shader/color.frag"));
+
+		float cube_vertices[] = {
+		    -1.0, -1.0, 1.0,  1.0, -1.0, 1.0,  1.0, 1.0, 1.0,  -1.0, 1.0, 1.0,
+		    -1.0, -1.0, -1.0, 1.0, -1.0, -1.0, 1.0, 1.0, -1.0, -1.0, 1.0, -1.0,
+		};
+
+		Object::index_t cube_indices[] = {
+		    0, 1, 2, 2, 3, 0, 1, 5, 6, 6, 2, 1, 7, 6, 5, 5, 4, 7,
+		    4, 0, 3, 3, 7, 4, 4, 5, 1, 1, 0, 4, 3, 2, 6, 6, 7, 3,
+		};
+
+		mObject = std::make_shared<Object>(cube_indices, 12 * 3, cube_vertices, 8 * 3, program);
+		mTool = Factory("pickaxe", 1.f / 32.f, program).build();
+	}
+
 	int count = 0;
 	// count += mObject->draw(subContext);
 
@@ -136,6 +159,7 @@ int Player::draw(const Context &context) {
 
 	return count;
 }
+#endif
 
 void Player::handleCollision(const vec3 &normal) { mSpeed = vec3(0.f, 0.f, 0.f); }
 
@@ -164,14 +188,4 @@ void Player::processMessage(const Message &message) {
 	}
 }
 
-void Player::sendControl() const {
-	Message message(Message::EntityControl);
-	BinaryFormatter formatter;
-	formatter << float32_t(mYaw) << float32_t(mPitch);
-	formatter << float32_t(mWalkSpeed);
-	formatter << uint32_t(0); // flags
-	message.payload = formatter.data();
-	mMessageBus->send(message);
-}
-
 } // namespace convergence
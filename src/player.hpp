@@ -45,20 +45,26 @@ public:
 	virtual float getRadius() const;
 	virtual vec3 getSpeed() const;
 
+	virtual EntityState getState() const;
+	virtual void setState(const EntityState &state);
+
 	virtual void update(sptr<Collidable> terrain, double time);
+#ifndef HEADLESS
 	virtual int draw(const Context &context);
+#endif
 
 protected:
 	virtual void handleCollision(const vec3 &normal);
 	virtual void processMessage(const Message &message);
-	void sendControl() const;
 
 	float mYaw, mPitch;
 	float mWalkSpeed;
 	float mAction;
 	bool mIsJumping;
 
+#ifndef HEADLESS
 	sptr<Object> mObject, mTool;
+#endif
 	sptr<Entity> mPicked;
 };
 
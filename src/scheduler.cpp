@@ -0,0 +1,121 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+#include "src/scheduler.hpp"
+
+#include <algorithm>
+
+namespace convergence {
+
+// Bulk transfers are held back while this much data is waiting in the channel
+const size_t BulkBufferedThreshold = 128 * 1024;
+
+Scheduler::Scheduler(shared_ptr<Channel> channel, size_t rate, size_t burst)
+    : mChannel(channel), mRate(double(rate)), mBurst(double(burst)), mTokens(double(burst)) {
+	mChannel->setBufferedAmountLowThreshold(BulkBufferedThreshold / 2);
+}
+
+Scheduler::~Scheduler(void) {}
+
+void Scheduler::setRate(size_t rate, size_t burst) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	mRate = double(rate);
+	mBurst = double(burst);
+	mTokens = std::min(mTokens, mBurst);
+}
+
+void Scheduler::send(const byte *data, size_t size, Class c) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (c == Control || (mQueues[c].empty() && canSend(c))) {
+		sendNow(data, size, c);
+	} else {
+		mQueues[c].emplace_back(data, data + size);
+		mQueuedBytes[c] += size;
+	}
+}
+
+void Scheduler::update(double time) {
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mTokens = std::min(mTokens + mRate * time, mBurst);
+
+		mWindowTime += time;
+		if (mWindowTime >= 1.) {
+			for (int c = 0; c < ClassCount; ++c) {
+				mThroughput[c] = mWindowBytes[c] / mWindowTime;
+				mWindowBytes[c] = 0;
+			}
+			mWindowTime = 0.;
+		}
+	}
+
+	flush();
+}
+
+void Scheduler::flush(void) {
+	// This can be called on non-main thread when the channel buffer drains
+	std::lock_guard<std::mutex> lock(mMutex);
+	for (int c = Terrain; c < ClassCount; ++c) {
+		auto &queue = mQueues[c];
+		while (!queue.empty() && canSend(Class(c))) {
+			binary data = std::move(queue.front());
+			queue.pop_front();
+			mQueuedBytes[c] -= data.size();
+			sendNow(data.data(), data.size(), Class(c));
+		}
+	}
+}
+
+Scheduler::Stats Scheduler::stats(void) const {
+	std::lock_guard<std::mutex> lock(mMutex);
+	Stats stats;
+	for (int c = 0; c < ClassCount; ++c)
+		stats.queued[c] = mQueues[c].size();
+
+	stats.queuedBytes = mQueuedBytes;
+	stats.sentBytes = mSentBytes;
+	stats.throughput = mThroughput;
+	return stats;
+}
+
+bool Scheduler::canSend(Class c) const {
+	// Higher classes go first
+	for (int h = Terrain; h < c; ++h)
+		if (!mQueues[h].empty())
+			return false;
+
+	// A message may overdraw the bucket so that large ones still go through
+	if (mRate > 0. && mTokens <= 0.)
+		return false;
+
+	return c != Bulk || mChannel->bufferedAmount() < BulkBufferedThreshold;
+}
+
+void Scheduler::sendNow(const byte *data, size_t size, Class c) {
+	mChannel->send(data, size);
+	mSentBytes[c] += size;
+	mWindowBytes[c] += size;
+	// Messages are charged in full, control messages included, so the debt they leave holds the
+	// other classes back by exactly what was sent over the rate
+	if (mRate > 0.)
+		mTokens -= double(size);
+}
+
+} // namespace convergence
@@ -0,0 +1,80 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+#ifndef CONVERGENCE_SCHEDULER_H
+#define CONVERGENCE_SCHEDULER_H
+
+#include "src/include.hpp"
+
+#include "rtc/channel.hpp"
+
+#include <array>
+#include <deque>
+#include <mutex>
+
+namespace convergence {
+
+using rtc::Channel;
+
+// Outbound queue of a channel. Control messages are sent right away, other classes wait for
+// tokens in priority order, and bulk transfers also wait for the channel buffer to drain.
+class Scheduler {
+public:
+	enum Class : int { Control = 0, Terrain = 1, Bulk = 2 };
+	static const int ClassCount = 3;
+
+	struct Stats {
+		std::array<size_t, ClassCount> queued;      // messages waiting
+		std::array<size_t, ClassCount> queuedBytes; // bytes waiting
+		std::array<size_t, ClassCount> sentBytes;   // bytes sent in total
+		std::array<double, ClassCount> throughput;  // bytes per second over the last second
+	};
+
+	Scheduler(shared_ptr<Channel> channel, size_t rate, size_t burst);
+	~Scheduler(void);
+
+	void setRate(size_t rate, size_t burst); // bytes per second, 0 for unlimited
+
+	void send(const byte *data, size_t size, Class c);
+	void update(double time); // refills tokens, then flushes
+	void flush(void);
+
+	Stats stats(void) const;
+
+private:
+	bool canSend(Class c) const; // requires mMutex
+	void sendNow(const byte *data, size_t size, Class c);
+
+	shared_ptr<Channel> mChannel;
+	std::array<std::deque<binary>, ClassCount> mQueues;
+	std::array<size_t, ClassCount> mQueuedBytes = {};
+	std::array<size_t, ClassCount> mSentBytes = {};
+	std::array<size_t, ClassCount> mWindowBytes = {};
+	std::array<double, ClassCount> mThroughput = {};
+	double mWindowTime = 0.;
+	double mRate;
+	double mBurst;
+	double mTokens;
+	mutable std::mutex mMutex;
+};
+
+} // namespace convergence
+
+#endif
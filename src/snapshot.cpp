@@ -0,0 +1,293 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+#include "src/snapshot.hpp"
+#include "src/surface.hpp"
+
+#include "pla/binaryformatter.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace convergence {
+
+using pla::BinaryFormatter;
+
+// Entry mask, fields equal to the base are omitted
+const uint8_t BlockField = 0x01;
+const uint8_t OffsetField = 0x02;
+const uint8_t RotationField = 0x04;
+const uint8_t ControlField = 0x08;
+const uint8_t AllFields = 0x0F;
+const uint8_t SenderEntity = 0x40; // the identifier is the source
+const uint8_t RemovedEntity = 0x80;
+
+// Header flags
+const uint8_t HasAck = 0x01;
+const uint8_t HasBase = 0x02;
+
+const float OffsetScale = 1024.f;
+const float WalkScale = 256.f;
+const int RotationMax = 0x3FF;
+
+EntityState EntityState::Quantise(const mat4 &transform) {
+	EntityState state;
+
+	const float size = float(Surface::Block::Size);
+	const vec3 p(transform[3]);
+	const vec3 b(std::floor(p.x / size), std::floor(p.y / size), std::floor(p.z / size));
+	const vec3 o = (p - b * size) * OffsetScale;
+	state.block = int3(int(b.x), int(b.y), int(b.z));
+	state.offset = {uint16_t(pla::bounds(int(std::round(o.x)), 0, 0xFFFF)),
+	                uint16_t(pla::bounds(int(std::round(o.y)), 0, 0xFFFF)),
+	                uint16_t(pla::bounds(int(std::round(o.z)), 0, 0xFFFF))};
+
+	// Smallest three: the largest component is dropped and recomputed from the others, it is
+	// made positive as q and -q are the same rotation
+	const quat q = glm::normalize(glm::quat_cast(transform));
+	const float c[4] = {q.x, q.y, q.z, q.w};
+	int largest = 0;
+	for (int i = 1; i < 4; ++i)
+		if (std::abs(c[i]) > std::abs(c[largest]))
+			largest = i;
+
+	const float sign = c[largest] < 0.f ? -1.f : 1.f;
+	state.rotation = uint32_t(largest) << 30;
+	int shift = 20;
+	for (int i = 0; i < 4; ++i) {
+		if (i == largest)
+			continue;
+
+		const float v = (c[i] * sign / Sqrt2 + 0.5f) * RotationMax; // |c[i]| <= 1/sqrt(2)
+		state.rotation |= uint32_t(pla::bounds(int(std::round(v)), 0, RotationMax)) << shift;
+		shift -= 10;
+	}
+	return state;
+}
+
+mat4 EntityState::transform(void) const {
+	const float size = float(Surface::Block::Size);
+	const vec3 p = vec3(block.x, block.y, block.z) * size +
+	               vec3(offset[0], offset[1], offset[2]) / OffsetScale;
+
+	const int largest = int(rotation >> 30);
+	float c[4];
+	float sum = 0.f;
+	int shift = 20;
+	for (int i = 0; i < 4; ++i) {
+		if (i == largest)
+			continue;
+
+		const int v = int((rotation >> shift) & RotationMax);
+		c[i] = (float(v) / RotationMax - 0.5f) * Sqrt2;
+		sum += c[i] * c[i];
+		shift -= 10;
+	}
+	c[largest] = std::sqrt(std::max(1.f - sum, 0.f));
+
+	quat q;
+	q.x = c[0];
+	q.y = c[1];
+	q.z = c[2];
+	q.w = c[3];
+	return glm::translate(p) * glm::mat4_cast(q);
+}
+
+void EntityState::setControl(float yaw, float pitch, float walk) {
+	const double scale = 65536. / (2. * Pi);
+	this->yaw = uint16_t(std::llround(yaw * scale)); // wraps around
+	this->pitch = uint16_t(std::llround(pitch * scale));
+	this->walk = int16_t(pla::bounds(int(std::round(walk * WalkScale)), -0x8000, 0x7FFF));
+}
+
+float EntityState::yawAngle(void) const { return float(int16_t(yaw)) * 2.f * Pi / 65536.f; }
+
+float EntityState::pitchAngle(void) const { return float(int16_t(pitch)) * 2.f * Pi / 65536.f; }
+
+float EntityState::walkSpeed(void) const { return float(walk) / WalkScale; }
+
+bool EntityState::operator==(const EntityState &other) const {
+	return block == other.block && offset == other.offset && rotation == other.rotation &&
+	       yaw == other.yaw && pitch == other.pitch && walk == other.walk;
+}
+
+Snapshots::Snapshots(sptr<MessageBus> messageBus) : mMessageBus(std::move(messageBus)) {}
+
+Snapshots::~Snapshots(void) {}
+
+void Snapshots::send(const States &states, const std::vector<identifier> &peers) {
+	const uint16_t sequence = mSequence++;
+	mSent.emplace_back(sequence, states);
+	if (mSent.size() > HistorySize)
+		mSent.pop_front();
+
+	const identifier localId = mMessageBus->localId();
+	for (const auto &id : peers) {
+		Peer &peer = mPeers[id];
+		const States *base = peer.acked ? &peer.ackedStates : nullptr;
+
+		BinaryFormatter entries;
+		auto writeEntry = [&](uint8_t mask, const identifier &entityId) {
+			if (entityId == localId)
+				entries << uint8_t(mask | SenderEntity);
+			else
+				entries << uint8_t(mask) << entityId;
+		};
+
+		for (const auto &[entityId, state] : states) {
+			uint8_t mask = AllFields;
+			if (auto it = base ? base->find(entityId) : States::const_iterator();
+			    base && it != base->end()) {
+				const EntityState &b = it->second;
+				mask = (state.block != b.block ? BlockField : 0) |
+				       (state.offset != b.offset ? OffsetField : 0) |
+				       (state.rotation != b.rotation ? RotationField : 0) |
+				       (state.yaw != b.yaw || state.pitch != b.pitch || state.walk != b.walk
+				            ? ControlField
+				            : 0);
+				if (!mask)
+					continue;
+			}
+
+			writeEntry(mask, entityId);
+			if (mask & BlockField)
+				entries << int32_t(state.block.x) << int32_t(state.block.y)
+				        << int32_t(state.block.z);
+			if (mask & OffsetField)
+				entries << state.offset[0] << state.offset[1] << state.offset[2];
+			if (mask & RotationField)
+				entries << state.rotation;
+			if (mask & ControlField)
+				entries << state.yaw << state.pitch << state.walk;
+		}
+
+		if (base)
+			for (const auto &[entityId, state] : *base)
+				if (states.find(entityId) == states.end())
+					writeEntry(RemovedEntity, entityId);
+
+		// Nothing changed since the acknowledged snapshot and nothing to acknowledge
+		if (entries.data().empty() && !peer.ackPending)
+			continue;
+
+		BinaryFormatter formatter;
+		formatter << sequence;
+		formatter << uint8_t((peer.received ? HasAck : 0) | (base ? HasBase : 0));
+		if (peer.received)
+			formatter << *peer.received;
+		if (base)
+			formatter << *peer.acked;
+		formatter << entries.data();
+
+		Message message(Message::EntitySnapshot);
+		message.destination = id;
+		message.payload = std::move(formatter.data());
+		mMessageBus->send(message);
+		peer.ackPending = false;
+	}
+
+	// Peers which left are forgotten
+	for (auto it = mPeers.begin(); it != mPeers.end();) {
+		if (std::find(peers.begin(), peers.end(), it->first) == peers.end())
+			it = mPeers.erase(it);
+		else
+			++it;
+	}
+}
+
+optional<Snapshots::States> Snapshots::receive(const Message &message) {
+	BinaryFormatter formatter(message.payload);
+	uint16_t sequence = 0, ack = 0, base = 0;
+	uint8_t flags = 0;
+	if (!(formatter >> sequence >> flags) || ((flags & HasAck) && !(formatter >> ack)) ||
+	    ((flags & HasBase) && !(formatter >> base)))
+		throw std::runtime_error("Invalid entity snapshot message");
+
+	Peer &peer = mPeers[message.source];
+	if (!(flags & HasAck)) {
+		peer.acked.reset(); // the peer lost our snapshots, send full states
+	} else if (!peer.acked || int16_t(ack - *peer.acked) > 0) {
+		auto it = std::find_if(mSent.begin(), mSent.end(),
+		                       [ack](const auto &s) { return s.first == ack; });
+		if (it != mSent.end()) {
+			peer.acked = ack;
+			peer.ackedStates = it->second;
+		} else {
+			peer.acked.reset(); // too old to be used as a base, send full states
+		}
+	}
+
+	if (peer.received && int16_t(sequence - *peer.received) <= 0)
+		return nullopt; // outdated
+
+	States states;
+	if (flags & HasBase) {
+		auto it = std::find_if(peer.history.begin(), peer.history.end(),
+		                       [base](const auto &s) { return s.first == base; });
+		if (it == peer.history.end()) {
+			// Stop acknowledging, so the peer falls back to full states
+			std::cout << "Missing base for entity snapshot" << std::endl;
+			peer.received.reset();
+			peer.ackPending = true;
+			return nullopt;
+		}
+		states = it->second;
+	}
+
+	bool changed = false;
+	uint8_t mask = 0;
+	while (formatter >> mask) {
+		changed = true;
+		identifier id = message.source;
+		if (!(mask & SenderEntity) && !(formatter >> id))
+			throw std::runtime_error("Invalid entity snapshot message");
+
+		if (mask & RemovedEntity) {
+			states.erase(id);
+			continue;
+		}
+
+		EntityState &state = states[id];
+		bool valid = true;
+		if (mask & BlockField) {
+			int32_t x = 0, y = 0, z = 0;
+			valid = valid && (formatter >> x >> y >> z);
+			state.block = int3(x, y, z);
+		}
+		if (mask & OffsetField)
+			valid = valid && (formatter >> state.offset[0] >> state.offset[1] >> state.offset[2]);
+		if (mask & RotationField)
+			valid = valid && (formatter >> state.rotation);
+		if (mask & ControlField)
+			valid = valid && (formatter >> state.yaw >> state.pitch >> state.walk);
+		if (!valid)
+			throw std::runtime_error("Invalid entity snapshot message");
+	}
+
+	peer.received = sequence;
+	peer.ackPending |= changed; // acknowledging an unchanged base is useless
+	peer.history.emplace_back(sequence, states);
+	if (peer.history.size() > HistorySize)
+		peer.history.pop_front();
+
+	return states;
+}
+
+} // namespace convergence
@@ -0,0 +1,87 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+#ifndef CONVERGENCE_SNAPSHOT_H
+#define CONVERGENCE_SNAPSHOT_H
+
+#include "src/identifier.hpp"
+#include "src/include.hpp"
+#include "src/messagebus.hpp"
+#include "src/types.hpp"
+
+#include <array>
+#include <deque>
+#include <map>
+#include <vector>
+
+namespace convergence {
+
+// Quantised entity state, the position is fixed-point relative to its block
+struct EntityState {
+	int3 block;
+	std::array<uint16_t, 3> offset = {}; // 1/1024 unit steps
+	uint32_t rotation = 0;               // smallest-three quaternion
+	uint16_t yaw = 0, pitch = 0;         // 2^16 steps per turn
+	int16_t walk = 0;                    // 1/256 unit/s steps
+
+	static EntityState Quantise(const mat4 &transform);
+
+	mat4 transform(void) const;
+	void setControl(float yaw, float pitch, float walk);
+	float yawAngle(void) const;
+	float pitchAngle(void) const;
+	float walkSpeed(void) const;
+
+	bool operator==(const EntityState &other) const;
+	bool operator!=(const EntityState &other) const { return !(*this == other); }
+};
+
+// States of local entities are sent to each peer once per network tick, delta-encoded against the
+// last snapshot the peer acknowledged. Acknowledgements ride on the peer's own snapshots.
+class Snapshots {
+public:
+	using States = std::map<identifier, EntityState>;
+
+	Snapshots(sptr<MessageBus> messageBus);
+	~Snapshots(void);
+
+	void send(const States &states, const std::vector<identifier> &peers);
+	optional<States> receive(const Message &message); // full states of the sender
+
+private:
+	struct Peer {
+		optional<uint16_t> acked; // our last snapshot known to the peer
+		States ackedStates;
+		optional<uint16_t> received; // last snapshot received from the peer
+		std::deque<std::pair<uint16_t, States>> history;
+		bool ackPending = false;
+	};
+
+	static const size_t HistorySize = 32;
+
+	sptr<MessageBus> mMessageBus;
+	uint16_t mSequence = 0;
+	std::deque<std::pair<uint16_t, States>> mSent;
+	std::map<identifier, Peer> mPeers;
+};
+
+} // namespace convergence
+
+#endif
@@ -23,23 +23,100 @@
 
 #include "pla/binaryformatter.hpp"
 
+#include <map>
+
 namespace convergence {
 
 using pla::BinaryFormatter;
 using pla::to_hex;
 
-Store::Store(sptr<MessageBus> messageBus) : mMessageBus(messageBus) {}
+// Keep batches well under the data channel message size limit
+const size_t MaxBatchSize = 60 * 1024;
+const size_t MaxBatchRequests = 1024;
+
+const double RequestTimeout = 2.;
+const int MaxRequestAttempts = 5;
+
+Store::Store(sptr<MessageBus> messageBus, uptr<Backend> backend)
+    : mMessageBus(messageBus),
+      mBackend(backend ? std::move(backend) : std::make_unique<MemoryBackend>()) {}
 
 Store::~Store(void) {}
 
-binary Store::insert(const binary &data) {
+void Store::update(double time) {
+	std::map<identifier, std::vector<binary>> batches;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mTime += time;
+
+		auto it = mPendingRequests.begin();
+		while (it != mPendingRequests.end()) {
+			auto &[digest, request] = *it;
+			if (!request.sent || mTime < request.deadline) {
+				++it;
+				continue;
+			}
+
+			if (request.attempts >= MaxRequestAttempts) {
+				std::cout << "Giving up request for " << to_hex(digest) << std::endl;
+				mNotifiables.erase(digest);
+				it = mPendingRequests.erase(it);
+				++mStats.expiredRequests;
+				continue;
+			}
+
+			// Try another peer
+			if (!request.peer.isNull())
+				mUnresponsivePeers.insert(request.peer);
+			request.peer = nextPeer(request.peer);
+			request.sent = false;
+			mRequestQueue.push_back(digest);
+			++mStats.retries;
+			++it;
+		}
+
+		for (const auto &digest : mRequestQueue) {
+			auto jt = mPendingRequests.find(digest);
+			if (jt == mPendingRequests.end() || jt->second.sent)
+				continue;
+
+			auto &request = jt->second;
+			request.sent = true;
+			request.deadline = mTime + RequestTimeout;
+			++request.attempts;
+			batches[request.peer].push_back(digest);
+
+			++mStats.requests;
+			if (!request.peer.isNull() && !mPeers.empty())
+				mStats.avoidedResponses += mPeers.size() - 1;
+		}
+		mRequestQueue.clear();
+	}
+
+	for (const auto &[peer, digests] : batches)
+		sendRequests(peer, digests);
+}
+
+Store::Stats Store::stats(void) const {
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mStats;
+}
+
+binary Store::insert(const binary &data) { return insert(data, false); }
+
+binary Store::insert(const binary &data, bool received) {
 	const binary digest = Hash(data);
 	auto dataPtr = std::make_shared<binary>(data);
 
 	std::vector<weak_ptr<Notifiable>> notifiables;
 	{
 		std::lock_guard<std::mutex> lock(mMutex);
-		mData[digest] = dataPtr;
+		if (!mBackend->contains(digest))
+			mBackend->insert(digest, data);
+		else if (received)
+			++mStats.duplicateResponses;
+
+		mPendingRequests.erase(digest);
 
 		auto range = mNotifiables.equal_range(digest);
 		std::transform(range.first, range.second, std::back_inserter(notifiables),
@@ -58,18 +135,39 @@ binary Store::insert(const binary &data) {
 
 shared_ptr<binary> Store::retrieve(const binary &digest) const {
 	std::lock_guard<std::mutex> lock(mMutex);
-	auto it = mData.find(digest);
-	return (it != mData.end() ? it->second : nullptr);
+	return mBackend->retrieve(digest);
+}
+
+void Store::setReference(const string &name, const binary &digest) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	mBackend->setReference(name, digest);
 }
 
-void Store::request(const binary &digest, weak_ptr<Notifiable> notifiable) {
+optional<binary> Store::reference(const string &name) const {
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mBackend->reference(name);
+}
+
+void Store::request(const binary &digest, weak_ptr<Notifiable> notifiable,
+                    const identifier &source) {
 	if (auto data = retrieve(digest)) {
 		if (auto locked = notifiable.lock()) {
 			locked->notify(digest, data, shared_from_this());
 		}
 	} else {
-		insertNotifiable(digest, notifiable);
-		sendRequest(digest);
+		std::lock_guard<std::mutex> lock(mMutex);
+		mNotifiables.insert(std::make_pair(digest, notifiable));
+		if (mPendingRequests.find(digest) != mPendingRequests.end()) {
+			++mStats.coalescedRequests;
+			return;
+		}
+
+		// Requests are sent in batches by update()
+		auto &request = mPendingRequests[digest];
+		request.peer = !source.isNull() && mUnresponsivePeers.count(source) == 0
+		                   ? source
+		                   : nextPeer(source);
+		mRequestQueue.push_back(digest);
 	}
 }
 
@@ -83,16 +181,31 @@ bool Store::broadcast(const binary &digest) {
 	return false;
 }
 
+void Store::onPeer(const identifier &id) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	mPeers.insert(id);
+}
+
 void Store::onMessage(const Message &message) {
+	if (!message.source.isNull()) {
+		std::lock_guard<std::mutex> lock(mMutex);
+		mPeers.insert(message.source);
+		mUnresponsivePeers.erase(message.source);
+	}
+
 	switch (message.type) {
 	case Message::Store: {
 		std::cout << "Received data" << std::endl;
-		insert(message.payload);
+		insert(message.payload, true);
 		break;
 	}
 
 	case Message::Request: {
 		std::cout << "Received request for " << to_hex(message.payload) << std::endl;
+		if (!message.source.isNull()) {
+			std::lock_guard<std::mutex> lock(mMutex);
+			mLegacyPeers.insert(message.source);
+		}
 		if (auto data = retrieve(message.payload)) {
 			Message response(Message::Store);
 			response.destination = message.source;
@@ -102,23 +215,147 @@ void Store::onMessage(const Message &message) {
 		break;
 	}
 
+	case Message::StoreBatch: {
+		BinaryFormatter formatter(message.payload);
+		uint32_t size;
+		while (formatter >> size) {
+			if (size > formatter.remainingSize())
+				throw std::runtime_error("Invalid store batch message");
+
+			binary data(size);
+			formatter >> data;
+			insert(data, true);
+		}
+		break;
+	}
+
+	case Message::RequestBatch: {
+		if (!message.source.isNull()) {
+			std::lock_guard<std::mutex> lock(mMutex);
+			mLegacyPeers.erase(message.source);
+		}
+
+		const binary &payload = message.payload;
+		if (payload.size() % 16 != 0)
+			throw std::runtime_error("Invalid request batch message");
+
+		std::vector<binary> digests;
+		for (auto it = payload.begin(); it != payload.end(); it += 16)
+			digests.emplace_back(it, it + 16);
+
+		std::cout << "Received batch request for " << digests.size() << " digests" << std::endl;
+		sendData(message.source, digests);
+		break;
+	}
+
 	default:
 		// Ignore
 		break;
 	}
 }
 
-void Store::sendRequest(const binary &digest) {
+identifier Store::nextPeer(const identifier &previous) const {
+	if (mPeers.empty())
+		return identifier(); // broadcast
+
+	auto next = mPeers.upper_bound(previous);
+	if (next == mPeers.end())
+		next = mPeers.begin();
+
+	// Prefer peers which answer
+	auto it = next;
+	do {
+		if (mUnresponsivePeers.count(*it) == 0)
+			return *it;
+		if (++it == mPeers.end())
+			it = mPeers.begin();
+	} while (it != next);
+
+	return *next;
+}
+
+void Store::sendRequest(const identifier &destination, const binary &digest) {
 	std::cout << "Requesting " << to_hex(digest) << std::endl;
 
 	Message message(Message::Request);
+	message.destination = destination;
 	message.payload = digest;
-	mMessageBus->broadcast(message);
+	mMessageBus->send(message); // broadcast if destination is null
 }
 
-void Store::insertNotifiable(const binary &digest, weak_ptr<Notifiable> notifiable) {
-	std::lock_guard<std::mutex> lock(mMutex);
-	mNotifiables.insert(std::make_pair(digest, notifiable));
+void Store::sendRequests(const identifier &destination, const std::vector<binary> &digests) {
+	bool legacy;
+	{
+		// A broadcast must also reach legacy peers
+		std::lock_guard<std::mutex> lock(mMutex);
+		legacy = destination.isNull() ? !mLegacyPeers.empty() : mLegacyPeers.count(destination) > 0;
+	}
+
+	if (legacy) {
+		for (const auto &digest : digests)
+			sendRequest(destination, digest);
+		return;
+	}
+
+	std::cout << "Requesting " << digests.size() << " digests" << std::endl;
+
+	for (size_t i = 0; i < digests.size(); i += MaxBatchRequests) {
+		Message message(Message::RequestBatch);
+		message.destination = destination;
+		auto last = digests.begin() + std::min(i + MaxBatchRequests, digests.size());
+		for (auto it = digests.begin() + i; it != last; ++it)
+			message.payload.insert(message.payload.end(), it->begin(), it->end());
+
+		mMessageBus->send(message); // broadcast if destination is null
+	}
+}
+
+void Store::sendData(const identifier &destination, const std::vector<binary> &digests) {
+	BinaryFormatter formatter;
+	auto flush = [&]() {
+		Message response(Message::StoreBatch);
+		response.destination = destination;
+		response.payload = std::move(formatter.data());
+		mMessageBus->send(response);
+		formatter.data().clear();
+	};
+
+	for (const auto &digest : digests) {
+		auto data = retrieve(digest);
+		if (!data)
+			continue;
+
+		if (!formatter.data().empty() && formatter.data().size() + 4 + data->size() > MaxBatchSize)
+			flush();
+
+		formatter << uint32_t(data->size());
+		formatter << *data;
+	}
+
+	if (!formatter.data().empty())
+		flush();
+}
+
+bool Store::MemoryBackend::contains(const binary &digest) const {
+	return mData.find(digest) != mData.end();
+}
+
+void Store::MemoryBackend::insert(const binary &digest, const binary &data) {
+	mData[digest] = std::make_shared<binary>(data);
+}
+
+shared_ptr<binary> Store::MemoryBackend::retrieve(const binary &digest) const {
+	auto it = mData.find(digest);
+	return (it != mData.end() ? it->second : nullptr);
+}
+
+void Store::MemoryBackend::setReference(const string &name, const binary &digest) {
+	mReferences[name] = digest;
+}
+
+optional<binary> Store::MemoryBackend::reference(const string &name) const {
+	auto it = mReferences.find(name);
+	return it != mReferences.end() ? std::make_optional(it->second) : nullopt;
 }
 
 binary Store::Hash(const binary &data) {
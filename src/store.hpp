@@ -25,39 +25,104 @@
 #include "src/messagebus.hpp"
 
 #include <mutex>
+#include <set>
 #include <unordered_map>
+#include <vector>
 
 namespace convergence {
 
 class Store : public MessageBus::Listener, public std::enable_shared_from_this<Store> {
 public:
-	Store(sptr<MessageBus> messageBus);
+	// Storage for digest to data records, calls are serialized by the store
+	class Backend {
+	public:
+		virtual ~Backend(void) {}
+
+		virtual bool contains(const binary &digest) const = 0;
+		virtual void insert(const binary &digest, const binary &data) = 0;
+		virtual shared_ptr<binary> retrieve(const binary &digest) const = 0;
+
+		// Named references to digests, for instance the last root of a tree
+		virtual void setReference(const string &name, const binary &digest) = 0;
+		virtual optional<binary> reference(const string &name) const = 0;
+	};
+
+	class MemoryBackend final : public Backend {
+	public:
+		bool contains(const binary &digest) const;
+		void insert(const binary &digest, const binary &data);
+		shared_ptr<binary> retrieve(const binary &digest) const;
+
+		void setReference(const string &name, const binary &digest);
+		optional<binary> reference(const string &name) const;
+
+	private:
+		std::unordered_map<binary, shared_ptr<binary>, binary_hash> mData;
+		std::unordered_map<string, binary> mReferences;
+	};
+
+	struct Stats {
+		size_t requests;           // digests sent in requests, retries included
+		size_t coalescedRequests;  // requests joining one already in flight
+		size_t retries;            // requests sent to another peer after a timeout
+		size_t expiredRequests;    // requests given up after too many attempts
+		size_t duplicateResponses; // received data which was already stored
+		size_t avoidedResponses;   // responses saved by asking a single peer
+	};
+
+	static binary Hash(const binary &data);
+
+	Store(sptr<MessageBus> messageBus, uptr<Backend> backend = nullptr);
 	virtual ~Store(void);
 
+	void update(double time); // sends queued requests and retries timed out ones
+	Stats stats(void) const;
+
 	binary insert(const binary &data);
 	shared_ptr<binary> retrieve(const binary &digest) const;
 
+	void setReference(const string &name, const binary &digest);
+	optional<binary> reference(const string &name) const;
+
 	class Notifiable {
 	public:
 		virtual void notify(const binary &digest, shared_ptr<binary> data,
 		                    shared_ptr<Store> store) = 0;
 	};
 
-	void request(const binary &digest, weak_ptr<Notifiable> notifiable);
+	// The source is the peer expected to hold the data, if known
+	void request(const binary &digest, weak_ptr<Notifiable> notifiable,
+	             const identifier &source = identifier());
 	bool broadcast(const binary &digest);
 
 private:
+	struct PendingRequest {
+		identifier peer; // null to broadcast
+		double deadline = 0.;
+		int attempts = 0;
+		bool sent = false;
+	};
+
+	void onPeer(const identifier &id);
 	void onMessage(const Message &message);
-	void sendRequest(const binary &digest);
-	void insertNotifiable(const binary &digest, weak_ptr<Notifiable> notifiable);
+	binary insert(const binary &data, bool received);
+	identifier nextPeer(const identifier &previous) const; // requires mMutex
+	void sendRequest(const identifier &destination, const binary &digest);
+	void sendRequests(const identifier &destination, const std::vector<binary> &digests);
+	void sendData(const identifier &destination, const std::vector<binary> &digests);
 
 	shared_ptr<MessageBus> mMessageBus;
-	std::unordered_map<binary, shared_ptr<binary>, binary_hash> mData;
+	uptr<Backend> mBackend;
 	std::unordered_multimap<binary, weak_ptr<Notifiable>, binary_hash> mNotifiables;
+	std::unordered_map<binary, PendingRequest, binary_hash> mPendingRequests;
+	std::vector<binary> mRequestQueue;
+	std::set<identifier> mPeers;
+	std::set<identifier> mUnresponsivePeers; // timed out since their last message
+	std::set<identifier> mLegacyPeers;       // sent plain requests, don't handle batches
+	Stats mStats = {};
+	double mTime = 0.;
 
 	mutable std::mutex mMutex;
-
-	static binary Hash(const binary &data);
 };
 } // namespace convergence
 
@@ -25,42 +25,51 @@ namespace convergence {
 
 using pla::bounds;
 using pla::PerlinNoise;
+#ifndef HEADLESS
 using pla::Texture;
+#endif
 
 Surface::Surface(std::function<shared_ptr<Block>(const int3 &b)> retrieveFunc)
-    : mRetrieveFunc(retrieveFunc) {
-	mProgram = std::make_shared<Program>(std::make_shared<VertexShader>("shader/ground.vect"),
-	                                     std::make_shared<FragmentShader>("shader/ground.frag"));
-	mInkProgram = std::make_shared<Program>(std::make_shared<VertexShader>("shader/ink.vect"),
-	                                        std::make_shared<FragmentShader>("shader/ink.frag"));
-
-	/*
-	    auto data = new uint8_t[256 * 256 * 256 * 4];
-	    int i = 0;
-	    PerlinNoise perlin(666, 256 / 16);
-	    for (int x = 0; x < 256; ++x)
-	        for (int y = 0; y < 256; ++y)
-	            for (int z = 0; z < 256; ++z) {
-	                double n = perlin.generate(dvec3(x, y, z) / 16., 3);
-	                uint8_t v = bounds(int((0.5 + n * 0.5) * 255.), 0, 255);
-	                data[i++] = v;
-	                data[i++] = v;
-	                data[i++] = v;
-	                data[i++] = 1;
-	            }
-
-	    auto texture = std::make_shared<Texture>(GL_TEXTURE_3D);
-	    texture->setImage(data, 256, 256, 256);
-	    delete[] data;
-
-	    mProgram->setUniform("detail", texture);*/
-}
+    : mRetrieveFunc(retrieveFunc) {}
 
 Surface::~Surface(void) {}
 
 void Surface::update(double time) {}
 
+#ifndef HEADLESS
 int Surface::draw(const Context &context) {
+	// Programs are created on first draw so the surface can exist without a graphics context
+	if (!mProgram) {
+		mProgram =
+		    std::make_shared<Program>(std::make_shared<VertexShader>("shader/ground.vect"),
+		                              std::make_shared<FragmentShader>("shader/ground.frag"));
+
+		/*
+		    auto data = new uint8_t[256 * 256 * 256 * 4];
+		    int i = 0;
+		    PerlinNoise perlin(666, 256 / 16);
+		    for (int x = 0; x < 256; ++x)
+		        for (int y = 0; y < 256; ++y)
+		            for (int z = 0; z < 256; ++z) {
+		                double n = perlin.generate(dvec3(x, y, z) / 16., 3);
+		                uint8_t v = bounds(int((0.5 + n * 0.5) * 255.), 0, 255);
+		                data[i++] = v;
+		                data[i++] = v;
+		                data[i++] = v;
+		                data[i++] = 1;
+		            }
+
+		    auto texture = std::make_shared<Texture>(GL_TEXTURE_3D);
+		    texture->setImage(data, 256, 256, 256);
+		    delete[] data;
+
+		    mProgram->setUniform("detail", texture);*/
+
+		mInkProgram =
+		    std::make_shared<Program>(std::make_shared<VertexShader>("shader/ink.vect"),
+		                              std::make_shared<FragmentShader>("shader/ink.frag"));
+	}
+
 	const vec3 pos = context.cameraPosition();
 	const int3 b = Block::blockCoord(int3(pos));
 	const float d = (float(Block::Size) + 1.f) * 0.5f * pla::Sqrt2;
@@ -93,6 +102,7 @@ int Surface::draw(const Context &context) {
 	}
 	return count;
 }
+#endif
 
 float Surface::intersect(const vec3 &pos, const vec3 &move, float radius, vec3 *intersection) {
 	const vec3 p1 = pos;
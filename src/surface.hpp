@@ -26,21 +26,27 @@
 #include "src/volume.hpp"
 
 #include "pla/collidable.hpp"
+
+#ifndef HEADLESS
 #include "pla/context.hpp"
 #include "pla/object.hpp"
 #include "pla/program.hpp"
 #include "pla/shader.hpp"
+#endif
 
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
 using pla::Collidable;
+
+#ifndef HEADLESS
 using pla::Context;
 using pla::FragmentShader;
 using pla::Object;
 using pla::Program;
 using pla::VertexShader;
+#endif
 
 namespace convergence {
 
@@ -98,7 +104,9 @@ public:
 	~Surface(void);
 
 	void update(double time);
+#ifndef HEADLESS
 	int draw(const Context &context);
+#endif
 	float intersect(const vec3 &pos, const vec3 &move, float radius, vec3 *intersection = NULL);
 
 protected:
@@ -106,8 +114,10 @@ protected:
 	                  std::unordered_set<sptr<Block>> &processed,
 	                  std::function<bool(sptr<Block>)> check) const;
 
+#ifndef HEADLESS
 	shared_ptr<Program> mProgram;
 	shared_ptr<Program> mInkProgram;
+#endif
 	std::function<shared_ptr<Block>(const int3 &b)> mRetrieveFunc;
 
 private:
@@ -23,6 +23,8 @@
 
 #include "pla/binaryformatter.hpp"
 
+#include <algorithm>
+#include <chrono>
 #include <set>
 
 namespace convergence {
@@ -30,20 +32,117 @@ namespace convergence {
 using pla::BinaryFormatter;
 using namespace std::placeholders;
 
+const size_t SnapshotChunkSize = 32 * 1024;
+const size_t SnapshotWindow = 256 * 1024; // queued per peer
+const double SnapshotTimeout = 5.;        // without chunks, for instance from a legacy peer
+const uint8_t LastSnapshotChunk = 0x01;
+
 Terrain::Terrain(shared_ptr<MessageBus> messageBus, shared_ptr<Store> store, int seed)
-    : Merkle(store), mMessageBus(messageBus), mNoise(seed),
-      mSurface(std::bind(&Terrain::getBlock, this, _1)) {}
+    : Merkle(store), mMessageBus(messageBus), mStore(store), mNoise(seed),
+      mSurface(std::bind(&Terrain::getBlock, this, _1)) {
+#ifndef __EMSCRIPTEN__
+	// Keep one hardware thread for the main loop
+	const unsigned count = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+	for (unsigned i = 0; i < count; ++i)
+		mGenerationWorkers.emplace_back(&Terrain::runGeneration, this);
+#endif
+
+	// Restore the last roots, a persistent store resolves them without network
+	if (auto digest = mStore->reference("terrain-compressed"))
+		updateRoot(*digest, Format::Compressed);
+	if (auto digest = mStore->reference("terrain"))
+		updateRoot(*digest, Format::Full);
+}
 
-Terrain::~Terrain(void) {}
+Terrain::~Terrain(void) {
+	{
+		std::lock_guard<std::mutex> lock(mGenerationMutex);
+		mGenerationStopped = true;
+	}
+	mGenerationCondition.notify_all();
+	for (auto &worker : mGenerationWorkers)
+		worker.join();
+}
 
 void Terrain::update(double time) {
 	Merkle::update(time);
+	finishGeneration(time);
 	mSurface.update(time);
+
+	mEvictionTime += time;
+	if (mEvictionTime >= 1.) {
+		mEvictionTime = 0.;
+		evictBlocks();
+	}
+
+	mAnnounceElapsed += time;
+	announceRoot();
+
+	bool expired = false;
+	{
+		std::lock_guard<std::mutex> lock(mSnapshotMutex);
+		if (mSnapshotRequest && (mSnapshotRequest->elapsed += time) >= SnapshotTimeout)
+			expired = true;
+	}
+	if (expired) {
+		std::cout << "Terrain snapshot timed out" << std::endl;
+		finishSnapshot(); // the rest is requested node by node
+	}
+	sendSnapshots();
+
+	// Blocks used until the next update are marked with the new tick
+	++mTick;
 }
 
+void Terrain::setFocus(const vec3 &position) {
+	{
+		std::lock_guard<std::mutex> lock(mGenerationMutex);
+		mFocus = position;
+	}
+
+	const int3 b = Block::blockCoord(int3(position));
+	{
+		std::lock_guard<std::mutex> lock(mInterestMutex);
+		mInterestCenter = position;
+		if (mInterestRadius <= 0.f || b == mInterestBlock)
+			return;
+
+		mInterestBlock = b;
+	}
+	updateInterest();
+}
+
+void Terrain::setInterestRadius(float radius) {
+	{
+		std::lock_guard<std::mutex> lock(mInterestMutex);
+		mInterestRadius = std::max(radius, 0.f);
+	}
+	updateInterest();
+}
+
+Terrain::GenerationStats Terrain::generationStats(void) const {
+	std::lock_guard<std::mutex> lock(mGenerationMutex);
+	return GenerationStats{mGenerationQueue.size(), mGenerationRate};
+}
+
+void Terrain::setMemoryBudget(size_t bytes) { mMemoryBudget = bytes; }
+
+Terrain::CacheStats Terrain::cacheStats(void) const { return mCacheStats; }
+
+#ifndef HEADLESS
 int Terrain::draw(const Context &context) { return mSurface.draw(context); }
+#endif
 
 float Terrain::intersect(const vec3 &pos, const vec3 &move, float radius, vec3 *intersection) {
+	// Collisions can't wait for generation, populate blocks on the way synchronously
+	const vec3 margin(radius + 2.f);
+	const int3 lower = Block::blockCoord(int3(glm::min(pos, pos + move) - margin));
+	const int3 upper = Block::blockCoord(int3(glm::max(pos, pos + move) + margin));
+	for (int x = lower.x; x <= upper.x; ++x)
+		for (int y = lower.y; y <= upper.y; ++y)
+			for (int z = lower.z; z <= upper.z; ++z)
+				getPopulatedBlock(int3(x, y, z));
+
 	return mSurface.intersect(pos, move, radius, intersection);
 }
 
@@ -62,7 +161,7 @@ void Terrain::dig(const vec3 &p, int weight, float radius) {
 				const vec3 q = vec3(i.x, i.y, i.z) + vec3(0.5f);
 				const float t = 1.f - glm::distance(p, q) / radius;
 				if (t > 0.f) {
-					auto block = getBlock(Block::blockCoord(i));
+					auto block = getPopulatedBlock(Block::blockCoord(i));
 					const int3 c = Block::cellCoord(i);
 					Surface::value v = block->getValue(c);
 					const int newWeight = pla::bounds(int(v.weight) - int(weight * t), 0, 255);
@@ -76,19 +175,71 @@ void Terrain::dig(const vec3 &p, int weight, float radius) {
 		}
 	}
 
+	beginEdit();
 	for (auto &block : changed)
 		block->commit();
+	commitEdit();
+}
+
+void Terrain::beginEdit(void) { ++mEditDepth; }
+
+void Terrain::commitEdit(void) {
+	if (mEditDepth == 0)
+		throw std::runtime_error("Terrain edit committed without being started");
+
+	if (--mEditDepth > 0)
+		return;
+
+	std::vector<std::pair<Index, binary>> updates;
+	updates.reserve(mEditedData.size());
+	for (auto &[pos, data] : mEditedData) {
+		propagateData(pos, data);
+		updates.emplace_back(TerrainIndex(pos), convertData(data, format()));
+	}
+	mEditedData.clear();
+	updateData(std::move(updates), false); // don't call changeData()
 }
 
-void Terrain::broadcast() { propagateRoot(rootDigest()); }
+void Terrain::broadcast() {
+	std::lock_guard<std::mutex> lock(mAnnounceMutex);
+	for (auto &[id, digest] : mPeerRoots)
+		digest.clear(); // announce again even if unchanged
+	mAnnouncePending = true;
+}
+
+void Terrain::setAnnounceInterval(double seconds) {
+	std::lock_guard<std::mutex> lock(mAnnounceMutex);
+	mAnnounceInterval = seconds;
+}
 
 sptr<Terrain::Block> Terrain::getBlock(const int3 &b) {
-	if (auto it = mBlocks.find(b); it != mBlocks.end())
+	if (auto it = mBlocks.find(b); it != mBlocks.end()) {
+		it->second->touch(mTick);
 		return it->second;
+	}
 
 	auto block = std::make_shared<Block>(this, b);
+	block->touch(mTick);
 	mBlocks[b] = block;
-	populateBlock(block);
+
+	// Modified blocks are restored from the tree, others are generated from the seed
+	auto node = get(TerrainIndex(b));
+	if (auto data = node ? node->data() : nullptr) {
+		block->replace(*data);
+		mEvictedBlocks.erase(b);
+		++mCacheStats.reloads;
+	} else {
+		enqueueGeneration(b);
+	}
+	return block;
+}
+
+sptr<Terrain::Block> Terrain::getPopulatedBlock(const int3 &b) {
+	auto block = getBlock(b);
+	if (block->isPending()) {
+		cancelGeneration(b);
+		populateBlock(block);
+	}
 	return block;
 }
 
@@ -98,21 +249,47 @@ Surface::value Terrain::getValue(const int3 &p) {
 }
 
 bool Terrain::setValue(const int3 &p, Surface::value v) {
-	sptr<Block> block = getBlock(Block::blockCoord(p));
+	sptr<Block> block = getPopulatedBlock(Block::blockCoord(p));
 	return block->writeValue(Block::cellCoord(p), v, true); // mark changed
 }
 
 bool Terrain::setType(const int3 &p, uint8_t t) {
-	sptr<Block> block = getBlock(Block::blockCoord(p));
+	sptr<Block> block = getPopulatedBlock(Block::blockCoord(p));
 	return block->writeType(Block::cellCoord(p), t, true); // mark changed
 }
 
+void Terrain::onPeer(const identifier &id) {
+	std::lock_guard<std::mutex> lock(mAnnounceMutex);
+	if (mPeerRoots.emplace(id, binary()).second)
+		mAnnouncePending = true;
+}
+
 void Terrain::onMessage(const Message &message) {
 	switch (message.type) {
 	case Message::TerrainRoot: {
 		const binary &digest = message.payload;
 		std::cout << "Received terrain root " << pla::to_hex(digest) << std::endl;
-		updateRoot(digest);
+		setPeerRoot(message.source, digest);
+		// The sender is a legacy peer, it can't serve snapshots and gets full roots from now on
+		setLegacyPeer(message.source, true);
+		updateRoot(digest, Format::Full, message.source);
+		break;
+	}
+	case Message::TerrainCompressedRoot: {
+		const binary &digest = message.payload;
+		std::cout << "Received compressed terrain root " << pla::to_hex(digest) << std::endl;
+		setPeerRoot(message.source, digest);
+		setLegacyPeer(message.source, false);
+		if (!requestSnapshot(digest, Format::Compressed, message.source))
+			updateRoot(digest, Format::Compressed, message.source);
+		break;
+	}
+	case Message::TerrainSnapshotRequest: {
+		startSnapshot(message);
+		break;
+	}
+	case Message::TerrainSnapshot: {
+		receiveSnapshot(message);
 		break;
 	}
 	case Message::TerrainUpdate: {
@@ -121,12 +298,32 @@ void Terrain::onMessage(const Message &message) {
 		if (!(formatter >> x >> y >> z))
 			throw std::runtime_error("Invalid terrain update message");
 		int3 pos(x, y, z);
+		if (!isInterested(TerrainIndex(pos)))
+			break; // merged at the hash level with the sender's root
+
 		std::cout << "Received terrain update for position " << pos.x << "," << pos.y << ","
 		          << pos.z << std::endl;
-		binary data = formatter.remaining();
+		// Legacy peers send raw cells
+		binary data = convertData(formatter.remaining(), format());
 		updateData(TerrainIndex(pos), data, true); // call changeData()
 		break;
 	}
+	case Message::TerrainDelta: {
+		BinaryFormatter formatter(message.payload);
+		int32_t x, y, z;
+		binary base(16), target(16);
+		if (!(formatter >> x >> y >> z >> base >> target))
+			throw std::runtime_error("Invalid terrain delta message");
+		int3 pos(x, y, z);
+		if (!isInterested(TerrainIndex(pos)))
+			break;
+
+		std::cout << "Received terrain delta for position " << pos.x << "," << pos.y << ","
+		          << pos.z << std::endl;
+		if (!applyDelta(pos, base, target, formatter))
+			requestBlock(pos, target, message.source);
+		break;
+	}
 	default:
 		// Ignore
 		break;
@@ -137,101 +334,539 @@ bool Terrain::replaceData(const int3 &pos, const binary &data) {
 	std::cout << "Replacing block at position " << pos.x << "," << pos.y << "," << pos.z
 	          << std::endl;
 	auto block = getBlock(pos);
+	if (block->isPending())
+		cancelGeneration(pos); // data is replaced entirely
+
 	return block->replace(data);
 }
 
 bool Terrain::mergeData(const int3 &pos, binary &data) {
 	std::cout << "Merging block at position " << pos.x << "," << pos.y << "," << pos.z << std::endl;
-	auto block = getBlock(pos);
+	auto block = getPopulatedBlock(pos);
 	return block->merge(data);
 }
 
 void Terrain::commitData(const int3 &pos, const binary &data) {
+	if (mEditDepth > 0) {
+		mEditedData[pos] = data;
+		return;
+	}
+
 	propagateData(pos, data);
-	updateData(TerrainIndex(pos), data, false); // don't call changeData()
+	updateData(TerrainIndex(pos), convertData(data, format()), false); // don't call changeData()
 }
 
 bool Terrain::merge(const binary &a, binary &b) {
-	if (a.size() != Block::CellsCount * sizeof(Surface::value))
-		throw std::runtime_error("Wrong terrain block size: " + std::to_string(a.size()));
-	if (b.size() != Block::CellsCount * sizeof(Surface::value))
-		throw std::runtime_error("Wrong merged terrain block size: " + std::to_string(b.size()));
-
-	auto va = reinterpret_cast<const Surface::value *>(a.data());
-	auto vb = reinterpret_cast<Surface::value *>(b.data());
-	return Block::Merge(va, vb);
+	Surface::value va[Block::CellsCount];
+	Surface::value vb[Block::CellsCount];
+	BlockData::Decode(a).copyTo(va);
+	BlockData::Decode(b).copyTo(vb);
+	bool changed = Block::Merge(va, vb);
+	b = convertData(BlockData(vb).encode(), format());
+	return changed;
 }
 
 bool Terrain::changeData(const Index &index, const binary &data) {
 	return replaceData(TerrainIndex(index).position(), data);
 }
 
+binary Terrain::convertData(const binary &data, Format format) {
+	// Leaves of full trees hold raw cells, like on legacy peers
+	const bool legacy = format == Format::Full;
+	if (BlockData::IsLegacy(data) == legacy)
+		return data;
+
+	BlockData block = BlockData::Decode(data);
+	return legacy ? block.encodeLegacy() : block.encode();
+}
+
 bool Terrain::propagateRoot(const binary &digest) {
-	std::cout << "Publishing terrain root " << pla::to_hex(digest) << std::endl;
+	const bool compressed = format() == Format::Compressed;
+	mStore->setReference(compressed ? "terrain-compressed" : "terrain", digest);
 
-	Message message(Message::TerrainRoot);
-	message.payload = digest;
-	mMessageBus->broadcast(message);
+	// Sent on next update, so a burst of edits or merges results in a single announcement
+	std::lock_guard<std::mutex> lock(mAnnounceMutex);
+	mAnnouncePending = true;
 	return true;
 }
 
 bool Terrain::propagateData(const int3 &pos, const binary &data) {
-	std::cout << "Sending terrain update for position " << pos.x << "," << pos.y << "," << pos.z
-	          << std::endl;
-	Message message(Message::TerrainUpdate);
 	BinaryFormatter formatter;
 	formatter << int32_t(pos.x);
 	formatter << int32_t(pos.y);
 	formatter << int32_t(pos.z);
+
+	bool hasLegacyPeers;
+	{
+		std::lock_guard<std::mutex> lock(mAnnounceMutex);
+		hasLegacyPeers = !mLegacyPeers.empty();
+	}
+
+	// Legacy peers only know updates with raw cells, which other peers also accept
+	if (hasLegacyPeers) {
+		std::cout << "Sending legacy terrain update for position " << pos.x << "," << pos.y
+		          << "," << pos.z << std::endl;
+		Message message(Message::TerrainUpdate);
+		formatter << BlockData::Decode(data).encodeLegacy();
+		message.payload = std::move(formatter.data());
+		mMessageBus->broadcast(message);
+		return true;
+	}
+
+	// Send changed cell runs against the previous version of the block when it is smaller
+	Cells cells;
+	if (auto base = readBase(pos, cells)) {
+		Surface::value values[Block::CellsCount];
+		BlockData::Decode(data).copyTo(values);
+
+		BinaryFormatter delta;
+		delta << *base << Store::Hash(data);
+		int i = 0;
+		while (i < Block::CellsCount) {
+			if (values[i] == cells[i]) {
+				++i;
+				continue;
+			}
+
+			// Extend the run over short gaps, which are cheaper than a run header
+			int last = i + 1;
+			for (int j = last; j < Block::CellsCount && j < last + 2; ++j)
+				if (values[j] != cells[j])
+					last = j + 1;
+
+			delta << uint16_t(i) << uint16_t(last - i);
+			for (int j = i; j < last; ++j)
+				delta << values[j].type << values[j].weight;
+
+			i = last;
+		}
+
+		if (delta.data().size() < data.size()) {
+			std::cout << "Sending terrain delta for position " << pos.x << "," << pos.y << ","
+			          << pos.z << std::endl;
+			Message message(Message::TerrainDelta);
+			formatter << delta.data();
+			message.payload = std::move(formatter.data());
+			mMessageBus->broadcast(message);
+			return true;
+		}
+	}
+
+	std::cout << "Sending terrain update for position " << pos.x << "," << pos.y << "," << pos.z
+	          << std::endl;
+	Message message(Message::TerrainUpdate);
 	formatter << data;
 	message.payload = std::move(formatter.data());
 	mMessageBus->broadcast(message);
 	return true;
 }
 
+bool Terrain::isInterested(const Index &index) const {
+	std::lock_guard<std::mutex> lock(mInterestMutex);
+	return mInterestAll || IsInterested(index, mInterestCenter, mInterestRadius);
+}
+
+bool Terrain::IsInterested(const Index &index, const vec3 &center, float radius) {
+	if (radius <= 0.f)
+		return true;
+
+	// The index fixes the most significant bits of the block coordinates, see TerrainIndex
+	const int64_t offset = 0x80000000;
+	int64_t x = 0, y = 0, z = 0;
+	for (int depth = 0; depth < index.length(); ++depth) {
+		const int n = index.at(depth);
+		x = (x << 2) | (n & 0x3);
+		y = (y << 2) | ((n >> 2) & 0x3);
+		z = (z << 2) | ((n >> 4) & 0x3);
+	}
+	const int shift = 2 * (Index::MaxLength - index.length());
+	const float size = float(int64_t(1) << shift) * float(Block::Size);
+	const vec3 lower = vec3(float((x << shift) - offset), float((y << shift) - offset),
+	                        float((z << shift) - offset)) *
+	                   float(Block::Size);
+	const vec3 nearest = glm::clamp(center, lower, lower + vec3(size));
+	return glm::distance(nearest, center) <= radius;
+}
+
+bool Terrain::requestSnapshot(const binary &digest, Format format, const identifier &source) {
+	{
+		std::lock_guard<std::mutex> lock(mSnapshotMutex);
+		if (mSnapshotRequest) {
+			if (mSnapshotRequest->root.digest != digest)
+				mSnapshotRequest->latest.emplace(RootAnnouncement{digest, format, source});
+			return true;
+		}
+
+		// Only worth it without a tree, otherwise most nodes are already known
+		if (root() || source.isNull())
+			return false;
+
+		mSnapshotRequest.emplace();
+		mSnapshotRequest->root = RootAnnouncement{digest, format, source};
+	}
+
+	vec3 center;
+	float radius;
+	{
+		std::lock_guard<std::mutex> lock(mInterestMutex);
+		center = mInterestCenter;
+		radius = mInterestRadius;
+	}
+
+	std::cout << "Requesting terrain snapshot " << pla::to_hex(digest) << std::endl;
+	BinaryFormatter formatter;
+	formatter << uint8_t(format) << digest;
+	formatter << float32_t(center.x) << float32_t(center.y) << float32_t(center.z);
+	formatter << float32_t(radius);
+
+	Message message(Message::TerrainSnapshotRequest);
+	message.destination = source;
+	message.payload = std::move(formatter.data());
+	mMessageBus->send(message);
+	return true;
+}
+
+void Terrain::startSnapshot(const Message &message) {
+	BinaryFormatter formatter(message.payload);
+	uint8_t format;
+	binary digest(16);
+	float32_t x, y, z, radius;
+	if (!(formatter >> format >> digest >> x >> y >> z >> radius) ||
+	    (format != uint8_t(Format::Full) && format != uint8_t(Format::Compressed)))
+		throw std::runtime_error("Invalid terrain snapshot request message");
+
+	std::cout << "Sending terrain snapshot " << pla::to_hex(digest) << std::endl;
+
+	// Only the subtrees the requester is interested in
+	const vec3 center(x, y, z);
+	auto filter = [center, radius](const Index &index) {
+		return IsInterested(index, center, radius);
+	};
+
+	SnapshotTransfer transfer;
+	transfer.root = digest;
+	transfer.format = Format(format);
+	transfer.walker = std::make_unique<Walker>(mStore, digest, Format(format), filter);
+
+	std::lock_guard<std::mutex> lock(mSnapshotMutex);
+	mSnapshotTransfers[message.source] = std::move(transfer);
+}
+
+void Terrain::receiveSnapshot(const Message &message) {
+	BinaryFormatter formatter(message.payload);
+	uint8_t format, flags;
+	binary digest(16);
+	if (!(formatter >> format >> digest >> flags))
+		throw std::runtime_error("Invalid terrain snapshot message");
+
+	{
+		std::lock_guard<std::mutex> lock(mSnapshotMutex);
+		if (!mSnapshotRequest || mSnapshotRequest->root.digest != digest ||
+		    mSnapshotRequest->root.source != message.source)
+			return;
+
+		mSnapshotRequest->elapsed = 0.;
+	}
+
+	uint32_t size;
+	while (formatter >> size) {
+		// Checked before allocating, the size comes from the network
+		if (size > formatter.remainingSize())
+			throw std::runtime_error("Invalid terrain snapshot message");
+
+		binary data(size);
+		formatter >> data;
+		mStore->insert(data);
+	}
+
+	if (flags & LastSnapshotChunk)
+		finishSnapshot();
+}
+
+void Terrain::finishSnapshot(void) {
+	optional<SnapshotRequest> request;
+	{
+		std::lock_guard<std::mutex> lock(mSnapshotMutex);
+		std::swap(request, mSnapshotRequest);
+	}
+	if (!request)
+		return;
+
+	// Children came first, so the tree resolves from the store at once
+	const auto &root = request->root;
+	updateRoot(root.digest, root.format, root.source);
+
+	if (const auto &latest = request->latest)
+		updateRoot(latest->digest, latest->format, latest->source);
+}
+
+void Terrain::sendSnapshots(void) {
+	std::lock_guard<std::mutex> lock(mSnapshotMutex);
+	auto it = mSnapshotTransfers.begin();
+	while (it != mSnapshotTransfers.end()) {
+		auto &[peer, transfer] = *it;
+
+		// Chunks are produced as the route drains, the transfer is paced by the scheduler
+		size_t sent = 0;
+		bool last = false;
+		while (!last && sent < SnapshotWindow && mMessageBus->queuedBytes(peer) < SnapshotWindow) {
+			BinaryFormatter entries;
+			while (entries.data().size() < SnapshotChunkSize) {
+				auto data = transfer.walker->next();
+				if (!data) {
+					last = true;
+					break;
+				}
+
+				entries << uint32_t(data->size());
+				entries << *data;
+			}
+
+			BinaryFormatter formatter;
+			formatter << uint8_t(transfer.format) << transfer.root;
+			formatter << uint8_t(last ? LastSnapshotChunk : 0);
+			formatter << entries.data();
+
+			Message message(Message::TerrainSnapshot);
+			message.destination = peer;
+			message.payload = std::move(formatter.data());
+			sent += message.payload.size();
+			mMessageBus->send(message);
+		}
+
+		it = last ? mSnapshotTransfers.erase(it) : std::next(it);
+	}
+}
+
+bool Terrain::applyDelta(const int3 &pos, const binary &base, const binary &target,
+                         BinaryFormatter &formatter) {
+	Cells cells;
+	if (readBase(pos, cells) != base)
+		return false;
+
+	uint16_t first, count;
+	while (formatter >> first >> count) {
+		if (first + count > Block::CellsCount)
+			throw std::runtime_error("Invalid terrain delta message");
+
+		for (int i = first; i < first + count; ++i)
+			if (!(formatter >> cells[i].type >> cells[i].weight))
+				throw std::runtime_error("Invalid terrain delta message");
+	}
+
+	binary data = BlockData(cells.data()).encode();
+	if (Store::Hash(data) != target)
+		return false;
+
+	updateData(TerrainIndex(pos), convertData(data, format()), true); // call changeData()
+	return true;
+}
+
+void Terrain::requestBlock(const int3 &pos, const binary &digest, const identifier &source) {
+	std::cout << "Requesting block at position " << pos.x << "," << pos.y << "," << pos.z
+	          << std::endl;
+	auto request = std::make_shared<BlockRequest>(this, pos);
+	{
+		std::lock_guard<std::mutex> lock(mBlockRequestsMutex);
+		mBlockRequests[pos] = request; // supersedes a previous request for the block
+	}
+	mStore->request(digest, request, source);
+}
+
+optional<binary> Terrain::readBase(const int3 &b, Cells &cells) const {
+	// Blocks missing from the tree have their generated cells, noted with a null digest
+	auto node = get(TerrainIndex(b));
+	if (!node) {
+		generateCells(b, cells);
+		return binary(16, byte(0));
+	}
+
+	auto data = node->data();
+	if (!data)
+		return nullopt;
+
+	cells.resize(Block::CellsCount);
+	BlockData::Decode(*data).copyTo(cells.data());
+	return node->digest();
+}
+
 void Terrain::populateBlock(shared_ptr<Block> block) {
+	Cells cells;
+	generateCells(block->position(), cells);
+	populateBlock(block, cells);
+}
+
+void Terrain::populateBlock(shared_ptr<Block> block, const Cells &cells) {
+	block->populate(cells.data());
+	if (mEvictedBlocks.erase(block->position()))
+		++mCacheStats.regenerations;
+
+	// TODO: push entities to world
+
+	// Neighbors might have been prepared while this block was still empty
+	const int3 b = block->position();
+	for (int dx = -1; dx <= 1; ++dx)
+		for (int dy = -1; dy <= 1; ++dy)
+			for (int dz = -1; dz <= 1; ++dz)
+				if (dx != 0 || dy != 0 || dz != 0)
+					markChangedBlock(int3(b.x + dx, b.y + dy, b.z + dz));
+}
+
+// Called from generation workers, must only depend on b
+void Terrain::generateCells(const int3 &b, Cells &cells) const {
 	static const auto Size = Block::Size;
 	const double tune = 0.5;
 	const double f1 = 0.1517;
 	const double f2 = 0.0269;
 	const double f3 = 0.0612;
 	const dvec3 offset(1000.);
+
+	// Sample noise fields for the block and one cell past it on both sides along z
+	const glm::ivec3 dims(Size, Size, Size + 2);
+	const dvec3 origin(b.x * Size, b.y * Size, b.z * Size - 1);
+	const dvec3 s1 = dvec3(1., 1., 0.1) * f1;
+	const dvec3 s2 = dvec3(1., 1., 4.0) * f2;
+	std::vector<float> noise1(dims.x * dims.y * dims.z);
+	std::vector<float> noise2(dims.x * dims.y * dims.z);
+	mNoise.generateGrid(origin * s1, s1, dims, 2, noise1.data());
+	mNoise.generateGrid(origin * s2 + offset, s2, dims, 1, noise2.data());
+
+	cells.assign(Block::CellsCount, Surface::value());
 	for (int x = 0; x < Size; ++x) {
 		for (int y = 0; y < Size; ++y) {
+			Surface::value *column = cells.data() + (x * Size + y) * Size;
+			const float *n1 = noise1.data() + (x * dims.y + y) * dims.z + 1;
+			const float *n2 = noise2.data() + (x * dims.y + y) * dims.z + 1;
 			bool inside = false;
-			for (int z = -1; z < Size; ++z) {
-				int3 pos = block->position();
-				const double ax = pos.x * Size + x;
-				const double ay = pos.y * Size + y;
-				const double az = pos.z * Size + z;
+			for (int z = -1; z <= Size; ++z) {
+				const double ax = b.x * Size + x;
+				const double ay = b.y * Size + y;
+				const double az = b.z * Size + z;
 				const double d2 = ax * ax + ay * ay + az * az;
-				const double n1 = mNoise.generate(dvec3(ax, ay, az * 0.1) * f1, 2);
-				const double n2 = mNoise.generate(dvec3(ax, ay, az * 4.0) * f2 + offset, 1);
-				const double noise = n1 * n1 + (n2 - (0.4 + tune * 0.1)) * 2. - 10. / d2;
+				const double noise = n1[z] * n1[z] + (n2[z] - (0.4 + tune * 0.1)) * 2. - 10. / d2;
 				uint8_t weight = uint8_t(pla::bounds(int(noise * 5000.), 0, 255));
 
-				if (z >= 0)
-					block->writeValue(int3(x, y, z), Surface::value(0, weight), false);
+				if (z >= 0 && z < Size)
+					column[z].weight = weight;
 
-				// Material 1 on top
+				// Material 1 on top, the cell below the surface may belong to the block under
 				if (weight != 0) {
 					inside = true;
 				} else if (inside) {
 					inside = false;
-					if (z >= 0) {
-						const double n3 = mNoise.generate(dvec3(ax, ay, az) * f3 + offset * 2., 1);
-						uint8_t type = n3 > 0.333 ? (n3 > 0.666 ? 2 : 1) : 0;
-						block->writeType(int3(x, y, z), type, false);
-						setType(int3(ax, ay, az - 1), type);
-					}
+					const double n3 = mNoise.generate(dvec3(ax, ay, az) * f3 + offset * 2., 1);
+					uint8_t type = n3 > 0.333 ? (n3 > 0.666 ? 2 : 1) : 0;
+					if (z >= 0 && z < Size)
+						column[z].type = type;
+					if (z >= 1)
+						column[z - 1].type = type;
 				}
 			}
 		}
 	}
+}
 
-	// TODO: push entities to world
+void Terrain::enqueueGeneration(const int3 &b) {
+	{
+		std::lock_guard<std::mutex> lock(mGenerationMutex);
+		mGenerationQueue.push_back(b);
+	}
+	mGenerationCondition.notify_one();
+}
 
-	block->markChanged();
+void Terrain::cancelGeneration(const int3 &b) {
+	std::lock_guard<std::mutex> lock(mGenerationMutex);
+	auto it = std::find(mGenerationQueue.begin(), mGenerationQueue.end(), b);
+	if (it != mGenerationQueue.end()) {
+		*it = mGenerationQueue.back();
+		mGenerationQueue.pop_back();
+	}
+}
+
+bool Terrain::popGeneration(int3 &b) {
+	if (mGenerationQueue.empty())
+		return false;
+
+	// Generate nearest blocks first
+	auto it = mGenerationQueue.end();
+	float nearest = std::numeric_limits<float>::infinity();
+	for (auto jt = mGenerationQueue.begin(); jt != mGenerationQueue.end(); ++jt) {
+		const vec3 center = (vec3(jt->x, jt->y, jt->z) + vec3(0.5f)) * float(Block::Size);
+		const float d2 = glm::length2(center - mFocus);
+		if (d2 < nearest) {
+			nearest = d2;
+			it = jt;
+		}
+	}
+	if (it == mGenerationQueue.end())
+		it = mGenerationQueue.begin();
+
+	b = *it;
+	*it = mGenerationQueue.back();
+	mGenerationQueue.pop_back();
+	return true;
+}
+
+void Terrain::runGeneration(void) {
+	std::unique_lock<std::mutex> lock(mGenerationMutex);
+	while (true) {
+		mGenerationCondition.wait(
+		    lock, [this]() { return mGenerationStopped || !mGenerationQueue.empty(); });
+		if (mGenerationStopped)
+			break;
+
+		int3 b;
+		popGeneration(b);
+		lock.unlock();
+		Cells cells;
+		generateCells(b, cells);
+		lock.lock();
+		mGenerated.emplace_back(b, std::move(cells));
+	}
+}
+
+void Terrain::finishGeneration(double time) {
+	std::vector<std::pair<int3, Cells>> generated;
+	{
+		std::lock_guard<std::mutex> lock(mGenerationMutex);
+		std::swap(generated, mGenerated);
+	}
+
+	if (mGenerationWorkers.empty()) {
+		// No workers, generate on the main thread within a time budget
+		using clock = std::chrono::steady_clock;
+		const auto deadline = clock::now() + std::chrono::milliseconds(4);
+		int3 b;
+		while (clock::now() < deadline) {
+			{
+				std::lock_guard<std::mutex> lock(mGenerationMutex);
+				if (!popGeneration(b))
+					break;
+			}
+			Cells cells;
+			generateCells(b, cells);
+			generated.emplace_back(b, std::move(cells));
+		}
+	}
+
+	for (const auto &[b, cells] : generated) {
+		// The block might have been populated synchronously or replaced in the meantime
+		if (auto it = mBlocks.find(b); it != mBlocks.end() && it->second->isPending())
+			populateBlock(it->second, cells);
+	}
+
+	mGeneratedCount += int(generated.size());
+	mGenerationTime += time;
+	if (mGenerationTime >= 1.) {
+		mGenerationRate = mGeneratedCount / mGenerationTime;
+		if (mGeneratedCount > 0) {
+			auto stats = generationStats();
+			std::cout << "Terrain generation: " << stats.blocksPerSecond << " blocks/s, "
+			          << stats.queued << " queued" << std::endl;
+		}
+		mGeneratedCount = 0;
+		mGenerationTime = 0.;
+	}
 }
 
 void Terrain::markChangedBlock(const int3 &b) {
@@ -239,6 +874,145 @@ void Terrain::markChangedBlock(const int3 &b) {
 		it->second->markChanged();
 }
 
+void Terrain::evictBlocks(void) {
+	size_t usage = 0;
+	for (const auto &[b, block] : mBlocks)
+		usage += block->memoryUsage();
+
+	if (usage > mMemoryBudget) {
+		// Only blocks unused since the last update are candidates, least recently used first.
+		// Blocks edited in an open transaction have their data only in mEditedData.
+		std::vector<sptr<Block>> candidates;
+		for (const auto &[b, block] : mBlocks)
+			if (block->lastUse() < mTick && !block->isModified() && !mEditedData.count(b))
+				candidates.push_back(block);
+
+		std::sort(candidates.begin(), candidates.end(),
+		          [](const sptr<Block> &a, const sptr<Block> &b) {
+			          return a->lastUse() < b->lastUse();
+		          });
+
+		// Leave some headroom so eviction does not happen on every check
+		const size_t target = mMemoryBudget - mMemoryBudget / 8;
+		const size_t evictions = mCacheStats.evictions;
+		const size_t meshEvictions = mCacheStats.meshEvictions;
+
+		// Release meshes first, they are rebuilt from the cells when needed
+		for (auto &block : candidates) {
+			if (usage <= target)
+				break;
+			if (size_t size = block->bufferSize(); size > 0) {
+				block->releaseMesh();
+				usage -= size;
+				++mCacheStats.meshEvictions;
+			}
+		}
+
+		// Then drop blocks, they are generated again or restored from the tree
+		for (auto &block : candidates) {
+			if (usage <= target)
+				break;
+			const int3 b = block->position();
+			if (block->isPending())
+				cancelGeneration(b);
+			usage -= block->memoryUsage();
+			mBlocks.erase(b);
+			mEvictedBlocks.insert(b);
+			++mCacheStats.evictions;
+		}
+
+		std::cout << "Terrain cache over budget, released "
+		          << mCacheStats.meshEvictions - meshEvictions << " meshes and evicted "
+		          << mCacheStats.evictions - evictions << " blocks" << std::endl;
+	}
+
+	mCacheStats.residentBlocks = mBlocks.size();
+	mCacheStats.residentBytes = usage;
+}
+
+void Terrain::announceRoot(void) {
+	bool hasLegacyPeers;
+	{
+		std::lock_guard<std::mutex> lock(mAnnounceMutex);
+		if (!mAnnouncePending || mAnnounceElapsed < mAnnounceInterval)
+			return;
+
+		mAnnouncePending = false;
+		mAnnounceElapsed = 0.;
+		hasLegacyPeers = !mLegacyPeers.empty();
+	}
+
+	const binary digest = rootDigest();
+	if (std::all_of(digest.begin(), digest.end(), [](byte b) { return b == byte(0); }))
+		return;
+
+	// Legacy peers get the same tree in the full format, empty until all leaves are present
+	const binary fullDigest = hasLegacyPeers ? rootDigest(Format::Full) : binary();
+
+	std::vector<std::pair<identifier, bool>> destinations;
+	{
+		std::lock_guard<std::mutex> lock(mAnnounceMutex);
+		for (auto &[id, root] : mPeerRoots) {
+			const bool legacy = mLegacyPeers.find(id) != mLegacyPeers.end();
+			const binary &announced = legacy ? fullDigest : digest;
+			if (!announced.empty() && root != announced) {
+				destinations.emplace_back(id, legacy);
+				root = announced;
+			}
+		}
+	}
+
+	if (destinations.empty())
+		return;
+
+	std::cout << "Publishing terrain root " << pla::to_hex(digest) << std::endl;
+
+	const bool compressed = format() == Format::Compressed;
+	for (const auto &[id, legacy] : destinations) {
+		Message message(compressed && !legacy ? Message::TerrainCompressedRoot
+		                                      : Message::TerrainRoot);
+		message.destination = id;
+		message.payload = legacy ? fullDigest : digest;
+		mMessageBus->send(message);
+	}
+}
+
+void Terrain::setPeerRoot(const identifier &id, const binary &digest) {
+	if (id.isNull())
+		return;
+
+	std::lock_guard<std::mutex> lock(mAnnounceMutex);
+	mPeerRoots[id] = digest;
+}
+
+void Terrain::setLegacyPeer(const identifier &id, bool legacy) {
+	if (id.isNull())
+		return;
+
+	bool hasLegacyPeers;
+	{
+		std::lock_guard<std::mutex> lock(mAnnounceMutex);
+		if (legacy)
+			mLegacyPeers.insert(id);
+		else
+			mLegacyPeers.erase(id);
+
+		hasLegacyPeers = !mLegacyPeers.empty();
+	}
+
+	// The full digest is only computed from all leaves, so the whole tree is replicated as long
+	// as legacy peers are around, whatever the interest radius
+	{
+		std::lock_guard<std::mutex> lock(mInterestMutex);
+		if (mInterestAll == hasLegacyPeers)
+			return;
+
+		mInterestAll = hasLegacyPeers;
+	}
+	if (hasLegacyPeers)
+		updateInterest();
+}
+
 bool Terrain::Block::Merge(const Surface::value *a, Surface::value *b) {
 	bool changed = false;
 	for (int c = 0; c < CellsCount; ++c) {
@@ -257,24 +1031,32 @@ Terrain::Block::Block(Terrain *terrain, const int3 &b)
 Terrain::Block::~Block(void) {}
 
 bool Terrain::Block::replace(const binary &data) {
-	if (data.size() != CellsCount * sizeof(Surface::value))
-		throw std::runtime_error("Wrong terrain block size: " + std::to_string(data.size()));
+	BlockData replacement = BlockData::Decode(data);
+	mPending = false;
 
-	auto cells = reinterpret_cast<const Surface::value *>(data.data());
 	bool changed = false;
 	for (int x = 0; x < Size; ++x)
 		for (int y = 0; y < Size; ++y)
-			for (int z = 0; z < Size; ++z)
-				changed |= writeValueImpl(int3(x, y, z), *(cells++), true);
+			for (int z = 0; z < Size; ++z) {
+				const int i = (x * Size + y) * Size + z;
+				if (mData.read(i) != replacement.read(i)) {
+					markChangedCell(int3(x, y, z));
+					changed = true;
+				}
+			}
+
+	mData = std::move(replacement);
+	mModified = false;
 	return changed;
 }
 
 bool Terrain::Block::merge(binary &data) {
-	if (data.size() != CellsCount * sizeof(Surface::value))
-		throw std::runtime_error("Wrong merged terrain block size: " + std::to_string(data.size()));
-
-	auto cells = reinterpret_cast<Surface::value *>(data.data());
-	if (Merge(mCells, cells)) {
+	Surface::value cells[CellsCount];
+	Surface::value merged[CellsCount];
+	mData.copyTo(cells);
+	BlockData::Decode(data).copyTo(merged);
+	if (Merge(cells, merged)) {
+		data = BlockData(merged).encode();
 		replace(data);
 		return true;
 	}
@@ -282,12 +1064,15 @@ bool Terrain::Block::merge(binary &data) {
 }
 
 void Terrain::Block::commit(void) {
-	auto data = reinterpret_cast<const byte *>(mCells);
-	auto size = CellsCount * sizeof(Surface::value);
-	mTerrain->commitData(position(), binary(data, data + size));
+	mModified = false;
+	mData.compact();
+	mTerrain->commitData(position(), mData.encode());
 }
 
 bool Terrain::Block::hasChanged(void) const {
+	if (mPending)
+		return false;
+
 	bool tmp = false;
 	std::swap(tmp, mChanged);
 	return tmp;
@@ -295,6 +1080,30 @@ bool Terrain::Block::hasChanged(void) const {
 
 void Terrain::Block::markChanged(void) { mChanged = true; }
 
+bool Terrain::Block::isPending(void) const { return mPending; }
+
+bool Terrain::Block::isModified(void) const { return mModified; }
+
+void Terrain::Block::populate(const Surface::value *cells) {
+	mData = BlockData(cells);
+	mPending = false;
+	mModified = false;
+	mChanged = true;
+}
+
+void Terrain::Block::touch(unsigned tick) { mLastUse = tick; }
+
+unsigned Terrain::Block::lastUse(void) const { return mLastUse; }
+
+size_t Terrain::Block::memoryUsage(void) const {
+	return sizeof(Block) + mData.memoryUsage() + bufferSize();
+}
+
+void Terrain::Block::releaseMesh(void) {
+	clear();
+	mChanged = true; // polygonize again when needed
+}
+
 Surface::value Terrain::Block::readValue(const int3 &c) const {
 	if (c.x >= 0 && c.y >= 0 && c.z >= 0 && c.x < Size && c.y < Size && c.z < Size)
 		return readValueImpl(c);
@@ -303,7 +1112,7 @@ Surface::value Terrain::Block::readValue(const int3 &c) const {
 }
 
 Surface::value Terrain::Block::readValueImpl(const int3 &c) const {
-	return mCells[(c.x * Size + c.y) * Size + c.z];
+	return mData.read((c.x * Size + c.y) * Size + c.z);
 }
 
 bool Terrain::Block::writeValue(const int3 &c, Surface::value v, bool markChanged) {
@@ -314,32 +1123,12 @@ bool Terrain::Block::writeValue(const int3 &c, Surface::value v, bool markChange
 }
 
 bool Terrain::Block::writeValueImpl(const int3 &c, Surface::value v, bool markChanged) {
-	auto &cell = mCells[(c.x * Size + c.y) * Size + c.z];
-	if (cell == v)
+	if (!mData.write((c.x * Size + c.y) * Size + c.z, v))
 		return false;
 
-	cell = v;
-	if (markChanged) {
-		mChanged = true;
-
-		// Mark neighboring blocks as changed
-		int3 pos = position();
-		for (int dx = -1; dx <= 1; ++dx) {
-			if ((c.x != 0 && dx == -1) || (c.x != Size - 1 && dx == 1))
-				continue;
-			for (int dy = -1; dy <= 1; ++dy) {
-				if ((c.y != 0 && dy == -1) || (c.y != Size - 1 && dy == 1))
-					continue;
-				for (int dz = -1; dz <= 1; ++dz) {
-					if ((c.z != 0 && dz == -1) || (c.z != Size - 1 && dz == 1))
-						continue;
-					if (dx == 0 && dy == 0 && dz == 0)
-						continue;
-					mTerrain->markChangedBlock(int3(pos.x + dx, pos.y + dy, pos.z + dz));
-				}
-			}
-		}
-	}
+	mModified = true;
+	if (markChanged)
+		markChangedCell(c);
 	return true;
 }
 
@@ -351,16 +1140,58 @@ bool Terrain::Block::writeType(const int3 &c, uint8_t t, bool markChanged) {
 }
 
 bool Terrain::Block::writeTypeImpl(const int3 &c, uint8_t t, bool markChanged) {
-	auto &cell = mCells[(c.x * Size + c.y) * Size + c.z];
-	if (cell.type == t)
+	const int i = (c.x * Size + c.y) * Size + c.z;
+	Surface::value v = mData.read(i);
+	v.type = t;
+	if (!mData.write(i, v))
 		return false;
 
-	cell.type = t;
+	mModified = true;
 	if (markChanged)
 		mChanged = true;
 	return true;
 }
 
+void Terrain::Block::markChangedCell(const int3 &c) {
+	mChanged = true;
+
+	// Mark neighboring blocks as changed
+	int3 pos = position();
+	for (int dx = -1; dx <= 1; ++dx) {
+		if ((c.x != 0 && dx == -1) || (c.x != Size - 1 && dx == 1))
+			continue;
+		for (int dy = -1; dy <= 1; ++dy) {
+			if ((c.y != 0 && dy == -1) || (c.y != Size - 1 && dy == 1))
+				continue;
+			for (int dz = -1; dz <= 1; ++dz) {
+				if ((c.z != 0 && dz == -1) || (c.z != Size - 1 && dz == 1))
+					continue;
+				if (dx == 0 && dy == 0 && dz == 0)
+					continue;
+				mTerrain->markChangedBlock(int3(pos.x + dx, pos.y + dy, pos.z + dz));
+			}
+		}
+	}
+}
+
+Terrain::BlockRequest::BlockRequest(Terrain *terrain, const int3 &pos)
+    : mTerrain(terrain), mPos(pos) {}
+
+void Terrain::BlockRequest::notify(const binary &digest, shared_ptr<binary> data,
+                                   shared_ptr<Store> store) {
+	{
+		std::lock_guard<std::mutex> lock(mTerrain->mBlockRequestsMutex);
+		auto it = mTerrain->mBlockRequests.find(mPos);
+		if (it == mTerrain->mBlockRequests.end() || it->second.get() != this)
+			return; // superseded
+
+		mTerrain->mBlockRequests.erase(it);
+	}
+
+	if (data)
+		mTerrain->updateData(TerrainIndex(mPos), *data, true); // call changeData()
+}
+
 Terrain::TerrainIndex::TerrainIndex(const Index &index) : Index(index) {}
 
 Terrain::TerrainIndex::TerrainIndex(int3 pos) {
@@ -376,7 +1207,7 @@ Terrain::TerrainIndex::TerrainIndex(int3 pos) {
 		x >>= 2;
 		y >>= 2;
 		z >>= 2;
-		mValues.push_back(n);
+		push(n);
 	}
 }
 
@@ -386,16 +1217,15 @@ int3 Terrain::TerrainIndex::position(void) const {
 	unsigned x = 0;
 	unsigned y = 0;
 	unsigned z = 0;
-	std::vector<int> values(mValues);
-	while (values.size() > 0) {
-		int n = values.back();
+	Index index(*this);
+	while (index.length() > 0) {
+		int n = index.pop();
 		x <<= 2;
 		y <<= 2;
 		z <<= 2;
 		x |= n & 0x3;
 		y |= (n >> 2) & 0x3;
 		z |= (n >> 4) & 0x3;
-		values.pop_back();
 	}
 	const unsigned offset = 0x80000000;
 	return int3(int(x) - offset, int(y) - offset, int(z) - offset);
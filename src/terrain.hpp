@@ -21,32 +21,75 @@
 #ifndef CONVERGENCE_TERRAIN_H
 #define CONVERGENCE_TERRAIN_H
 
+#include "blockdata.hpp"
 #include "include.hpp"
 #include "merkle.hpp"
 #include "messagebus.hpp"
 #include "store.hpp"
 #include "surface.hpp"
 
-#include "pla/context.hpp"
+#include "pla/binaryformatter.hpp"
 #include "pla/perlinnoise.hpp"
 
+#ifndef HEADLESS
+#include "pla/context.hpp"
+#endif
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
 namespace convergence {
 
+using pla::BinaryFormatter;
 using pla::PerlinNoise;
 
 class Terrain : public Merkle, public MessageBus::Listener, public Collidable {
 public:
+	struct GenerationStats {
+		size_t queued;          // blocks waiting for generation
+		double blocksPerSecond; // generated blocks per second
+	};
+
+	struct CacheStats {
+		size_t residentBlocks;
+		size_t residentBytes;
+		size_t evictions;     // blocks dropped from memory
+		size_t meshEvictions; // meshes released while keeping cells
+		size_t regenerations; // evicted blocks populated from the seed again
+		size_t reloads;       // modified blocks restored from the tree
+	};
+
 	Terrain(shared_ptr<MessageBus> messageBus, shared_ptr<Store> store, int seed);
 	virtual ~Terrain(void);
 
 	void update(double time);
+	void setFocus(const vec3 &position);
+	void setInterestRadius(float radius); // only replicate the tree around the focus, 0 for all
+	GenerationStats generationStats(void) const;
+
+	void setMemoryBudget(size_t bytes);
+	CacheStats cacheStats(void) const;
+#ifndef HEADLESS
 	int draw(const Context &context);
+#endif
 	float intersect(const vec3 &pos, const vec3 &move, float radius, vec3 *intersection = NULL);
 
 	void dig(const vec3 &p, int weight, float radius);
 
+	// Blocks committed until the matching commitEdit() form a single tree update
+	void beginEdit(void);
+	void commitEdit(void);
+
 	void broadcast();
 
+	// Root changes are announced at most once per interval, with the latest root
+	void setAnnounceInterval(double seconds);
+
 protected:
 	class TerrainIndex : public Index {
 	public:
@@ -57,6 +100,7 @@ protected:
 		int3 position(void) const;
 	};
 
+	void onPeer(const identifier &id);
 	void onMessage(const Message &message);
 
 	bool replaceData(const int3 &pos, const binary &data);
@@ -65,9 +109,23 @@ protected:
 
 	bool merge(const binary &a, binary &b);
 	bool changeData(const Index &index, const binary &data);
+	binary convertData(const binary &data, Format format);
 
 	bool propagateRoot(const binary &digest);
 	bool propagateData(const int3 &pos, const binary &data);
+	bool isInterested(const Index &index) const;
+	static bool IsInterested(const Index &index, const vec3 &center, float radius);
+
+	// A peer joining with an empty tree gets whole subtrees streamed instead of walking them
+	bool requestSnapshot(const binary &digest, Format format, const identifier &source);
+	void startSnapshot(const Message &message);
+	void receiveSnapshot(const Message &message);
+	void finishSnapshot(void);
+	void sendSnapshots(void);
+
+	bool applyDelta(const int3 &pos, const binary &base, const binary &target,
+	                BinaryFormatter &formatter);
+	void requestBlock(const int3 &pos, const binary &digest, const identifier &source);
 
 private:
 	class Block : public Surface::Block {
@@ -84,6 +142,15 @@ private:
 		bool hasChanged(void) const;
 		void markChanged(void);
 
+		bool isPending(void) const;
+		bool isModified(void) const;
+		void populate(const Surface::value *cells);
+
+		void touch(unsigned tick);
+		unsigned lastUse(void) const;
+		size_t memoryUsage(void) const;
+		void releaseMesh(void);
+
 		Surface::value readValue(const int3 &c) const;
 		bool writeValue(const int3 &c, Surface::value v, bool markChanged = true);
 		bool writeType(const int3 &c, uint8_t t, bool markChanged = true);
@@ -92,24 +159,113 @@ private:
 		Surface::value readValueImpl(const int3 &c) const;
 		bool writeValueImpl(const int3 &c, Surface::value v, bool markChanged);
 		bool writeTypeImpl(const int3 &c, uint8_t t, bool markChanged);
+		void markChangedCell(const int3 &c);
 
 		Terrain *mTerrain;
-		Surface::value mCells[CellsCount] = {};
+		BlockData mData;
 
 		mutable bool mChanged = true;
+		bool mPending = true;
+		bool mModified = false; // written since last commit
+		unsigned mLastUse = 0;
 	};
 
+	// Fetches a whole block when a delta can't be applied
+	class BlockRequest : public Store::Notifiable {
+	public:
+		BlockRequest(Terrain *terrain, const int3 &pos);
+
+		void notify(const binary &digest, shared_ptr<binary> data, shared_ptr<Store> store);
+
+	private:
+		Terrain *mTerrain;
+		int3 mPos;
+	};
+
+	using Cells = std::vector<Surface::value>;
+
 	shared_ptr<Block> getBlock(const int3 &b);
+	shared_ptr<Block> getPopulatedBlock(const int3 &b);
 	Surface::value getValue(const int3 &p);
 	bool setValue(const int3 &p, Surface::value v);
 	bool setType(const int3 &p, uint8_t t);
 
 	void populateBlock(shared_ptr<Block> block);
+	void populateBlock(shared_ptr<Block> block, const Cells &cells);
+	void generateCells(const int3 &b, Cells &cells) const;
+	optional<binary> readBase(const int3 &b, Cells &cells) const;
 	void markChangedBlock(const int3 &b);
+	void evictBlocks(void);
+	void announceRoot(void);
+	void setPeerRoot(const identifier &id, const binary &digest);
+	void setLegacyPeer(const identifier &id, bool legacy);
+
+	void enqueueGeneration(const int3 &b);
+	void cancelGeneration(const int3 &b);
+	bool popGeneration(int3 &b); // requires mGenerationMutex
+	void runGeneration(void);
+	void finishGeneration(double time);
 
 	std::unordered_map<int3, shared_ptr<Block>, int3::hash> mBlocks;
+	std::unordered_map<int3, binary, int3::hash> mEditedData;
+	std::unordered_set<int3, int3::hash> mEvictedBlocks;
+	std::unordered_map<int3, shared_ptr<BlockRequest>, int3::hash> mBlockRequests;
+	std::mutex mBlockRequestsMutex;
+	int mEditDepth = 0;
+	size_t mMemoryBudget = 256 * 1024 * 1024;
+	CacheStats mCacheStats = {};
+	double mEvictionTime = 0.;
+	unsigned mTick = 0;
+
+	std::vector<int3> mGenerationQueue;
+	std::vector<std::pair<int3, Cells>> mGenerated;
+	std::vector<std::thread> mGenerationWorkers;
+	mutable std::mutex mGenerationMutex;
+	std::condition_variable mGenerationCondition;
+	vec3 mFocus = vec3(0.f);
+	bool mGenerationStopped = false;
+
+	vec3 mInterestCenter = vec3(0.f);
+	int3 mInterestBlock = int3(0);
+	float mInterestRadius = 0.f;
+	bool mInterestAll = false; // while legacy peers are known
+	mutable std::mutex mInterestMutex;
+
+	struct RootAnnouncement {
+		binary digest;
+		Format format;
+		identifier source;
+	};
+
+	struct SnapshotRequest {
+		RootAnnouncement root;
+		optional<RootAnnouncement> latest; // announced meanwhile, applied afterwards
+		double elapsed = 0.;               // since the last chunk
+	};
+
+	struct SnapshotTransfer {
+		binary root;
+		Format format;
+		uptr<Walker> walker;
+	};
+
+	optional<SnapshotRequest> mSnapshotRequest;
+	std::map<identifier, SnapshotTransfer> mSnapshotTransfers;
+	std::mutex mSnapshotMutex;
+
+	std::map<identifier, binary> mPeerRoots; // last root advertised by or sent to each peer
+	std::set<identifier> mLegacyPeers;       // peers without the compressed format
+	std::mutex mAnnounceMutex;
+	double mAnnounceInterval = 0.5;
+	double mAnnounceElapsed = 0.5;
+	bool mAnnouncePending = false;
+
+	int mGeneratedCount = 0;
+	double mGenerationTime = 0.;
+	double mGenerationRate = 0.;
 
 	shared_ptr<MessageBus> mMessageBus;
+	shared_ptr<Store> mStore;
 	PerlinNoise mNoise;
 	Surface mSurface;
 };
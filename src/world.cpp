@@ -27,20 +27,36 @@ namespace convergence {
 
 using pla::to_hex;
 
-World::World(sptr<MessageBus> messageBus) : mMessageBus(messageBus) {
-	mStore = std::make_shared<Store>(mMessageBus);
+const double SnapshotPeriod = 0.05; // network tick
+
+World::World(sptr<MessageBus> messageBus, uptr<Store::Backend> storeBackend)
+    : mMessageBus(messageBus) {
+	mStore = std::make_shared<Store>(mMessageBus, std::move(storeBackend));
+	mSnapshots = std::make_unique<Snapshots>(mMessageBus);
 	mMessageBus->registerTypeListener(Message::Store, mStore);
 	mMessageBus->registerTypeListener(Message::Request, mStore);
+	mMessageBus->registerTypeListener(Message::StoreBatch, mStore);
+	mMessageBus->registerTypeListener(Message::RequestBatch, mStore);
 
 	unsigned seed = 130;
 	mTerrain = std::make_shared<Terrain>(mMessageBus, mStore, seed);
 	mMessageBus->registerTypeListener(Message::TerrainRoot, mTerrain);
 	mMessageBus->registerTypeListener(Message::TerrainUpdate, mTerrain);
+	mMessageBus->registerTypeListener(Message::TerrainCompressedRoot, mTerrain);
+	mMessageBus->registerTypeListener(Message::TerrainDelta, mTerrain);
+	mMessageBus->registerTypeListener(Message::TerrainSnapshotRequest, mTerrain);
+	mMessageBus->registerTypeListener(Message::TerrainSnapshot, mTerrain);
 
+#ifndef HEADLESS
+	// A headless peer only holds the world, it is not a player
 	mLocalPlayer = std::make_shared<LocalPlayer>(mMessageBus);
 	mMessageBus->registerListener(mLocalPlayer->id(), mLocalPlayer);
 	mPlayers[mLocalPlayer->id()] = mLocalPlayer;
 
+	// Clients only replicate the terrain within this radius, headless peers hold all of it
+	mTerrain->setInterestRadius(512.f);
+#endif
+
 	mEntities[identifier()] = std::make_shared<Firefly>(mMessageBus, identifier());
 
 	// Factory factory("pickaxe", 1.f / 32.f, program);
@@ -69,6 +85,9 @@ sptr<Entity> World::createEntity(identifier id, Entity::Init init) {
 }
 
 void World::localPick() {
+	if (!mLocalPlayer)
+		return;
+
 	vec3 position = mLocalPlayer->getPosition();
 	std::multimap<float, shared_ptr<Entity>> ordered;
 	for (const auto &[id, entity] : mEntities) {
@@ -85,19 +104,15 @@ void World::localPick() {
 	}
 }
 
-void World::collect(Light::Collection &lights) {
-	for (auto &[id, player] : mPlayers)
-		player->collect(lights);
-
-	for (auto &[id, entity] : mEntities)
-		entity->collect(lights);
-}
-
 void World::update(double time) {
-	Message message;
-	while (readMessage(message))
+	mInbox.clear();
+	readMessages(mInbox);
+	for (const auto &message : mInbox)
 		processMessage(message);
 
+	if (mLocalPlayer)
+		mTerrain->setFocus(mLocalPlayer->getPosition());
+
 	mTerrain->update(time);
 
 	for (auto &[id, player] : mPlayers)
@@ -105,6 +120,26 @@ void World::update(double time) {
 
 	for (auto &[id, entity] : mEntities)
 		entity->update(mTerrain, time);
+
+	mSnapshotTime += time;
+	if (mSnapshotTime >= SnapshotPeriod) {
+		mSnapshotTime = 0.;
+		sendSnapshots();
+	}
+
+	// Send the requests of this tick
+	mStore->update(time);
+
+	mMessageBus->update(time);
+}
+
+#ifndef HEADLESS
+void World::collect(Light::Collection &lights) {
+	for (auto &[id, player] : mPlayers)
+		player->collect(lights);
+
+	for (auto &[id, entity] : mEntities)
+		entity->collect(lights);
 }
 
 int World::draw(Context &context) {
@@ -120,8 +155,14 @@ int World::draw(Context &context) {
 
 	return count;
 }
+#endif
 
 void World::processMessage(const Message &message) {
+	if (message.type == Message::EntitySnapshot) {
+		processSnapshot(message);
+		return;
+	}
+
 	if (!message.source.isNull()) {
 		const identifier &id = message.source;
 		if (mPlayers.find(id) == mPlayers.end()) {
@@ -134,4 +175,33 @@ void World::processMessage(const Message &message) {
 	}
 }
 
+void World::processSnapshot(const Message &message) {
+	auto states = mSnapshots->receive(message);
+	if (!states)
+		return;
+
+	for (const auto &[id, state] : *states) {
+		if (id == message.source) {
+			auto it = mPlayers.find(id);
+			if (it == mPlayers.end()) {
+				// Peers without a player only send acknowledgements
+				std::cout << "New player: " << to_hex(id) << std::endl;
+				it = mPlayers.emplace(id, createPlayer(id, {})).first;
+				mTerrain->broadcast();
+			}
+			it->second->setState(state);
+		} else if (auto it = mEntities.find(id); it != mEntities.end()) {
+			it->second->setState(state);
+		}
+	}
+}
+
+void World::sendSnapshots(void) {
+	Snapshots::States states;
+	if (mLocalPlayer)
+		states[mLocalPlayer->id()] = mLocalPlayer->getState();
+
+	mSnapshots->send(states, mMessageBus->peers());
+}
+
 } // namespace convergence
@@ -22,26 +22,32 @@
 #define CONVERGENCE_WORLD_H
 
 #include "src/include.hpp"
-#include "src/light.hpp"
 #include "src/localplayer.hpp"
 #include "src/messagebus.hpp"
 #include "src/player.hpp"
+#include "src/snapshot.hpp"
 #include "src/store.hpp"
 #include "src/terrain.hpp"
 
+#ifndef HEADLESS
+#include "src/light.hpp"
+
 #include "pla/context.hpp"
 #include "pla/object.hpp"
+#endif
 
 #include <map>
 
 namespace convergence {
 
+#ifndef HEADLESS
 using pla::Context;
 using pla::Object;
+#endif
 
 class World final : public MessageBus::AsyncListener {
 public:
-	World(shared_ptr<MessageBus> messageBus);
+	World(shared_ptr<MessageBus> messageBus, uptr<Store::Backend> storeBackend = nullptr);
 	~World();
 
 	sptr<Terrain> terrain() const;
@@ -52,16 +58,23 @@ public:
 
 	void localPick();
 
-	void collect(Light::Collection &lights);
 	void update(double time);
+#ifndef HEADLESS
+	void collect(Light::Collection &lights);
 	int draw(Context &context);
+#endif
 
 private:
 	void processMessage(const Message &message);
+	void processSnapshot(const Message &message);
+	void sendSnapshots(void);
 
 	sptr<MessageBus> mMessageBus;
+	std::vector<Message> mInbox;
 	sptr<Store> mStore;
 	sptr<Terrain> mTerrain;
+	uptr<Snapshots> mSnapshots;
+	double mSnapshotTime = 0.;
 	sptr<LocalPlayer> mLocalPlayer;
 	std::map<identifier, sptr<Player>> mPlayers;
 	std::map<identifier, sptr<Entity>> mEntities; // Non-player entities
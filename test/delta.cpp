@@ -0,0 +1,113 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+// Delta benchmark: replays a scripted tunnelling session on a peer and measures the terrain
+// updates received by another peer, against the full blocks they would otherwise carry.
+// Usage: convergence-bench-delta [digs]
+
+#include "test/simulation.hpp"
+
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace convergence;
+
+namespace {
+
+const double Tick = 0.02; // seconds per update, like the network tick
+
+// Counts the terrain updates received, and keeps the digests of the blocks sent as deltas
+class UpdateCounter final : public MessageBus::Listener {
+public:
+	void onMessage(const Message &message) {
+		bytes += message.payload.size();
+		if (message.type == Message::TerrainDelta) {
+			++deltas;
+			const size_t offset = 12 + 16; // position and base digest
+			if (message.payload.size() >= offset + 16)
+				targets.emplace_back(message.payload.begin() + offset,
+				                     message.payload.begin() + offset + 16);
+		} else {
+			++updates;
+			fullBytes += message.payload.size();
+		}
+	}
+
+	size_t updates = 0;
+	size_t deltas = 0;
+	size_t bytes = 0;
+	size_t fullBytes = 0; // of plain updates
+	std::vector<binary> targets;
+};
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+	const int digs = argc > 1 ? std::stoi(argv[1]) : 400;
+
+	std::ostream out(std::cout.rdbuf(nullptr)); // peers log to std::cout
+
+	Simulation simulation;
+	Simulation::Peer source, receiver;
+	auto counter = std::make_shared<UpdateCounter>();
+	receiver.bus->registerTypeListener(Message::TerrainUpdate, counter);
+	receiver.bus->registerTypeListener(Message::TerrainDelta, counter);
+	auto channels = simulation.connect(*source.bus, *receiver.bus, Simulation::LinkParams());
+
+	double time = 0.;
+	auto step = [&]() {
+		time += Tick;
+		simulation.run(time);
+		source.update(Tick);
+		receiver.update(Tick);
+	};
+
+	// Wandering tunnel underground, with a dig at every step
+	std::mt19937 random(4);
+	vec3 position(20.f, 20.f, -6.f), direction(1.f, 0.f, 0.f);
+	for (int i = 0; i < digs; ++i) {
+		if (i % 25 == 0)
+			direction = vec3(float(int(random() % 3) - 1), float(int(random() % 3) - 1), 0.f) +
+			            vec3(0.5f, 0.f, 0.f);
+		position += direction * 0.4f;
+		source.terrain->dig(position, 40 + random() % 60, 1.5f + (random() % 100) / 100.f);
+		step();
+	}
+	for (int i = 0; i < 50; ++i)
+		step();
+
+	if (source.terrain->rootDigest() != receiver.terrain->rootDigest()) {
+		out << "Roots differ after the session" << std::endl;
+		return 1;
+	}
+
+	// A plain update carries the position and the whole block
+	size_t fullBytes = counter->fullBytes;
+	for (const auto &digest : counter->targets)
+		if (auto data = receiver.store->retrieve(digest))
+			fullBytes += 12 + data->size();
+
+	out << digs << " digs: " << counter->deltas << " deltas and " << counter->updates
+	    << " full updates, " << double(counter->bytes) / digs << " bytes/dig, "
+	    << double(fullBytes) / digs << " bytes/dig with full updates only, "
+	    << channels.first->bytes() << " bytes sent in total" << std::endl;
+	return 0;
+}
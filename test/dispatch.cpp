@@ -0,0 +1,91 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+// Dispatch benchmark: messages per second delivered to the listeners of one bus by 1, 4 and 16
+// concurrent sender threads, like the network threads of as many peerings. The listeners have the
+// shape of a world: a few type listeners and one listener per remote entity. Contention only
+// shows with at least as many cores as threads.
+// Usage: convergence-bench-dispatch [dispatches]
+
+#include "src/messagebus.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+using namespace convergence;
+
+namespace {
+
+class Counter final : public MessageBus::Listener {
+public:
+	void onMessage(const Message &message) { count.fetch_add(1, std::memory_order_relaxed); }
+
+	std::atomic<size_t> count = 0;
+};
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+	const int dispatches = argc > 1 ? std::stoi(argv[1]) : 400000;
+
+	std::ostream out(std::cout.rdbuf(nullptr)); // the bus logs to std::cout
+
+	auto bus = std::make_shared<MessageBus>();
+	std::vector<sptr<Counter>> counters;
+	const Message::Type types[] = {Message::Store, Message::Request, Message::StoreBatch,
+	                               Message::TerrainRoot};
+	for (auto type : types) {
+		counters.push_back(std::make_shared<Counter>());
+		bus->registerTypeListener(type, counters.back());
+	}
+	for (int i = 0; i < 16; ++i) {
+		counters.push_back(std::make_shared<Counter>());
+		bus->registerListener(identifier(binary(16, byte(i + 1))), counters.back());
+	}
+
+	out << std::thread::hardware_concurrency() << " hardware threads" << std::endl;
+	for (int threads : {1, 4, 16}) {
+		const int count = dispatches / threads;
+		const auto start = std::chrono::steady_clock::now();
+
+		// Messages addressed to the local peer are dispatched right away on the sending thread
+		std::vector<std::thread> senders;
+		for (int t = 0; t < threads; ++t)
+			senders.emplace_back([&bus, count]() {
+				Message message(Message::Store);
+				message.destination = bus->localId();
+				message.payload.resize(32);
+				for (int i = 0; i < count; ++i)
+					bus->send(message);
+			});
+
+		for (auto &sender : senders)
+			sender.join();
+
+		const double wall =
+		    std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		out << threads << " threads: " << double(count) * threads / wall / 1e6
+		    << " M dispatches/s" << std::endl;
+	}
+
+	return 0;
+}
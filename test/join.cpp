@@ -0,0 +1,118 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+// Join benchmark: time for a peer with an empty tree to resolve the root of a world with modified
+// blocks, over a 20 Mbit/s link with a 20 ms one-way delay. Blocks are not materialized, only the
+// tree is replicated.
+// Usage: convergence-bench-join [blocks...]
+
+#include "test/simulation.hpp"
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace convergence;
+
+namespace {
+
+const double Tick = 0.01;        // seconds per update
+const double MaxDuration = 120.; // simulated seconds
+const size_t LeafSize = 256;
+
+class Tree final : public Terrain {
+public:
+	Tree(sptr<MessageBus> messageBus, sptr<Store> store) : Terrain(messageBus, store, 130) {}
+
+	void fill(int count) {
+		// Random leaves don't compress, like the worst case of modified blocks
+		std::mt19937 random(count);
+		std::vector<std::pair<Index, binary>> updates;
+		for (int i = 0; i < count; ++i) {
+			binary data(LeafSize);
+			for (auto &b : data)
+				b = byte(random());
+			const int3 pos(i % 64, (i / 64) % 64, i / 4096);
+			updates.emplace_back(TerrainIndex(pos), std::move(data));
+		}
+		updateData(std::move(updates));
+	}
+
+private:
+	bool changeData(const Index &index, const binary &data) { return true; }
+};
+
+Simulation::Peer::TerrainFactory makeTree = [](sptr<MessageBus> messageBus, sptr<Store> store) {
+	return std::make_shared<Tree>(messageBus, store);
+};
+
+bool isResolved(const Terrain &terrain, const binary &digest) {
+	auto root = terrain.root();
+	return root && root->digest() == digest && root->isResolved();
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+	std::vector<int> counts;
+	for (int i = 1; i < argc; ++i)
+		counts.push_back(std::stoi(argv[i]));
+	if (counts.empty())
+		counts = {1000, 10000, 100000};
+
+	std::ostream out(std::cout.rdbuf(nullptr)); // peers log to std::cout
+
+	for (int count : counts) {
+		Simulation simulation;
+		Simulation::LinkParams params;
+		params.delay = 0.02;         // one-way
+		params.bandwidth = 20e6 / 8; // 20 Mbit/s
+
+		Simulation::Peer source(makeTree), joiner(makeTree);
+		std::static_pointer_cast<Tree>(source.terrain)->fill(count);
+		const binary target = source.terrain->rootDigest();
+
+		auto channels = simulation.connect(*source.bus, *joiner.bus, params);
+		const auto start = std::chrono::steady_clock::now();
+		double time = 0.;
+		while (!isResolved(*joiner.terrain, target) && time < MaxDuration) {
+			time += Tick;
+			simulation.run(time);
+			source.update(Tick);
+			joiner.update(Tick);
+		}
+		const double wall =
+		    std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		if (!isResolved(*joiner.terrain, target)) {
+			out << count << " blocks: the root did not resolve" << std::endl;
+			return 1;
+		}
+
+		const auto stats = joiner.store->stats();
+		out << count << " blocks: resolved after " << time << " s simulated (" << wall
+		    << " s wall), " << channels.first->bytes() << " bytes received, "
+		    << channels.second->bytes() << " bytes sent, " << stats.requests << " requests, "
+		    << stats.retries << " retries" << std::endl;
+	}
+
+	return 0;
+}
@@ -0,0 +1,176 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+// Latency benchmark: two real peerings over loopback, with entity updates on the unreliable
+// channel next to bulk store-like traffic on the reliable one. Loss and delay are injected on the
+// loopback interface, for instance:
+//   tc qdisc add dev lo root netem delay 30ms loss 1%
+// Usage: convergence-bench-latency [duration in seconds]
+
+#include "src/peering.hpp"
+#include "test/simulation.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace convergence;
+
+using clock_type = std::chrono::steady_clock;
+
+namespace {
+
+const double EntityInterval = 0.05; // network tick
+const size_t EntitySize = 96;
+const double BulkInterval = 0.1;
+const size_t BulkSize = 16 * 1024;
+const double ConnectTimeout = 30.;
+
+// Records the one-way latency of timestamped messages of a type
+class LatencyRecorder final : public MessageBus::Listener {
+public:
+	void onMessage(const Message &message) {
+		int64_t sent;
+		if (message.payload.size() < sizeof(sent))
+			return;
+
+		std::memcpy(&sent, message.payload.data(), sizeof(sent));
+		const auto now = clock_type::now().time_since_epoch();
+		std::lock_guard<std::mutex> lock(mMutex);
+		mLatencies.push_back(
+		    std::chrono::duration<double>(now - clock_type::duration(sent)).count());
+	}
+
+	void report(std::ostream &out, const string &name, size_t sent) {
+		std::lock_guard<std::mutex> lock(mMutex);
+		std::sort(mLatencies.begin(), mLatencies.end());
+		auto percentile = [&](double p) {
+			return mLatencies.empty() ? 0.
+			                          : mLatencies[size_t(p * (mLatencies.size() - 1))] * 1000.;
+		};
+		const size_t received = mLatencies.size();
+		out << name << ": " << received << " of " << sent << " received ("
+		    << (sent ? 100. * (sent - std::min(received, sent)) / sent : 0.) << "% lost), p50 "
+		    << percentile(0.5) << " ms, p95 " << percentile(0.95) << " ms, p99 "
+		    << percentile(0.99) << " ms, max " << percentile(1.) << " ms" << std::endl;
+	}
+
+private:
+	std::vector<double> mLatencies;
+	std::mutex mMutex;
+};
+
+void sendTimestamped(MessageBus &bus, Message::Type type, const identifier &destination,
+                     size_t size) {
+	Message message(type);
+	message.destination = destination;
+	message.payload.resize(size);
+	const int64_t now = clock_type::now().time_since_epoch().count();
+	std::memcpy(message.payload.data(), &now, sizeof(now));
+	bus.send(message);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+	const double duration = argc > 1 ? std::stod(argv[1]) : 60.;
+
+	std::ostream out(std::cout.rdbuf(nullptr)); // peerings log to std::cout
+
+	auto a = std::make_shared<MessageBus>();
+	auto b = std::make_shared<MessageBus>();
+
+	// In-process stand-in for the signaling server, unknown destinations go through it
+	Simulation signaling;
+	Simulation::LinkParams params;
+	params.delay = 0.;
+	auto channels = signaling.link(params);
+	a->addChannel(channels.first, MessageBus::Priority::Default);
+	b->addChannel(channels.second, MessageBus::Priority::Default);
+
+	auto peeringA = std::make_shared<Peering>(b->localId(), a);
+	auto peeringB = std::make_shared<Peering>(a->localId(), b);
+	a->registerListener(b->localId(), peeringA);
+	b->registerListener(a->localId(), peeringB);
+
+	auto entities = std::make_shared<LatencyRecorder>();
+	auto bulk = std::make_shared<LatencyRecorder>();
+	b->registerTypeListener(Message::EntityControl, entities); // latest-wins, unreliable
+	b->registerTypeListener(Message::Dummy, bulk);
+
+	const auto start = clock_type::now();
+	auto elapsed = [&start]() {
+		return std::chrono::duration<double>(clock_type::now() - start).count();
+	};
+	double last = 0.;
+	auto step = [&]() {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		const double now = elapsed();
+		signaling.run(now);
+		a->update(now - last);
+		b->update(now - last);
+		last = now;
+	};
+
+	peeringA->connect();
+	while (!(peeringA->isConnected() && peeringB->isConnected()) && elapsed() < ConnectTimeout)
+		step();
+
+	if (!(peeringA->isConnected() && peeringB->isConnected())) {
+		out << "Peerings did not connect" << std::endl;
+		return 1;
+	}
+
+	// Let the entity channel open too
+	const double settle = elapsed() + 1.;
+	while (elapsed() < settle)
+		step();
+
+	const double begin = elapsed();
+	size_t entitiesSent = 0, bulkSent = 0;
+	while (elapsed() - begin < duration) {
+		const double t = elapsed() - begin;
+		while (entitiesSent * EntityInterval <= t) {
+			sendTimestamped(*a, Message::EntityControl, b->localId(), EntitySize);
+			++entitiesSent;
+		}
+		while (bulkSent * BulkInterval <= t) {
+			sendTimestamped(*a, Message::Dummy, b->localId(), BulkSize);
+			++bulkSent;
+		}
+		step();
+	}
+
+	// Messages in flight
+	const double end = elapsed() + 2.;
+	while (elapsed() < end)
+		step();
+
+	entities->report(out, "entities", entitiesSent);
+	bulk->report(out, "bulk", bulkSent);
+
+	peeringA->disconnect();
+	peeringB->disconnect();
+	return 0;
+}
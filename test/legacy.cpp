@@ -0,0 +1,124 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+// Legacy interop test: a peer only running the full tree format and raw block data converges with
+// a client limited to its area of interest, which must then replicate the whole world to compute
+// the full digest.
+
+#include "src/blockdata.hpp"
+#include "test/simulation.hpp"
+
+#include <iostream>
+
+using namespace convergence;
+
+namespace {
+
+const double Tick = 0.02;
+const double Settle = 10.; // simulated seconds
+const float InterestRadius = 256.f;
+const size_t PositionSize = 3 * sizeof(int32_t);
+
+vec3 region(int r) { return vec3(2000.f * r, 0.f, -6.f); }
+
+// Ignores the messages introduced with the compressed format and rejects compact block data, like
+// older peers
+class Legacy final : public Terrain {
+public:
+	Legacy(sptr<MessageBus> messageBus, sptr<Store> store) : Terrain(messageBus, store, 130) {
+		setFormat(Format::Full);
+	}
+
+	void onMessage(const Message &message) {
+		if (message.type == Message::TerrainUpdate) {
+			const auto &payload = message.payload;
+			if (payload.size() < PositionSize ||
+			    !BlockData::IsLegacy(binary(payload.begin() + PositionSize, payload.end()))) {
+				++rejected;
+				return;
+			}
+			++accepted;
+		}
+		if (message.type == Message::TerrainRoot || message.type == Message::TerrainUpdate)
+			Terrain::onMessage(message);
+	}
+
+	int accepted = 0;
+	int rejected = 0; // updates an older peer would fail to decode
+};
+
+Simulation::Peer::TerrainFactory makeLegacy = [](sptr<MessageBus> messageBus, sptr<Store> store) {
+	return std::make_shared<Legacy>(messageBus, store);
+};
+
+} // namespace
+
+int main() {
+	std::ostream out(std::cout.rdbuf(nullptr)); // peers log to std::cout
+
+	Simulation simulation;
+	Simulation::Peer legacy(makeLegacy), client;
+	client.terrain->setFocus(region(0));
+	client.terrain->setInterestRadius(InterestRadius);
+
+	// The legacy peer holds edits far out of the interest of the client
+	for (int r = 0; r < 4; ++r)
+		legacy.terrain->dig(region(r), 100, 2.f);
+	client.terrain->dig(region(0) + vec3(0.f, 8.f, 0.f), 100, 2.f);
+
+	simulation.connect(*legacy.bus, *client.bus, Simulation::LinkParams());
+	legacy.terrain->broadcast();
+	client.terrain->broadcast();
+
+	double time = 0.;
+	auto settle = [&]() {
+		for (double end = time + Settle; time < end; time += Tick) {
+			simulation.run(time + Tick);
+			legacy.update(Tick);
+			client.update(Tick);
+		}
+	};
+	auto converged = [&](const char *step) {
+		const binary digest = client.terrain->rootDigest(Merkle::Format::Full);
+		const bool match = !digest.empty() && digest == legacy.terrain->rootDigest();
+		const int rejected = std::static_pointer_cast<Legacy>(legacy.terrain)->rejected;
+		out << step << ": roots " << (match ? "match" : "differ") << ", " << rejected
+		    << " updates rejected" << std::endl;
+		return match && rejected == 0;
+	};
+
+	settle();
+	if (!converged("Joined"))
+		return 1;
+
+	client.terrain->dig(region(0) + vec3(8.f, 0.f, 0.f), 100, 2.f);
+	legacy.terrain->dig(region(3) + vec3(8.f, 0.f, 0.f), 100, 2.f);
+	settle();
+	if (!converged("Concurrent edits"))
+		return 1;
+
+	// Deltas are unknown to the legacy peer, it must get the edit of the client as an update
+	if (std::static_pointer_cast<Legacy>(legacy.terrain)->accepted == 0) {
+		out << "No update received by the legacy peer" << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,110 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+// Bulk update benchmark: interior node hashes per leaf update, one update at a time versus all
+// at once, for edits clustered around a place and scattered over the world.
+// Usage: convergence-bench-merkle [updates]
+
+#include "src/merkle.hpp"
+#include "src/terrain.hpp"
+
+#include <cmath>
+#include <iostream>
+#include <random>
+
+using namespace convergence;
+
+namespace {
+
+// Plain tree without terrain behind it
+class Tree final : public Merkle {
+public:
+	Tree(shared_ptr<Store> store) : Merkle(store) {}
+
+	using Merkle::setFormat;
+	using Merkle::updateData;
+
+private:
+	bool merge(const binary &a, binary &b) { return false; }
+	bool changeData(const Index &index, const binary &data) { return true; }
+	bool propagateRoot(const binary &digest) { return true; }
+};
+
+// Only exposes the terrain index, where nearby blocks share most of their ancestors
+struct TerrainIndexes : Terrain {
+	using Terrain::TerrainIndex;
+};
+
+using Targets = std::vector<std::pair<Merkle::Index, binary>>;
+
+Targets generate(int count, bool clustered, std::mt19937 &random) {
+	// Clustered edits fill a box of blocks, like digging, scattered ones are anywhere
+	std::uniform_int_distribution<int> anywhere(-100000, 100000);
+	std::uniform_int_distribution<int> height(-1000, 1000);
+	const int side = int(std::cbrt(count)) + 1;
+	Targets targets;
+	for (int i = 0; i < count; ++i) {
+		const int3 pos = clustered ? int3(i % side, (i / side) % side, i / (side * side))
+		                           : int3(anywhere(random), anywhere(random), height(random));
+		binary data(64);
+		for (auto &b : data)
+			b = byte(random());
+		targets.emplace_back(TerrainIndexes::TerrainIndex(pos), std::move(data));
+	}
+	return targets;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+	const int count = argc > 1 ? std::stoi(argv[1]) : 256;
+
+	std::ostream out(std::cout.rdbuf(nullptr)); // the tree logs to std::cout
+
+	auto messageBus = std::make_shared<MessageBus>();
+	std::mt19937 random(count);
+	for (auto format : {Merkle::Format::Full, Merkle::Format::Compressed}) {
+		for (bool clustered : {true, false}) {
+			const Targets targets = generate(count, clustered, random);
+
+			Tree sequential(std::make_shared<Store>(messageBus));
+			sequential.setFormat(format);
+			for (const auto &[index, data] : targets)
+				sequential.updateData(index, data);
+
+			Tree bulk(std::make_shared<Store>(messageBus));
+			bulk.setFormat(format);
+			bulk.updateData(targets);
+
+			if (bulk.rootDigest() != sequential.rootDigest()) {
+				out << "Bulk and sequential updates give different roots" << std::endl;
+				return 1;
+			}
+
+			out << (format == Merkle::Format::Full ? "full" : "compressed") << " tree, "
+			    << (clustered ? "clustered" : "scattered") << ", " << count
+			    << " updates: sequential " << double(sequential.hashedNodes()) / count
+			    << ", bulk " << double(bulk.hashedNodes()) / count << " node hashes/update"
+			    << std::endl;
+		}
+	}
+
+	return 0;
+}
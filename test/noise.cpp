@@ -0,0 +1,95 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+// Checks PerlinNoise::generateGrid() against the scalar reference generate(). The lane set is
+// chosen at compile time, so this is built once per lane set.
+
+#include "pla/perlinnoise.hpp"
+
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+using namespace pla;
+
+namespace {
+
+const double MaxDivergence = 1e-5; // single precision against double
+
+const char *lanes(void) {
+#if defined(__AVX2__) && !defined(PLA_NO_SIMD)
+	return "AVX2";
+#elif defined(__SSE2__) && !defined(PLA_NO_SIMD)
+	return "SSE2";
+#else
+	return "scalar";
+#endif
+}
+
+double divergence(const PerlinNoise &perlin, const dvec3 &origin, const dvec3 &step,
+                  const ivec3 &dims, int octaves) {
+	std::vector<float> out(dims.x * dims.y * dims.z);
+	perlin.generateGrid(origin, step, dims, octaves, out.data());
+
+	double result = 0.;
+	for (int i = 0; i < dims.x; ++i)
+		for (int j = 0; j < dims.y; ++j)
+			for (int k = 0; k < dims.z; ++k) {
+				const dvec3 v = origin + dvec3(step.x * i, step.y * j, step.z * k);
+				const double expected = perlin.generate(v, octaves);
+				const double value = out[(i * dims.y + j) * dims.z + k];
+				result = std::max(result, std::abs(value - expected));
+			}
+
+	return result;
+}
+
+} // namespace
+
+int main() {
+#if defined(__AVX2__) && !defined(PLA_NO_SIMD) && (defined(__GNUC__) || defined(__clang__))
+	if (!__builtin_cpu_supports("avx2")) {
+		std::cout << "AVX2 is not supported by this CPU, skipping" << std::endl;
+		return 77;
+	}
+#endif
+
+	// Odd sizes along z exercise the scalar remainder after the SIMD lanes
+	const ivec3 sizes[] = {{8, 8, 10}, {9, 7, 21}, {1, 1, 1}, {3, 2, 8}, {2, 3, 33}};
+	const dvec3 origins[] = {{0., 0., 0.}, {-37.3, 12.8, -5.1}, {1021.7, -513.2, 254.9}};
+	const dvec3 step(0.1517, 0.1517, 0.01517);
+
+	double result = 0.;
+	for (unsigned seed : {130u, 1234u})
+		for (int octaves = 1; octaves <= 3; ++octaves) {
+			PerlinNoise perlin(seed);
+			for (const auto &dims : sizes)
+				for (const auto &origin : origins)
+					result = std::max(result, divergence(perlin, origin, step, dims, octaves));
+		}
+
+	std::cout << lanes() << " lanes: maximum divergence " << result << std::endl;
+	if (result > MaxDivergence) {
+		std::cout << "Divergence exceeds " << MaxDivergence << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
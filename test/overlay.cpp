@@ -0,0 +1,286 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+// Overlay test: peers open a few peerings to random candidates, like Networking, and every
+// broadcast must reach every peer. The overlay must then repair itself when links are cut and
+// when peers leave, with the candidates discovered from signaling, offers and broadcasts.
+// Latest-wins messages relayed between peers which are not neighbors are checked too.
+
+#include "src/candidates.hpp"
+#include "test/simulation.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <set>
+
+using namespace convergence;
+
+namespace {
+
+const int Peers = 100;
+const size_t Degree = 4;             // peerings opened, like Networking
+const size_t MaxDegree = Degree * 3; // incoming peerings are declined past this
+const double Tick = 0.05;            // seconds per update
+const int Cut = 80;                  // links cut at once
+const int Leaving = 20;              // peers leaving at once
+
+class Node final : public MessageBus::Listener {
+public:
+	Node(int i) : index(i), bus(std::make_shared<MessageBus>()), candidates(i) {}
+
+	void onPeer(const identifier &id) { candidates.add(id); }
+	void onMessage(const Message &message) { received.insert(message.source); }
+
+	const int index;
+	const sptr<MessageBus> bus;
+	Candidates candidates;
+	std::map<int, Simulation::ChannelPair> links; // by remote index
+	std::set<identifier> received; // broadcast sources
+	bool left = false;
+};
+
+class Network {
+public:
+	Network(void) {
+		for (int i = 0; i < Peers; ++i) {
+			auto node = std::make_shared<Node>(i);
+			node->bus->registerTypeListener(Message::Dummy, node);
+			mIndex[node->bus->localId()] = i;
+			mNodes.push_back(std::move(node));
+		}
+	}
+
+	// Like the signaling server, a joining peer gets the list of the others
+	void join(int count) {
+		for (int i = 0; i < count; ++i) {
+			for (int j = 0; j < i; ++j)
+				mNodes[i]->candidates.add(mNodes[j]->bus->localId());
+
+			connectCandidates(*mNodes[i]);
+			run(Tick);
+		}
+	}
+
+	void run(double duration) {
+		for (double end = mSimulation.now() + duration; mSimulation.now() < end;) {
+			mSimulation.run(mSimulation.now() + Tick);
+			for (auto &node : mNodes) {
+				if (node->left)
+					continue;
+
+				node->bus->update(Tick);
+				node->candidates.update(Tick);
+				connectCandidates(*node);
+			}
+		}
+	}
+
+	// Returns the number of peers which missed a broadcast
+	int broadcast(void) {
+		for (auto &node : mNodes)
+			node->received.clear();
+
+		for (auto &node : mNodes)
+			if (!node->left) {
+				Message message(Message::Dummy);
+				node->bus->broadcast(message);
+			}
+
+		run(2.);
+
+		std::set<identifier> sources;
+		for (auto &node : mNodes)
+			if (!node->left)
+				sources.insert(node->bus->localId());
+
+		int missed = 0;
+		for (auto &node : mNodes)
+			if (!node->left && node->received.size() + 1 < sources.size())
+				++missed;
+
+		return missed;
+	}
+
+	void cut(int count) {
+		std::vector<std::pair<int, int>> links;
+		for (auto &node : mNodes)
+			for (const auto &[remote, channels] : node->links)
+				if (node->index < remote)
+					links.emplace_back(node->index, remote);
+
+		std::shuffle(links.begin(), links.end(), mRandom);
+		for (int i = 0; i < count && i < int(links.size()); ++i)
+			disconnect(*mNodes[links[i].first], *mNodes[links[i].second]);
+	}
+
+	// All the links of a peer are cut, its neighbors might not need to replace them
+	void isolate(int i) {
+		Node &node = *mNodes[i];
+		while (!node.links.empty())
+			disconnect(node, *mNodes[node.links.begin()->first]);
+	}
+
+	void leave(int count) {
+		for (int i = 0; i < count;) {
+			Node &node = *mNodes[mRandom() % mNodes.size()];
+			if (node.left)
+				continue;
+
+			isolate(node.index);
+			node.left = true;
+			++i;
+		}
+	}
+
+	size_t links(void) const {
+		size_t count = 0;
+		for (const auto &node : mNodes)
+			count += node->links.size();
+
+		return count / 2;
+	}
+
+private:
+	// Like Networking::connectCandidates(), failed peerings are retried after a backoff
+	void connectCandidates(Node &node) {
+		if (node.links.size() >= Degree)
+			return;
+
+		std::set<identifier> connected;
+		for (const auto &[remote, channels] : node.links)
+			connected.insert(mNodes[remote]->bus->localId());
+
+		for (const auto &id : node.candidates.pick(Degree - node.links.size(), connected)) {
+			Node &remote = *mNodes[mIndex[id]];
+			if (remote.left) {
+				node.candidates.fail(id); // the offer times out
+				continue;
+			}
+
+			// The remote peer learns about this one from the offer, even if it declines
+			remote.candidates.add(node.bus->localId());
+			if (remote.links.size() >= MaxDegree) {
+				node.candidates.fail(id);
+				continue;
+			}
+
+			auto channels = mSimulation.connect(*node.bus, *remote.bus, Simulation::LinkParams());
+			node.links[remote.index] = channels;
+			remote.links[node.index] = Simulation::ChannelPair(channels.second, channels.first);
+		}
+	}
+
+	void disconnect(Node &a, Node &b) {
+		mSimulation.disconnect(*a.bus, *b.bus, a.links[b.index]);
+		a.links.erase(b.index);
+		b.links.erase(a.index);
+	}
+
+	Simulation mSimulation;
+	std::vector<sptr<Node>> mNodes;
+	std::map<identifier, int> mIndex;
+	std::mt19937 mRandom;
+};
+
+// Latest-wins messages from the end of the chain A-B-C must reach A. B relays them on its reliable
+// channel, as A only accepts the own messages of B on the unreliable one.
+bool relayLatestWins(std::ostream &out) {
+	Simulation simulation;
+	std::vector<sptr<Node>> chain;
+	for (int i = 0; i < 3; ++i) {
+		chain.push_back(std::make_shared<Node>(i));
+		for (auto type : {Message::Dummy, Message::EntityTransform, Message::EntitySnapshot})
+			chain.back()->bus->registerTypeListener(type, chain.back());
+	}
+	simulation.connect(*chain[0]->bus, *chain[1]->bus, Simulation::LinkParams());
+	simulation.connect(*chain[1]->bus, *chain[2]->bus, Simulation::LinkParams());
+
+	auto run = [&]() {
+		for (int i = 0; i < 20; ++i) {
+			simulation.run(simulation.now() + Tick);
+			for (auto &node : chain)
+				node->bus->update(Tick);
+		}
+	};
+
+	// The route from C to A is learned from a broadcast of A, once the links are up
+	run();
+	Message dummy(Message::Dummy);
+	chain[0]->bus->broadcast(dummy);
+	run();
+
+	const identifier &c = chain[2]->bus->localId();
+	bool success = true;
+	for (auto type : {Message::EntityTransform, Message::EntitySnapshot}) {
+		chain[0]->received.clear();
+		Message message(type);
+		if (type == Message::EntitySnapshot)
+			message.destination = chain[0]->bus->localId();
+
+		chain[2]->bus->send(message);
+		run();
+
+		bool received = chain[0]->received.count(c) > 0;
+		out << (type == Message::EntitySnapshot ? "Directed" : "Broadcast")
+		    << " latest-wins message relayed: " << (received ? "yes" : "no") << std::endl;
+		success &= received;
+	}
+	return success;
+}
+
+} // namespace
+
+int main() {
+	std::ostream out(std::cout.rdbuf(nullptr)); // peers log to std::cout
+
+	Network network;
+	network.join(Peers);
+	out << Peers << " peers, " << network.links() << " links" << std::endl;
+
+	int failures = 0;
+	auto check = [&](const string &step) {
+		int missed = network.broadcast();
+		out << step << ": " << missed << " peers missed broadcasts" << std::endl;
+		failures += missed > 0;
+	};
+
+	check("Flooding");
+	check("Spanning trees");
+
+	// Peers left with fewer peerings open new ones, and grafts repair the trees
+	network.cut(Cut);
+	network.run(15.);
+	check("After cutting " + std::to_string(Cut) + " links");
+
+	// The first peer joined alone and got no list, it must have discovered the others
+	network.isolate(0);
+	network.run(15.);
+	check("After isolating the first peer");
+
+	// Neighbors of leaving peers replace them, the departed candidates are retried then forgotten
+	network.leave(Leaving);
+	network.run(60.);
+	check("After " + std::to_string(Leaving) + " peers left");
+
+	failures += !relayLatestWins(out);
+
+	return failures > 0 ? 1 : 0;
+}
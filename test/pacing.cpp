@@ -0,0 +1,80 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+// Pacing test: control messages flow next to a saturated bulk queue on a rate-limited channel,
+// and the total sent must stay within the rate. Control messages don't wait for tokens, so they
+// must still be charged for, without cancelling the debt left by large bulk messages.
+
+#include "src/scheduler.hpp"
+#include "test/simulation.hpp"
+
+#include <iostream>
+
+using namespace convergence;
+
+namespace {
+
+const size_t Rate = 100 * 1000; // bytes per second
+const size_t Burst = 16 * 1024;
+const size_t BulkSize = 60 * 1024;
+const size_t ControlSize = 100;
+const double ControlPeriod = 0.05; // like entity snapshots, 20 per second
+const double Tick = 0.01;
+const double Duration = 20.;
+const double Tolerance = 1.05;
+
+} // namespace
+
+int main() {
+	Simulation simulation;
+	auto channels = simulation.link(Simulation::LinkParams());
+	Scheduler scheduler(channels.first, Rate, Burst);
+
+	const binary bulk(BulkSize);
+	const binary control(ControlSize);
+	double nextControl = 0.;
+	for (double time = 0.; time < Duration; time += Tick) {
+		// The bulk queue never runs dry
+		if (scheduler.stats().queued[Scheduler::Bulk] < 2)
+			scheduler.send(bulk.data(), bulk.size(), Scheduler::Bulk);
+
+		if (time >= nextControl) {
+			scheduler.send(control.data(), control.size(), Scheduler::Control);
+			nextControl += ControlPeriod;
+		}
+
+		scheduler.update(Tick);
+		simulation.run(time + Tick);
+	}
+
+	const auto stats = scheduler.stats();
+	const double limit = Rate * Duration + Burst + BulkSize;
+	const double sent = double(channels.first->bytes());
+	std::cout << "Sent " << sent / Duration << " bytes/s for a rate of " << Rate << " bytes/s ("
+	          << stats.sentBytes[Scheduler::Control] << " control bytes, "
+	          << stats.sentBytes[Scheduler::Bulk] << " bulk bytes)" << std::endl;
+
+	if (sent > limit * Tolerance) {
+		std::cout << "Rate exceeded" << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
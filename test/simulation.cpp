@@ -0,0 +1,255 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+#include "test/simulation.hpp"
+
+#include <algorithm>
+
+namespace convergence {
+
+Simulation::Channel::Channel(Simulation *simulation, LinkParams params)
+    : mSimulation(simulation), mParams(params) {}
+
+Simulation::Channel::~Channel(void) {}
+
+void Simulation::Channel::close(void) {
+	if (mClosed)
+		return;
+
+	mClosed = true;
+	triggerClosed();
+}
+
+bool Simulation::Channel::send(rtc::message_variant data) {
+	if (auto *b = std::get_if<binary>(&data))
+		return send(b->data(), b->size());
+
+	return false; // only binary messages are used
+}
+
+bool Simulation::Channel::send(const byte *data, size_t size) {
+	if (mClosed)
+		return false;
+
+	std::lock_guard<std::recursive_mutex> lock(mSimulation->mMutex);
+	++mMessages;
+	mBytes += size;
+
+	// Messages are serialized on the link, then delayed
+	const double now = mSimulation->mTime;
+	mLinkFree = std::max(mLinkFree, now);
+	if (mParams.bandwidth > 0.)
+		mLinkFree += size / mParams.bandwidth;
+
+	if (mParams.loss > 0. &&
+	    std::uniform_real_distribution<double>(0., 1.)(mSimulation->mRandom) < mParams.loss) {
+		++mLost;
+		return true;
+	}
+
+	weak_ptr<Channel> remote = mRemote;
+	binary copy(data, data + size);
+	mSimulation->schedule(mLinkFree - now + mParams.delay,
+	                      [remote, copy = std::move(copy)]() mutable {
+		                      if (auto channel = remote.lock())
+			                      channel->incoming(std::move(copy));
+	                      });
+	return true;
+}
+
+bool Simulation::Channel::isOpen(void) const { return !mClosed; }
+
+bool Simulation::Channel::isClosed(void) const { return mClosed; }
+
+size_t Simulation::Channel::bufferedAmount(void) const {
+	std::lock_guard<std::recursive_mutex> lock(mSimulation->mMutex);
+	const double pending = mLinkFree - mSimulation->mTime;
+	return pending > 0. ? size_t(pending * mParams.bandwidth) : 0;
+}
+
+std::optional<rtc::message_variant> Simulation::Channel::receive(void) {
+	if (mInbox.empty())
+		return std::nullopt;
+
+	auto message = std::move(mInbox.front());
+	mInbox.pop_front();
+	return message;
+}
+
+std::optional<rtc::message_variant> Simulation::Channel::peek(void) {
+	if (mInbox.empty())
+		return std::nullopt;
+
+	return mInbox.front();
+}
+
+size_t Simulation::Channel::availableAmount(void) const {
+	size_t amount = 0;
+	for (const auto &message : mInbox)
+		amount += std::get<binary>(message).size();
+
+	return amount;
+}
+
+void Simulation::Channel::resetCounters(void) {
+	mMessages = 0;
+	mBytes = 0;
+	mLost = 0;
+}
+
+void Simulation::Channel::incoming(binary data) {
+	if (mClosed)
+		return;
+
+	mInbox.emplace_back(std::move(data));
+	triggerAvailable(mInbox.size());
+}
+
+Simulation::Simulation(unsigned seed) : mRandom(seed) {}
+
+Simulation::~Simulation(void) {}
+
+double Simulation::now(void) const {
+	std::lock_guard<std::recursive_mutex> lock(mMutex);
+	return mTime;
+}
+
+void Simulation::schedule(double delay, std::function<void()> func) {
+	std::lock_guard<std::recursive_mutex> lock(mMutex);
+	mEvents.emplace(std::make_pair(mTime + std::max(delay, 0.), mCounter++), std::move(func));
+}
+
+void Simulation::run(double until) {
+	while (true) {
+		std::function<void()> func;
+		{
+			std::lock_guard<std::recursive_mutex> lock(mMutex);
+			auto it = mEvents.begin();
+			if (it == mEvents.end() || it->first.first > until)
+				break;
+
+			mTime = it->first.first;
+			func = std::move(it->second);
+			mEvents.erase(it);
+		}
+		func();
+	}
+
+	std::lock_guard<std::recursive_mutex> lock(mMutex);
+	mTime = std::max(mTime, until);
+}
+
+bool Simulation::idle(void) const {
+	std::lock_guard<std::recursive_mutex> lock(mMutex);
+	return mEvents.empty();
+}
+
+Simulation::ChannelPair Simulation::link(LinkParams params) {
+	auto first = std::make_shared<Channel>(this, params);
+	auto second = std::make_shared<Channel>(this, params);
+	first->mRemote = second;
+	second->mRemote = first;
+	return ChannelPair(first, second);
+}
+
+Simulation::ChannelPair Simulation::connect(MessageBus &a, MessageBus &b, LinkParams params) {
+	// Wired like a peering: routes are only learned from broadcasts, and latest-wins messages go
+	// on a separate unreliable channel
+	auto channels = link(params);
+	a.addChannel(channels.first, MessageBus::Priority::Relay);
+	b.addChannel(channels.second, MessageBus::Priority::Relay);
+	a.addRoute(b.localId(), channels.first, MessageBus::Priority::Direct);
+	b.addRoute(a.localId(), channels.second, MessageBus::Priority::Direct);
+
+	auto entities = link(params);
+	a.addUnreliableChannel(b.localId(), entities.first);
+	b.addUnreliableChannel(a.localId(), entities.second);
+
+	// Like a peering, a listener for the remote peer makes it part of peers()
+	auto remoteA = std::make_shared<Remote>();
+	auto remoteB = std::make_shared<Remote>();
+	a.registerListener(b.localId(), remoteA);
+	b.registerListener(a.localId(), remoteB);
+
+	// Like the signaling server, a list makes each bus notify its listeners of the other peer
+	Message list(Message::List);
+	list.payload = b.localId();
+	channels.second->send(binary(list));
+	list.payload = a.localId();
+	channels.first->send(binary(list));
+
+	std::lock_guard<std::recursive_mutex> lock(mMutex);
+	mRemotes[std::make_pair(a.localId(), b.localId())] = remoteA;
+	mRemotes[std::make_pair(b.localId(), a.localId())] = remoteB;
+	mEntityChannels[std::make_pair(a.localId(), b.localId())] = entities.first;
+	mEntityChannels[std::make_pair(b.localId(), a.localId())] = entities.second;
+	return channels;
+}
+
+void Simulation::disconnect(MessageBus &a, MessageBus &b, const ChannelPair &channels) {
+	a.removeChannel(channels.first);
+	b.removeChannel(channels.second);
+	channels.first->close();
+	channels.second->close();
+
+	std::lock_guard<std::recursive_mutex> lock(mMutex);
+	for (auto [local, remote] : {std::make_pair(&a, &b), std::make_pair(&b, &a)}) {
+		auto key = std::make_pair(local->localId(), remote->localId());
+		if (auto it = mEntityChannels.find(key); it != mEntityChannels.end()) {
+			local->removeChannel(it->second);
+			it->second->close();
+			mEntityChannels.erase(it);
+		}
+		mRemotes.erase(key);
+	}
+}
+
+Simulation::Peer::Peer(uptr<Store::Backend> backend, int seed)
+    : Peer(
+          [seed](sptr<MessageBus> bus, sptr<Store> store) {
+	          return std::make_shared<Terrain>(bus, store, seed);
+          },
+          std::move(backend)) {}
+
+Simulation::Peer::Peer(TerrainFactory makeTerrain, uptr<Store::Backend> backend)
+    : bus(std::make_shared<MessageBus>()),
+      store(std::make_shared<Store>(bus, std::move(backend))), terrain(makeTerrain(bus, store)) {
+	bus->registerTypeListener(Message::Store, store);
+	bus->registerTypeListener(Message::Request, store);
+	bus->registerTypeListener(Message::StoreBatch, store);
+	bus->registerTypeListener(Message::RequestBatch, store);
+
+	bus->registerTypeListener(Message::TerrainRoot, terrain);
+	bus->registerTypeListener(Message::TerrainUpdate, terrain);
+	bus->registerTypeListener(Message::TerrainCompressedRoot, terrain);
+	bus->registerTypeListener(Message::TerrainDelta, terrain);
+	bus->registerTypeListener(Message::TerrainSnapshotRequest, terrain);
+	bus->registerTypeListener(Message::TerrainSnapshot, terrain);
+}
+
+Simulation::Peer::~Peer(void) {}
+
+void Simulation::Peer::update(double time) {
+	terrain->update(time);
+	store->update(time);
+	bus->update(time);
+}
+
+} // namespace convergence
@@ -0,0 +1,137 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+#ifndef CONVERGENCE_SIMULATION_H
+#define CONVERGENCE_SIMULATION_H
+
+#include "src/include.hpp"
+#include "src/messagebus.hpp"
+#include "src/store.hpp"
+#include "src/terrain.hpp"
+
+#include "rtc/channel.hpp"
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <random>
+#include <vector>
+
+namespace convergence {
+
+// Discrete-event simulation of peers linked in-process, for tests and benchmarks. Time only
+// advances with run(), so results do not depend on the speed of the machine.
+class Simulation {
+public:
+	struct LinkParams {
+		double delay = 0.01;    // one-way, in seconds
+		double bandwidth = 0.;  // bytes per second, 0 for unlimited
+		double loss = 0.;       // probability to drop a message
+	};
+
+	class Channel final : public rtc::Channel {
+	public:
+		Channel(Simulation *simulation, LinkParams params);
+		~Channel(void);
+
+		void close(void) override;
+		bool send(rtc::message_variant data) override;
+		bool send(const byte *data, size_t size) override;
+		bool isOpen(void) const override;
+		bool isClosed(void) const override;
+		size_t bufferedAmount(void) const override;
+
+		std::optional<rtc::message_variant> receive(void) override;
+		std::optional<rtc::message_variant> peek(void) override;
+		size_t availableAmount(void) const override;
+
+		size_t messages(void) const { return mMessages; } // sent, including lost ones
+		size_t bytes(void) const { return mBytes; }
+		size_t lost(void) const { return mLost; }
+		void resetCounters(void);
+
+	private:
+		void incoming(binary data);
+
+		Simulation *const mSimulation;
+		const LinkParams mParams;
+		weak_ptr<Channel> mRemote;
+		std::deque<rtc::message_variant> mInbox;
+		double mLinkFree = 0.; // time when the link has sent everything queued
+		bool mClosed = false;
+		size_t mMessages = 0;
+		size_t mBytes = 0;
+		size_t mLost = 0;
+
+		friend class Simulation;
+	};
+
+	using ChannelPair = std::pair<shared_ptr<Channel>, shared_ptr<Channel>>;
+
+	Simulation(unsigned seed = 0);
+	~Simulation(void);
+
+	double now(void) const;
+	void schedule(double delay, std::function<void()> func);
+	void run(double until); // runs the events up to the time
+	bool idle(void) const;  // no events left
+
+	ChannelPair link(LinkParams params);
+
+	// Links the two buses like a peering, with a reliable and an unreliable channel. Messages sent
+	// before running are delivered first.
+	ChannelPair connect(MessageBus &a, MessageBus &b, LinkParams params);
+	void disconnect(MessageBus &a, MessageBus &b, const ChannelPair &channels);
+
+	// Store and terrain wired like in the world, updated like World::update()
+	class Peer {
+	public:
+		using TerrainFactory = std::function<sptr<Terrain>(sptr<MessageBus>, sptr<Store>)>;
+
+		Peer(uptr<Store::Backend> backend = nullptr, int seed = 130);
+		Peer(TerrainFactory makeTerrain, uptr<Store::Backend> backend = nullptr);
+		~Peer(void);
+
+		void update(double time);
+
+		const sptr<MessageBus> bus;
+		const sptr<Store> store;
+		const sptr<Terrain> terrain;
+	};
+
+private:
+	class Remote final : public MessageBus::Listener {
+	public:
+		void onMessage(const Message &message) {}
+	};
+
+	double mTime = 0.;
+	uint64_t mCounter = 0; // keeps events at the same time in order
+	std::multimap<std::pair<double, uint64_t>, std::function<void()>> mEvents;
+	std::map<std::pair<identifier, identifier>, sptr<Remote>> mRemotes; // local, remote
+	std::map<std::pair<identifier, identifier>, sptr<Channel>> mEntityChannels;
+	std::mt19937 mRandom;
+	mutable std::recursive_mutex mMutex;
+};
+
+} // namespace convergence
+
+#endif
@@ -0,0 +1,120 @@
+/***************************************************************************
+ *   Copyright (C) 2017-2020 by Paul-Louis Ageneau                         *
+ *   paul-louis (at) ageneau (dot) org                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.           *
+ ***************************************************************************/
+
+// Startup benchmark: time for a peer to resolve the whole terrain root, cold by fetching it from
+// another peer, then warm by reopening its persistent store.
+// Usage: convergence-bench-startup [digs] [store path]
+
+#include "src/logbackend.hpp"
+#include "test/simulation.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+
+using namespace convergence;
+
+namespace {
+
+const double Tick = 0.02;        // seconds per update, like the network tick
+const double MaxDuration = 600.; // simulated seconds
+
+bool isResolved(const Terrain &terrain, const binary &digest) {
+	auto root = terrain.root();
+	return root && root->digest() == digest && root->isResolved();
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+	const int digs = argc > 1 ? std::stoi(argv[1]) : 20000;
+	const string path = argc > 2 ? argv[2] : "convergence-bench-startup.log";
+	std::remove(path.c_str());
+	std::remove((path + ".idx").c_str());
+
+	std::ostream out(std::cout.rdbuf(nullptr)); // peers log to std::cout
+
+	Simulation simulation;
+	Simulation::LinkParams params;
+	params.delay = 0.02;             // one-way
+	params.bandwidth = 20e6 / 8;     // 20 Mbit/s
+
+	// Tunnel through the terrain, each dig modifies a few blocks
+	Simulation::Peer source;
+	for (int i = 0; i < digs; ++i)
+		source.terrain->dig(vec3((i % 500) * 2.f, (i / 500) * 12.f, -6.f), 80, 3.f);
+	source.update(Tick);
+
+	const binary target = source.terrain->rootDigest();
+	out << digs << " digs" << std::endl;
+
+	{
+		Simulation::Peer joiner(std::make_unique<LogBackend>(path));
+		auto channels = simulation.connect(*source.bus, *joiner.bus, params);
+
+		const auto start = std::chrono::steady_clock::now();
+		double time = 0.;
+		while (!isResolved(*joiner.terrain, target) && time < MaxDuration) {
+			time += Tick;
+			simulation.run(time);
+			source.update(Tick);
+			joiner.update(Tick);
+		}
+		const double wall =
+		    std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		if (!isResolved(*joiner.terrain, target)) {
+			out << "Cold startup did not resolve the root" << std::endl;
+			return 1;
+		}
+
+		out << "cold: resolved after " << time << " s simulated (" << wall << " s wall), "
+		    << channels.second->messages() << " messages and " << channels.second->bytes()
+		    << " bytes sent, " << channels.first->messages() << " messages and "
+		    << channels.first->bytes() << " bytes received" << std::endl;
+
+		simulation.disconnect(*source.bus, *joiner.bus, channels);
+	}
+
+	{
+		// No channel at all, everything must come from the store
+		const auto start = std::chrono::steady_clock::now();
+		Simulation::Peer joiner(std::make_unique<LogBackend>(path));
+		int ticks = 0;
+		while (!isResolved(*joiner.terrain, target) && ticks * Tick < MaxDuration) {
+			++ticks;
+			joiner.update(Tick);
+		}
+		const double wall =
+		    std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		if (!isResolved(*joiner.terrain, target)) {
+			out << "Warm startup did not resolve the root" << std::endl;
+			return 1;
+		}
+
+		out << "warm: resolved after " << ticks << " updates (" << wall
+		    << " s wall), 0 messages" << std::endl;
+	}
+
+	std::remove(path.c_str());
+	std::remove((path + ".idx").c_str());
+	return 0;
+}